@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * libbgpq4: expand IRR objects and render router filters in process,
+ * without running bgpq4(8) and parsing its output.
+ *
+ *	struct bgpq4	*q;
+ *	char		*buf;
+ *	size_t		 len;
+ *
+ *	q = bgpq4_new(AF_INET);
+ *	bgpq4_set_output(q, BGPQ4_VENDOR_JUNIPER, BGPQ4_LIST_EACL);
+ *	bgpq4_add(q, "AS-EXAMPLE");
+ *	if (bgpq4_expand(q, -1) && bgpq4_render(q, &buf, &len))
+ *		...
+ *	bgpq4_free(q);
+ *
+ * Functions returning int return 1 on success and 0 on failure, after
+ * reporting the failure on standard error as bgpq4(8) would; running out
+ * of memory and answers IRRd should never send still end the process.
+ * Handles share no state and can be used from different threads, one
+ * thread per handle.  A server closing the connection never raises
+ * SIGPIPE.  The values of the enums below are part of the ABI and are
+ * never renumbered.
+ */
+
+#ifndef BGPQ4_H
+#define BGPQ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BGPQ4_API_VERSION	1
+
+struct bgpq4;
+
+/* the output formats, as the bgpq4(8) options in the comments */
+enum bgpq4_vendor {
+	BGPQ4_VENDOR_CISCO = 0,		/* default */
+	BGPQ4_VENDOR_JUNIPER = 1,	/* -J */
+	BGPQ4_VENDOR_CISCO_XR = 2,	/* -X */
+	BGPQ4_VENDOR_JSON = 3,		/* -j */
+	BGPQ4_VENDOR_BIRD = 4,		/* -b */
+	BGPQ4_VENDOR_OPENBGPD = 5,	/* -B */
+	BGPQ4_VENDOR_FORMAT = 6,	/* -F, see bgpq4_set_format() */
+	BGPQ4_VENDOR_NOKIA = 7,		/* -N */
+	BGPQ4_VENDOR_HUAWEI = 8,	/* -U */
+	BGPQ4_VENDOR_HUAWEI_XPL = 9,	/* -u */
+	BGPQ4_VENDOR_MIKROTIK6 = 10,	/* -K */
+	BGPQ4_VENDOR_MIKROTIK7 = 11,	/* -K7 */
+	BGPQ4_VENDOR_NOKIA_MD = 12,	/* -n */
+	BGPQ4_VENDOR_ARISTA = 13,	/* -e */
+	BGPQ4_VENDOR_NOKIA_SRL = 14,	/* -n2 */
+	BGPQ4_VENDOR_BINARY = 15	/* -Y */
+};
+
+/* what to generate */
+enum bgpq4_list {
+	BGPQ4_LIST_PREFIX = 0,		/* default */
+	BGPQ4_LIST_EACL = 1,		/* -E */
+	BGPQ4_LIST_ROUTE_FILTER = 2,	/* -z */
+	BGPQ4_LIST_ASPATH = 3,		/* -f asn */
+	BGPQ4_LIST_OASPATH = 4,		/* -G asn */
+	BGPQ4_LIST_ASLIST = 5,		/* -H asn */
+	BGPQ4_LIST_ASSET = 6		/* -t */
+};
+
+/* an entry of the expanded prefix list */
+struct bgpq4_prefix {
+	int		 family;	/* AF_INET or AF_INET6 */
+	unsigned int	 len;
+	unsigned int	 ge, le;	/* accepted lengths, len and len if exact */
+	unsigned char	 addr[16];	/* IPv4 in the first 4 bytes */
+};
+
+struct bgpq4	*bgpq4_new(int af);
+void		 bgpq4_free(struct bgpq4 *q);
+
+int		 bgpq4_add_server(struct bgpq4 *q, const char *server);
+int		 bgpq4_set_sources(struct bgpq4 *q, const char *sources);
+int		 bgpq4_set_name(struct bgpq4 *q, const char *name);
+int		 bgpq4_set_output(struct bgpq4 *q, enum bgpq4_vendor vendor,
+		    enum bgpq4_list list);
+int		 bgpq4_set_format(struct bgpq4 *q, const char *format);
+int		 bgpq4_set_asn(struct bgpq4 *q, uint32_t asn);
+int		 bgpq4_set_aggregate(struct bgpq4 *q, int aggregate);
+int		 bgpq4_set_maxlen(struct bgpq4 *q, unsigned int maxlen);
+
+int		 bgpq4_add(struct bgpq4 *q, const char *object);
+int		 bgpq4_add_except(struct bgpq4 *q, const char *object);
+
+int		 bgpq4_expand(struct bgpq4 *q, int fd);
+
+int		 bgpq4_render(struct bgpq4 *q, char **buf, size_t *len);
+void		 bgpq4_foreach_prefix(struct bgpq4 *q,
+		    void (*cb)(const struct bgpq4_prefix *, void *), void *arg);
+void		 bgpq4_foreach_asn(struct bgpq4 *q,
+		    void (*cb)(uint32_t, void *), void *arg);
+
+#endif /* BGPQ4_H */
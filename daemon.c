@@ -0,0 +1,767 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Daemon mode (-k): serve command lines received on a Unix socket.
+ *
+ * Every request runs in a forked child through the same code path as a
+ * command line invocation, so each one gets a fresh bgpq_expander and
+ * fatal errors end only that request. The parent keeps a connection to
+ * the default IRRd open in advance and hands it to the next child, and
+ * caches successful responses for a while.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+extern int debug_expander;
+
+#define DAEMON_SESSIONS		32	/* requests served at once */
+#define DAEMON_CACHED		1024	/* responses kept in the cache */
+#define DAEMON_IRRD_IDLE	60	/* seconds a spare connection is kept */
+
+struct response {
+	RB_ENTRY(response)	 entry;
+	TAILQ_ENTRY(response)	 age;
+	char			*req;
+	size_t			 reqlen;
+	char			*data;
+	size_t			 len;
+	time_t			 expires;
+};
+
+struct session {
+	LIST_ENTRY(session)	 entry;
+	int			 fd;
+	int			 out, err;
+	pid_t			 pid;
+	unsigned char		 reqhdr[4];	/* the length of req */
+	size_t			 reqhdrlen;
+	char			 req[BGPQ4_DAEMON_MAXREQ];
+	size_t			 reqlen, reqwant;
+	int			 started, done;
+	int			 uncached;	/* reads files, see refused */
+	char			*buf;
+	size_t			 len, size, sent;
+};
+
+static int
+response_cmp(struct response *a, struct response *b)
+{
+	if (a->reqlen != b->reqlen)
+		return a->reqlen < b->reqlen ? -1 : 1;
+
+	return memcmp(a->req, b->req, a->reqlen);
+}
+
+static RB_HEAD(responses, response) cache = RB_INITIALIZER(&cache);
+RB_GENERATE_STATIC(responses, response, entry, response_cmp);
+
+static TAILQ_HEAD(, response) cacheage = TAILQ_HEAD_INITIALIZER(cacheage);
+static unsigned int ncached;
+
+static LIST_HEAD(, session) sessions = LIST_HEAD_INITIALIZER(sessions);
+static unsigned int nsessions;
+
+static const char	*irrdhosts, *irrdserver, *irrdport;
+static int		 irrdfd = -1, irrdtimeout;
+static time_t		 irrdtime;
+
+/* the connection a child was given, until main() asks for it */
+static int		 handover = -1;
+
+static void
+response_free(struct response *r)
+{
+	RB_REMOVE(responses, &cache, r);
+	TAILQ_REMOVE(&cacheage, r, age);
+	ncached--;
+	free(r->req);
+	free(r->data);
+	free(r);
+}
+
+static struct response *
+cache_lookup(const char *req, size_t reqlen)
+{
+	struct response	 find, *r;
+	time_t		 now = time(NULL);
+
+	/* all entries live equally long, the oldest expire first */
+	while ((r = TAILQ_FIRST(&cacheage)) != NULL && r->expires <= now)
+		response_free(r);
+
+	find.req = (char *)req;
+	find.reqlen = reqlen;
+
+	return RB_FIND(responses, &cache, &find);
+}
+
+static void
+cache_insert(struct session *s, int ttl)
+{
+	struct response	*r;
+
+	if (ttl == 0 || s->uncached || cache_lookup(s->req, s->reqlen) != NULL)
+		return;
+
+	if (ncached >= DAEMON_CACHED)
+		response_free(TAILQ_FIRST(&cacheage));
+
+	if ((r = calloc(1, sizeof(struct response))) == NULL)
+		err(1, NULL);
+	if ((r->req = malloc(s->reqlen)) == NULL)
+		err(1, NULL);
+	if ((r->data = malloc(s->len)) == NULL)
+		err(1, NULL);
+
+	memcpy(r->req, s->req, s->reqlen);
+	r->reqlen = s->reqlen;
+	memcpy(r->data, s->buf, s->len);
+	r->len = s->len;
+	r->expires = time(NULL) + ttl;
+
+	RB_INSERT(responses, &cache, r);
+	TAILQ_INSERT_TAIL(&cacheage, r, age);
+	ncached++;
+}
+
+static void
+frame_append(struct session *s, int type, const void *data, size_t len)
+{
+	unsigned char	*c;
+
+	if (s->len + 5 + len > s->size) {
+		size_t	size = s->size ? s->size : 16384;
+
+		while (size < s->len + 5 + len)
+			size *= 2;
+		if ((c = realloc(s->buf, size)) == NULL)
+			err(1, NULL);
+		s->buf = (char *)c;
+		s->size = size;
+	}
+
+	c = (unsigned char *)s->buf + s->len;
+	c[0] = type;
+	c[1] = len >> 24;
+	c[2] = len >> 16;
+	c[3] = len >> 8;
+	c[4] = len;
+	memcpy(c + 5, data, len);
+	s->len += 5 + len;
+}
+
+static void
+frame_exit(struct session *s, int status)
+{
+	unsigned char	code[4];
+
+	code[0] = status >> 24;
+	code[1] = status >> 16;
+	code[2] = status >> 8;
+	code[3] = status;
+
+	frame_append(s, BGPQ4_DAEMON_EXIT, code, sizeof(code));
+	s->done = 1;
+}
+
+/*
+ * Keep a connection to the first default IRRd ready for the next request.
+ * An idle connection must not be readable: data or end of file there
+ * means the server gave up on it.
+ */
+static void
+irrd_warm(void)
+{
+	struct pollfd	pfd;
+
+	if (irrdfd != -1) {
+		pfd.fd = irrdfd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 0
+		    && time(NULL) - irrdtime < DAEMON_IRRD_IDLE)
+			return;
+		SX_DEBUG(debug_expander, "daemon: dropping idle connection to "
+		    "%s\n", irrdserver);
+		close(irrdfd);
+	}
+
+	irrdfd = bgpq_connect(irrdserver, irrdport, 1, irrdtimeout);
+	irrdtime = time(NULL);
+}
+
+int
+bgpq4_daemon_irrd(const char *server, const char *port)
+{
+	int	fd = handover;
+
+	if (fd == -1)
+		return -1;
+
+	handover = -1;
+	if (strcmp(server, irrdserver) != 0 || strcmp(port, irrdport) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+session_run(struct session *s, int lfd, int (*run)(int, char **))
+{
+	struct session	*o;
+	char		**argv, *c;
+	int		 argc = 0, out[2], errp[2];
+
+	if (pipe(out) == -1) {
+		sx_report(SX_ERROR, "daemon: pipe: %s\n", strerror(errno));
+		frame_exit(s, 1);
+		return;
+	}
+	if (pipe(errp) == -1) {
+		sx_report(SX_ERROR, "daemon: pipe: %s\n", strerror(errno));
+		close(out[0]);
+		close(out[1]);
+		frame_exit(s, 1);
+		return;
+	}
+
+	irrd_warm();
+
+	if ((s->pid = fork()) == -1) {
+		sx_report(SX_ERROR, "daemon: fork: %s\n", strerror(errno));
+		close(out[0]);
+		close(out[1]);
+		close(errp[0]);
+		close(errp[1]);
+		frame_exit(s, 1);
+		return;
+	}
+
+	if (s->pid == 0) {
+		signal(SIGPIPE, SIG_DFL);
+		close(lfd);
+		LIST_FOREACH(o, &sessions, entry) {
+			if (o->fd != -1)
+				close(o->fd);
+			if (o->out != -1)
+				close(o->out);
+			if (o->err != -1)
+				close(o->err);
+		}
+		close(out[0]);
+		close(errp[0]);
+		if (dup2(out[1], STDOUT_FILENO) == -1
+		    || dup2(errp[1], STDERR_FILENO) == -1)
+			_exit(1);
+		close(out[1]);
+		close(errp[1]);
+
+		handover = irrdfd;
+
+		/*
+		 * The daemon's servers are the default, a -h in the request
+		 * comes later and overrides them.
+		 */
+		if ((argv = calloc(s->reqlen + 4, sizeof(char *))) == NULL)
+			_exit(1);
+		if (irrdhosts != NULL) {
+			if ((c = strdup(irrdhosts)) == NULL)
+				_exit(1);
+		} else if (asprintf(&c, "%s:%s", irrdserver, irrdport) == -1)
+			_exit(1);
+		argv[argc++] = "bgpq4";
+		argv[argc++] = "-h";
+		argv[argc++] = c;
+		for (c = s->req; c < s->req + s->reqlen; c += strlen(c) + 1)
+			argv[argc++] = c;
+		argv[argc] = NULL;
+
+#ifdef __GLIBC__
+		optind = 0;
+#else
+		optreset = 1;
+		optind = 1;
+#endif
+		exit(run(argc, argv));
+	}
+
+	close(out[1]);
+	close(errp[1]);
+	s->out = out[0];
+	s->err = errp[0];
+
+	/* the child owns the connection now, open the next one */
+	if (irrdfd != -1) {
+		close(irrdfd);
+		irrdfd = -1;
+	}
+	irrd_warm();
+}
+
+/*
+ * Options a request can't use: those starting a daemon or talking to one,
+ * and those writing files, which would be written with the daemon's
+ * rights and skipped when the response comes from the cache. The files
+ * read by the options in uncached may change at any time, so responses
+ * to requests using them are not cached.
+ */
+static const char	 refused[] = "CgkOoxZ";
+static const char	 uncached[] = "cIy";
+
+static int
+session_allowed(struct session *s)
+{
+	char	**argv, *c, msg[64];
+	int	  argc = 0, ch, ok = 1;
+
+	if ((argv = calloc(s->reqlen + 2, sizeof(char *))) == NULL)
+		err(1, NULL);
+	argv[argc++] = "bgpq4";
+	for (c = s->req; c < s->req + s->reqlen; c += strlen(c) + 1)
+		argv[argc++] = c;
+	argv[argc] = NULL;
+
+	/* unknown options are for the request to report */
+	opterr = 0;
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optreset = 1;
+	optind = 1;
+#endif
+	while ((ch = getopt(argc, argv, bgpq4_optstring)) != -1) {
+		if (ch != '?' && strchr(refused, ch) != NULL) {
+			snprintf(msg, sizeof(msg), "FATAL ERROR:-%c can't be "
+			    "used through the daemon (-x)\n", ch);
+			frame_append(s, BGPQ4_DAEMON_STDERR, msg, strlen(msg));
+			frame_exit(s, 1);
+			ok = 0;
+			break;
+		}
+		if (ch != '?' && strchr(uncached, ch) != NULL)
+			s->uncached = 1;
+	}
+
+	free(argv);
+
+	return ok;
+}
+
+/* Read what is there of the request, returns 0 when the client is gone. */
+static int
+session_fill(struct session *s, void *buf, size_t len, size_t *have)
+{
+	ssize_t	 n;
+
+	if (*have == len)
+		return 1;
+
+	n = read(s->fd, (char *)buf + *have, len - *have);
+	if (n == -1 && errno == EAGAIN)
+		return 1;
+	if (n <= 0) {
+		close(s->fd);
+		s->fd = -1;
+		s->done = 1;
+		return 0;
+	}
+	*have += n;
+
+	return 1;
+}
+
+static void
+session_request(struct session *s, int lfd, int ttl, int (*run)(int, char **))
+{
+	struct response	*r;
+
+	/* a 4 byte length, then the arguments, each NUL terminated */
+	if (s->reqhdrlen < sizeof(s->reqhdr)) {
+		if (!session_fill(s, s->reqhdr, sizeof(s->reqhdr),
+		    &s->reqhdrlen) || s->reqhdrlen < sizeof(s->reqhdr))
+			return;
+		s->reqwant = (size_t)s->reqhdr[0] << 24 | s->reqhdr[1] << 16 |
+		    s->reqhdr[2] << 8 | s->reqhdr[3];
+		if (s->reqwant > sizeof(s->req)) {
+			sx_report(SX_ERROR, "daemon: request too long\n");
+			close(s->fd);
+			s->fd = -1;
+			s->done = 1;
+			return;
+		}
+	}
+
+	if (!session_fill(s, s->req, s->reqwant, &s->reqlen)
+	    || s->reqlen < s->reqwant)
+		return;
+
+	if (s->reqlen > 0 && s->req[s->reqlen - 1] != '\0') {
+		sx_report(SX_ERROR, "daemon: malformed request\n");
+		close(s->fd);
+		s->fd = -1;
+		s->done = 1;
+		return;
+	}
+
+	s->started = 1;
+
+	if (!session_allowed(s))
+		return;
+
+	if (ttl && !s->uncached
+	    && (r = cache_lookup(s->req, s->reqlen)) != NULL) {
+		SX_DEBUG(debug_expander, "daemon: cached response, %zu "
+		    "bytes\n", r->len);
+		if ((s->buf = malloc(r->len)) == NULL)
+			err(1, NULL);
+		memcpy(s->buf, r->data, r->len);
+		s->len = s->size = r->len;
+		s->done = 1;
+		return;
+	}
+
+	session_run(s, lfd, run);
+}
+
+static void
+session_read(struct session *s, int *fd, int type, int ttl)
+{
+	char	buf[16384];
+	ssize_t	n;
+	int	status;
+
+	if ((n = read(*fd, buf, sizeof(buf))) > 0) {
+		frame_append(s, type, buf, n);
+		return;
+	}
+	if (n == -1 && errno == EAGAIN)
+		return;
+
+	close(*fd);
+	*fd = -1;
+
+	if (s->out != -1 || s->err != -1)
+		return;
+
+	if (waitpid(s->pid, &status, 0) == -1)
+		status = 1;
+	else if (WIFEXITED(status))
+		status = WEXITSTATUS(status);
+	else
+		status = 128 + WTERMSIG(status);
+
+	frame_exit(s, status);
+	if (status == 0)
+		cache_insert(s, ttl);
+}
+
+static void
+session_write(struct session *s)
+{
+	ssize_t	n;
+
+	n = write(s->fd, s->buf + s->sent, s->len - s->sent);
+	if (n == -1) {
+		if (errno == EAGAIN)
+			return;
+		/* client went away, let the request finish for the cache */
+		close(s->fd);
+		s->fd = -1;
+		return;
+	}
+	s->sent += n;
+}
+
+static int
+daemon_listen(const char *path)
+{
+	struct sockaddr_un	 sun;
+	struct stat		 st;
+	mode_t			 mask;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path))
+	    >= sizeof(sun.sun_path)) {
+		sx_report(SX_FATAL, "Socket path too long: %s\n", path);
+		exit(1);
+	}
+
+	/* a socket left over by a previous daemon */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+
+	/*
+	 * Requests read files and use the IRRd connection with the daemon's
+	 * rights: only its own user may connect.
+	 */
+	mask = umask(077);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	umask(mask);
+	if (chmod(path, 0600) == -1)
+		err(1, "chmod %s", path);
+	if (listen(fd, 64) == -1)
+		err(1, "listen %s", path);
+
+	return fd;
+}
+
+int
+bgpq4_daemon(const char *path, const char *hosts, const char *server,
+    const char *port, int ttl, int ctimeout, int (*run)(int, char **))
+{
+	struct pollfd	 pfd[1 + 3 * DAEMON_SESSIONS];
+	struct session	*s, *sn, *owner[1 + 3 * DAEMON_SESSIONS];
+	int		 lfd, fd, n, i;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = daemon_listen(path);
+
+	irrdhosts = hosts;
+	irrdserver = server;
+	irrdport = port;
+	irrdtimeout = ctimeout;
+	irrd_warm();
+
+	SX_DEBUG(debug_expander, "daemon: listening on %s\n", path);
+
+	for (;;) {
+		n = 0;
+		if (nsessions < DAEMON_SESSIONS) {
+			pfd[n].fd = lfd;
+			pfd[n].events = POLLIN;
+			owner[n++] = NULL;
+		}
+		LIST_FOREACH(s, &sessions, entry) {
+			if (!s->started) {
+				pfd[n].fd = s->fd;
+				pfd[n].events = POLLIN;
+				owner[n++] = s;
+				continue;
+			}
+			if (s->out != -1) {
+				pfd[n].fd = s->out;
+				pfd[n].events = POLLIN;
+				owner[n++] = s;
+			}
+			if (s->err != -1) {
+				pfd[n].fd = s->err;
+				pfd[n].events = POLLIN;
+				owner[n++] = s;
+			}
+			if (s->fd != -1 && s->sent < s->len) {
+				pfd[n].fd = s->fd;
+				pfd[n].events = POLLOUT;
+				owner[n++] = s;
+			}
+		}
+
+		if (poll(pfd, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		for (i = 0; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			s = owner[i];
+			if (s == NULL) {
+				if ((fd = accept(lfd, NULL, NULL)) == -1)
+					continue;
+				fcntl(fd, F_SETFL, O_NONBLOCK |
+				    fcntl(fd, F_GETFL));
+				if ((s = calloc(1, sizeof(struct session)))
+				    == NULL)
+					err(1, NULL);
+				s->fd = fd;
+				s->out = s->err = -1;
+				LIST_INSERT_HEAD(&sessions, s, entry);
+				nsessions++;
+			} else if (!s->started) {
+				if (s->fd != -1)
+					session_request(s, lfd, ttl, run);
+			} else if (pfd[i].fd == s->out) {
+				session_read(s, &s->out, BGPQ4_DAEMON_STDOUT,
+				    ttl);
+			} else if (pfd[i].fd == s->err) {
+				session_read(s, &s->err, BGPQ4_DAEMON_STDERR,
+				    ttl);
+			} else if (pfd[i].fd == s->fd) {
+				session_write(s);
+			}
+		}
+
+		LIST_FOREACH_SAFE(s, &sessions, entry, sn) {
+			if (!s->done || (s->fd != -1 && s->sent < s->len))
+				continue;
+			if (s->fd != -1)
+				close(s->fd);
+			LIST_REMOVE(s, entry);
+			nsessions--;
+			free(s->buf);
+			free(s);
+		}
+	}
+
+	return 0;
+}
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+	char	*c = buf;
+	ssize_t	 n;
+
+	while (len > 0) {
+		if ((n = read(fd, c, len)) <= 0)
+			return 0;
+		c += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+/*
+ * Client side of -k: send the arguments to the daemon listening on path
+ * and copy its output back as if the command had run here.
+ */
+int
+bgpq4_client(const char *path, int argc, char *argv[])
+{
+	struct sockaddr_un	 sun;
+	unsigned char		 hdr[5];
+	char			*req, *buf = NULL;
+	size_t			 len = 0, off = 4, size = 0, flen;
+	int			 fd, i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	if (len > BGPQ4_DAEMON_MAXREQ) {
+		sx_report(SX_FATAL, "Request too long for the daemon\n");
+		exit(1);
+	}
+	if ((req = malloc(4 + len)) == NULL)
+		err(1, NULL);
+	req[0] = len >> 24;
+	req[1] = len >> 16;
+	req[2] = len >> 8;
+	req[3] = len;
+	for (i = 0; i < argc; i++) {
+		memcpy(req + off, argv[i], strlen(argv[i]) + 1);
+		off += strlen(argv[i]) + 1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path))
+	    >= sizeof(sun.sun_path)) {
+		sx_report(SX_FATAL, "Socket path too long: %s\n", path);
+		exit(1);
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		sx_report(SX_ERROR, "Unable to connect to %s: %s\n", path,
+		    strerror(errno));
+		exit(1);
+	}
+	if (write(fd, req, off) != (ssize_t)off) {
+		sx_report(SX_ERROR, "Unable to send request to %s: %s\n", path,
+		    strerror(errno));
+		exit(1);
+	}
+	free(req);
+
+	while (readall(fd, hdr, sizeof(hdr))) {
+		flen = (size_t)hdr[1] << 24 | hdr[2] << 16 | hdr[3] << 8 |
+		    hdr[4];
+		if (flen > size) {
+			if ((buf = realloc(buf, flen)) == NULL)
+				err(1, NULL);
+			size = flen;
+		}
+		if (!readall(fd, buf, flen))
+			break;
+
+		switch (hdr[0]) {
+		case BGPQ4_DAEMON_STDOUT:
+			fwrite(buf, 1, flen, stdout);
+			break;
+		case BGPQ4_DAEMON_STDERR:
+			fflush(stdout);
+			fwrite(buf, 1, flen, stderr);
+			break;
+		case BGPQ4_DAEMON_EXIT:
+			if (flen != 4)
+				goto broken;
+			close(fd);
+			i = buf[0] << 24 | (unsigned char)buf[1] << 16 |
+			    (unsigned char)buf[2] << 8 | (unsigned char)buf[3];
+			free(buf);
+			return i;
+		default:
+			goto broken;
+		}
+	}
+
+broken:
+	sx_report(SX_ERROR, "Incomplete response from %s\n", path);
+	close(fd);
+	free(buf);
+	return 1;
+}
@@ -27,8 +27,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <netinet/tcp.h>
 
 #include <assert.h>
@@ -39,19 +41,20 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "extern.h"
 #include "sx_report.h"
 
 int debug_expander = 0;
-int pipelining = 1;
-int expand_special_asn = 0;
 
 static inline int
 tentry_cmp(struct sx_tentry *a, struct sx_tentry *b)
@@ -93,13 +96,19 @@ bgpq_expander_init(struct bgpq_expander *b, int af)
 	b->identify = 1;
 	b->server = "rr.ntt.net";
 	b->port = "43";
+	b->fd = -1;
+	b->ctimeout = BGPQ_CONNECT_TIMEOUT;
+	b->pipelining = 1;
 
 	RB_INIT(&b->asnlist);
 
 	STAILQ_INIT(&b->wq);
-	STAILQ_INIT(&b->rq);
+	STAILQ_INIT(&b->reqfree);
+	SLIST_INIT(&b->reqchunks);
+	STAILQ_INIT(&b->servers);
 	STAILQ_INIT(&b->rsets);
 	STAILQ_INIT(&b->macroses);
+	STAILQ_INIT(&b->sourcesets);
 
 	return 1;
 
@@ -180,6 +189,61 @@ bgpq_expander_add_stop(struct bgpq_expander *b, char *rs)
 	return 1;
 }
 
+static struct bgpq_server *
+bgpq_server_alloc(struct bgpq_expander *b, const char *host, const char *port)
+{
+	struct bgpq_server	*s;
+
+	if ((s = calloc(1, sizeof(struct bgpq_server))) == NULL)
+		err(1, NULL);
+
+	if ((s->host = strdup(host)) == NULL || (s->port = strdup(port)) == NULL)
+		err(1, NULL);
+
+	s->fd = -1;
+	STAILQ_INIT(&s->wq);
+	STAILQ_INIT(&s->rq);
+
+	if (STAILQ_EMPTY(&b->servers)) {
+		b->server = s->host;
+		b->port = s->port;
+	}
+
+	STAILQ_INSERT_TAIL(&b->servers, s, entry);
+
+	return s;
+}
+
+/*
+ * Add an IRRd server as host[:port]. The first one added becomes
+ * b->server, the others are equivalent mirrors.
+ */
+int
+bgpq_expander_add_server(struct bgpq_expander *b, const char *server)
+{
+	char	*host, *port;
+
+	if ((host = strdup(server)) == NULL)
+		err(1, NULL);
+
+	if ((port = strchr(host, ':')) != NULL)
+		*port++ = '\0';
+	else
+		port = "43";
+
+	if (*host == '\0' || *port == '\0') {
+		free(host);
+		return 0;
+	}
+
+	bgpq_server_alloc(b, host, port);
+	free(host);
+
+	return 1;
+}
+
+static void bgpq_pipeline_asn(struct bgpq_expander *, uint32_t);
+
 int
 bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 {
@@ -197,7 +261,7 @@ bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 		return 0;
 	}
 
-	if (!expand_special_asn && (asno == 23456 || asno >= 4200000000ul
+	if (!b->specialasn && (asno == 23456 || asno >= 4200000000ul
 	    || (asno >= 64496 && asno <= 65551))) {
 		sx_report(SX_ERROR, "Invalid AS number: %u\n", asno);
 		return 0;
@@ -207,33 +271,79 @@ bgpq_expander_add_as(struct bgpq_expander *b, char *as)
 		err(1, NULL);
 
 	asne->asn = asno;
-	RB_INSERT(asn_tree, &b->asnlist, asne);
+	if (RB_INSERT(asn_tree, &b->asnlist, asne) != NULL) {
+		free(asne);
+		return 1;
+	}
+
+	if (b->fetchasns)
+		bgpq_pipeline_asn(b, asno);
 
 	return 1;
 }
 
+/*
+ * In streaming mode prefixes bypass the radix tree: every prefix not seen
+ * before is printed right away.
+ */
+static void
+bgpq_expander_stream(struct sx_prefix *p, void *udata)
+{
+	struct bgpq_expander *b = udata;
+
+	if (b->seen == NULL)
+		b->seen = sx_prefix_set_new(b->family);
+
+	if (sx_prefix_set_add(b->seen, p))
+		bgpq4_print_stream_prefix(stdout, b, p);
+}
+
+/*
+ * A dual-stack run keeps IPv6 prefixes in tree6, with no masklen limit
+ * of its own since -m is per family.
+ */
+static struct sx_radix_tree *
+bgpq_expander_tree(struct bgpq_expander *b, int af, unsigned int *maxlen)
+{
+	if (af == b->family) {
+		*maxlen = b->maxlen;
+		return b->tree;
+	}
+	if (af == AF_INET6 && b->tree6 != NULL) {
+		*maxlen = 128;
+		return b->tree6;
+	}
+
+	return NULL;
+}
+
 int
 bgpq_expander_add_prefix(struct bgpq_expander *b, char *prefix)
 {
-	struct sx_prefix *p = sx_prefix_alloc(NULL);
+	struct sx_prefix	 p;
+	struct sx_radix_tree	*tree;
+	unsigned int		 maxlen;
+
+	memset(&p, 0, sizeof(p));
 
-	if (!sx_prefix_parse(p, 0, prefix)) {
+	if (!sx_prefix_parse(&p, 0, prefix)) {
 		sx_report(SX_ERROR, "Unable to parse prefix %s\n", prefix);
 		return 0;
-	} else if (p->family != b->family) {
+	} else if ((tree = bgpq_expander_tree(b, p.family, &maxlen)) == NULL) {
 		SX_DEBUG(debug_expander, "Ignoring prefix %s with wrong "
 		    "address family\n", prefix);
 		return 0;
 	}
-	if (b->maxlen && p->masklen>b->maxlen) {
+	if (maxlen && p.masklen > maxlen) {
 		SX_DEBUG(debug_expander, "Ignoring prefix %s: masklen %i > max"
-		    " masklen %u\n", prefix, p->masklen, b->maxlen);
+		    " masklen %u\n", prefix, p.masklen, maxlen);
 		return 0;
 	}
-	sx_radix_tree_insert(b->tree, p);
 
-        if (p)
-		sx_prefix_free(p);
+	if (b->stream)
+		bgpq_expander_stream(&p, b);
+	else
+		sx_radix_tree_insert(tree, &p);
 
 	return 1;
 }
@@ -241,61 +351,386 @@ bgpq_expander_add_prefix(struct bgpq_expander *b, char *prefix)
 int
 bgpq_expander_add_prefix_range(struct bgpq_expander *b, char *prefix)
 {
+	if (b->tree6 != NULL && strchr(prefix, ':') != NULL)
+		return sx_prefix_range_parse(b->tree6, AF_INET6, 128, prefix);
+
+	if (b->stream)
+		return sx_prefix_range_foreach(b->family, b->maxlen, prefix,
+		    bgpq_expander_stream, b);
+
 	return sx_prefix_range_parse(b->tree, b->family, b->maxlen, prefix);
 }
 
-char *
-bgpq_get_asset(char *object) {
-	char *d, *asset;
+static int
+bgpq_expander_load_prefixes(struct bgpq_expander *b, const unsigned char *rec,
+    uint32_t count, const char *file)
+{
+	struct bgpq4_bin_prefix	 r;
+	struct sx_prefix	 p;
+	struct sx_radix_node	*n, *last = NULL;
+	unsigned int		 family, maxlen;
+	uint32_t		 i;
+
+	family = b->family == AF_INET ? 4 : 6;
+	maxlen = b->family == AF_INET ? 32 : 128;
+
+	for (i = 0; i < count; i++, rec += sizeof(r)) {
+		memcpy(&r, rec, sizeof(r));
+
+		if (r.family != family || r.len > maxlen || r.ge < r.len
+		    || r.le < r.ge || r.le > maxlen) {
+			sx_report(SX_ERROR, "Invalid prefix record %u in %s\n",
+			    i, file);
+			return 0;
+		}
 
-	d = strstr(object, "::");
-	if (d)
-		d += 2;
+		memset(&p, 0, sizeof(p));
+		p.family = b->family;
+		p.masklen = r.len;
+		memcpy(p.addr.addrs, r.addr, sizeof(r.addr));
+		sx_prefix_adjust_masklen(&p);
+
+		if ((n = sx_radix_tree_insert(b->tree, &p)) == NULL) {
+			sx_report(SX_ERROR, "Unable to insert prefix record %u "
+			    "from %s\n", i, file);
+			return 0;
+		}
+
+		/* several ranges of one prefix are written back to back */
+		if (n == last) {
+			while (n->son)
+				n = n->son;
+			n->son = sx_radix_node_new(&p);
+			n = n->son;
+		} else
+			last = n;
+
+		if (r.ge != r.len || r.le != r.len) {
+			n->isAggregate = 1;
+			n->aggregateLow = r.ge;
+			n->aggregateHi = r.le;
+		}
+	}
+
+	return 1;
+}
+
+static int
+bgpq_expander_load_asns(struct bgpq_expander *b, const unsigned char *rec,
+    uint32_t count)
+{
+	struct asn_entry	*asne;
+	uint32_t		 i, asn;
+
+	for (i = 0; i < count; i++, rec += sizeof(asn)) {
+		memcpy(&asn, rec, sizeof(asn));
+
+		if ((asne = malloc(sizeof(struct asn_entry))) == NULL)
+			err(1, NULL);
+
+		asne->asn = ntohl(asn);
+		if (RB_INSERT(asn_tree, &b->asnlist, asne) != NULL)
+			free(asne);
+	}
+
+	return 1;
+}
+
+#define PAD8(x)	(((size_t)(x) + 7) & ~(size_t)7)
+
+static int
+bgpq_expander_load_snapshot(struct bgpq_expander *b, const unsigned char *map,
+    size_t size, const char *file, int *flags)
+{
+	struct bgpq4_snap_header	 h;
+	size_t				 off;
+	uint32_t			 nprefixes, nasns, srclen;
+
+	if (size < sizeof(h))
+		goto truncated;
+
+	memcpy(&h, map, sizeof(h));
+
+	if (h.version != BGPQ4_SNAP_VERSION) {
+		sx_report(SX_ERROR, "%s: unsupported snapshot version %u\n",
+		    file, h.version);
+		return 0;
+	}
+
+	if (h.family != (b->family == AF_INET ? 4 : 6)) {
+		sx_report(SX_ERROR, "%s holds an IPv%u expansion, use -%u\n",
+		    file, h.family, h.family);
+		return 0;
+	}
+
+	nprefixes = ntohl(h.nprefixes);
+	nasns = ntohl(h.nasns);
+	srclen = ntohl(h.srclen);
+
+	off = sizeof(h) + PAD8(srclen);
+	if (off < sizeof(h) || size < off
+	    || (size - off) / sizeof(struct bgpq4_bin_prefix) < nprefixes)
+		goto truncated;
+	if ((size - off - (size_t)nprefixes * sizeof(struct bgpq4_bin_prefix))
+	    / sizeof(uint32_t) < nasns)
+		goto truncated;
+
+	if (b->generation >= T_PREFIXLIST
+	    && !(h.flags & BGPQ4_SNAP_PREFIXES)) {
+		sx_report(SX_ERROR, "%s holds no prefixes, it was taken by an "
+		    "as-path run\n", file);
+		return 0;
+	}
+
+	if (b->generation < T_PREFIXLIST && !(h.flags & BGPQ4_SNAP_ASNS)) {
+		sx_report(SX_ERROR, "%s holds no AS numbers, its run expanded "
+		    "the as-sets to prefixes (!a)\n", file);
+		return 0;
+	}
+
+	if (srclen) {
+		free(b->defaultsources);
+		if ((b->defaultsources = strndup((const char *)map + sizeof(h),
+		    srclen)) == NULL)
+			err(1, NULL);
+	}
+
+	if (!bgpq_expander_load_prefixes(b, map + off, nprefixes, file))
+		return 0;
+
+	off += (size_t)nprefixes * sizeof(struct bgpq4_bin_prefix);
+
+	bgpq_expander_load_asns(b, map + off, nasns);
+
+	if (flags)
+		*flags = h.flags;
+
+	SX_DEBUG(debug_expander, "Loaded %u prefixes and %u ASNs from %s "
+	    "(sources %s)\n", nprefixes, nasns, file,
+	    b->defaultsources ? b->defaultsources : "unknown");
+
+	return 1;
+
+truncated:
+	sx_report(SX_ERROR, "%s is truncated\n", file);
+
+	return 0;
+}
+
+static int
+bgpq_expander_load_binout(struct bgpq_expander *b, const unsigned char *map,
+    size_t size, const char *file)
+{
+	struct bgpq4_bin_header	 h;
+	size_t			 off;
+	uint32_t		 count;
+
+	if (size < sizeof(h))
+		goto truncated;
+
+	memcpy(&h, map, sizeof(h));
+
+	if (h.version != BGPQ4_BIN_VERSION) {
+		sx_report(SX_ERROR, "%s: unsupported binary output version "
+		    "%u\n", file, h.version);
+		return 0;
+	}
+
+	if (h.kind != BGPQ4_BIN_PREFIXES || h.recsize != sizeof(struct
+	    bgpq4_bin_prefix) || h.family != (b->family == AF_INET ? 4 : 6)) {
+		sx_report(SX_ERROR, "%s does not hold an IPv%u prefix-list\n",
+		    file, b->family == AF_INET ? 4 : 6);
+		return 0;
+	}
+
+	if (b->generation < T_PREFIXLIST) {
+		sx_report(SX_ERROR, "%s holds no AS numbers, only prefixes\n",
+		    file);
+		return 0;
+	}
+
+	count = ntohl(h.count);
+	off = sizeof(h) + PAD8(ntohl(h.namelen));
+
+	if (size < off
+	    || (size - off) / sizeof(struct bgpq4_bin_prefix) < count)
+		goto truncated;
+
+	return bgpq_expander_load_prefixes(b, map + off, count, file);
+
+truncated:
+	sx_report(SX_ERROR, "%s is truncated\n", file);
+
+	return 0;
+}
+
+/*
+ * Load a snapshot (-C) or the prefix-list a previous run wrote with -Y.
+ * The file is mapped rather than read, records are decoded in place.
+ */
+int
+bgpq_expander_load(struct bgpq_expander *b, const char *file, int *flags)
+{
+	struct stat	 st;
+	void		*map;
+	int		 fd, ret = 0;
+
+	if (flags)
+		*flags = 0;
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		sx_report(SX_ERROR, "Unable to open %s: %s\n", file,
+		    strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		sx_report(SX_ERROR, "Unable to stat %s: %s\n", file,
+		    strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if (st.st_size < 4) {
+		sx_report(SX_ERROR, "%s is not a bgpq4 snapshot or binary "
+		    "output\n", file);
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		sx_report(SX_ERROR, "Unable to mmap %s: %s\n", file,
+		    strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if (!memcmp(map, BGPQ4_SNAP_MAGIC, 4))
+		ret = bgpq_expander_load_snapshot(b, map, st.st_size, file,
+		    flags);
+	else if (!memcmp(map, BGPQ4_BIN_MAGIC, 4))
+		ret = bgpq_expander_load_binout(b, map, st.st_size, file);
 	else
-		d = object;
+		sx_report(SX_ERROR, "%s is not a bgpq4 snapshot or binary "
+		    "output\n", file);
 
-	if ((asset = calloc(1, 256)) == NULL)
-		err(1, NULL);
+	munmap(map, st.st_size);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Write the expanded tree, ASN list and the IRR sources they came from
+ * to file, so that later runs can render them without querying IRRd (-c).
+ * flags records the post-processing (-A, -R, -r) already applied, the
+ * kinds of data the run collected are added here: the prefixes for prefix
+ * filters, the AS numbers for as-paths and for prefix filters expanding
+ * their as-sets to AS numbers, rather than to prefixes with !a.
+ */
+int
+bgpq_expander_save(struct bgpq_expander *b, const char *file, int flags)
+{
+	struct bgpq4_snap_header	 h;
+	struct asn_entry		*asne;
+	static const char		 pad[8];
+	char				 tmp[PATH_MAX];
+	const char			*sources = b->defaultsources;
+	uint32_t			 nprefixes = 0, nasns = 0, asn;
+	size_t				 srclen = sources ? strlen(sources) : 0;
+	FILE				*f;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp)) {
+		sx_report(SX_ERROR, "Snapshot file name too long: %s\n", file);
+		return 0;
+	}
+
+	if ((f = fopen(tmp, "w")) == NULL) {
+		sx_report(SX_ERROR, "Unable to create %s: %s\n", tmp,
+		    strerror(errno));
+		return 0;
+	}
 
-	memcpy(asset, d, strlen(object) - (d - object));
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_count_binary_prefix,
+	    &nprefixes);
+	RB_FOREACH(asne, asn_tree, &b->asnlist)
+		nasns++;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BGPQ4_SNAP_MAGIC, sizeof(h.magic));
+	h.version = BGPQ4_SNAP_VERSION;
+	h.family = b->family == AF_INET ? 4 : 6;
+	h.flags = flags;
+	if (b->generation >= T_PREFIXLIST)
+		h.flags |= BGPQ4_SNAP_PREFIXES;
+	if (b->generation < T_PREFIXLIST || !b->aqueried)
+		h.flags |= BGPQ4_SNAP_ASNS;
+	h.nprefixes = htonl(nprefixes);
+	h.nasns = htonl(nasns);
+	h.srclen = htonl(srclen);
+	h.created = htonl(time(NULL));
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(sources ? sources : "", srclen, 1, f);
+	fwrite(pad, PAD8(srclen) - srclen, 1, f);
+
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_print_binary_prefix, f);
+
+	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		asn = htonl(asne->asn);
+		fwrite(&asn, sizeof(asn), 1, f);
+	}
+
+	if (ferror(f)) {
+		sx_report(SX_ERROR, "Unable to write snapshot %s\n", tmp);
+		fclose(f);
+		unlink(tmp);
+		return 0;
+	}
+
+	if (fclose(f) == EOF || rename(tmp, file) == -1) {
+		sx_report(SX_ERROR, "Unable to write snapshot %s: %s\n", file,
+		    strerror(errno));
+		unlink(tmp);
+		return 0;
+	}
 
-	return asset;
+	return 1;
 }
 
+/* The set name of [source::]name, within object. */
 char *
-bgpq_get_rset(char *object) {
-	char *d, *rset;
+bgpq_get_asset(char *object) {
+	char *d;
 
 	d = strstr(object, "::");
-
 	if (d)
-		d += 2;
-	else
-		d = object;
-
-	if ((rset = calloc(1, 256)) == NULL)
-		err(1, NULL);
+		return d + 2;
 
-	memcpy(rset, d, strlen(object) - (d - object));
+	return object;
+}
 
-	return rset;
+char *
+bgpq_get_rset(char *object) {
+	return bgpq_get_asset(object);
 }
 
+/* The source of source::name copied to buf, NULL if there is none. */
 char *
-bgpq_get_source(char *object) {
+bgpq_get_source(char *object, char *buf, size_t len) {
 	char 		*d;
-	char 		*source;
-	unsigned int	 slen;
+	size_t		 slen;
 
 	d = strstr(object, "::");
 
 	if (d) {
-		if ((source = calloc(1, 256)) == NULL)
-			err(1, NULL);
-
 		slen = d - object;
-		memcpy(source, object, slen);
-		return source;
+		if (slen >= len)
+			slen = len - 1;
+		memcpy(buf, object, slen);
+		buf[slen] = '\0';
+		return buf;
 	}
 
 	return NULL;
@@ -315,6 +750,9 @@ bgpq_pipeline(struct bgpq_expander *b,
     int (*callback)(char *, struct bgpq_expander *b, struct request *req),
     void *udata, char *fmt, ...);
 
+static void
+bgpq_pipeline_sources(struct bgpq_expander *b, const char *sources);
+
 int
 bgpq_expand_irrd(struct bgpq_expander *b,
     int (*callback)(char*, struct bgpq_expander *b, struct request *req),
@@ -324,7 +762,7 @@ static int
 bgpq_expanded_macro_limit(char *as, struct bgpq_expander *b,
     struct request *req)
 {
-	char		*source;
+	char		*source, sbuf[256];
 	struct request	*req1;
 
 	if (!strncasecmp(as, "AS-", 3) || strchr(as, '-') || strchr(as, ':')) {
@@ -346,16 +784,15 @@ bgpq_expanded_macro_limit(char *as, struct bgpq_expander *b,
 		    (b->cdepth + 1 < b->maxdepth &&
 		    req->depth + 1 < b->maxdepth)) {
 			bgpq_expander_add_already(b, as);
-			if (pipelining) {
+			if (b->pipelining) {
 				if (b->usesource) {
-					source = bgpq_get_source(as);
+					source = bgpq_get_source(as, sbuf,
+					    sizeof(sbuf));
 					if (source) {
-						bgpq_pipeline(b, NULL, NULL,
-						    "!s%s\n", source);
-						free(source);
+						bgpq_pipeline_sources(b, source);
 					} else {
-						bgpq_pipeline(b, NULL, NULL,
-						    "!s%s\n", b->defaultsources);
+						bgpq_pipeline_sources(b,
+						    b->defaultsources);
 					}
 				}
 
@@ -364,11 +801,11 @@ bgpq_expanded_macro_limit(char *as, struct bgpq_expander *b,
 				req1->depth = req->depth + 1;
 			} else {
 				if (b->usesource) {
-					source = bgpq_get_source(as);
+					source = bgpq_get_source(as, sbuf,
+					    sizeof(sbuf));
 					if (source) {
 						bgpq_expand_irrd(b, NULL, NULL,
 						    "!s%s\n", source);
-						free(source);
 					} else {
 						bgpq_expand_irrd(b, NULL, NULL,
 						    "!s%s\n", b->defaultsources);
@@ -437,6 +874,9 @@ bgpq_expanded_v6prefix(char *prefix, struct bgpq_expander *ex,
 	return 1;
 }
 
+/*
+ * The sources the server has, NULL if it can't tell.
+ */
 static char *
 bgpq_get_irrd_sources(int fd)
 {
@@ -454,31 +894,28 @@ bgpq_get_irrd_sources(int fd)
 		err(1, NULL);
 
 	SX_DEBUG(debug_expander, "Requesting source list %s", query);
-	if ((ret = write(fd, query, strlen(query))) != qlen) {
+	if ((ret = bgpq_irrd_write(fd, query, strlen(query))) != qlen) {
 		sx_report(SX_ERROR, "Partial write of query to "
 			"IRRd: %i bytes, %s\n", ret, strerror(errno));
-		close(fd);
 		free(sources);
 		free(response);
-		exit(1);
+		return NULL;
 	}
 
-	if (0 < read(fd, response, rsize)) {
+	if (0 < bgpq_irrd_read(fd, response, rsize)) {
 		SX_DEBUG(debug_expander, "Got answer %s", response);
 		if (*(response + strlen(response) - 2) != 'C') {
 			sx_report(SX_ERROR, "Invalid response "
 				"'%s': %s\n", response, query);
-			close(fd);
 			free(sources);
 			free(response);
-			exit(1);
+			return NULL;
 		}
 	} else {
 		sx_report(SX_ERROR, "failed to read sources\n");
-		close(fd);
 		free(sources);
 		free(response);
-		exit(1);
+		return NULL;
 	}
 
 	start = strchr(response, '\n');
@@ -488,10 +925,9 @@ bgpq_get_irrd_sources(int fd)
 		if (!end) {
 			sx_report(SX_ERROR, "No 2nd newline in response '%s': %s\n",
 				response, query);
-			close(fd);
 			free(sources);
 			free(response);
-			exit(1);
+			return NULL;
 		}
 		slen = end - start;
 		if (slen > rsize)
@@ -501,32 +937,49 @@ bgpq_get_irrd_sources(int fd)
 	} else {
 		sx_report(SX_ERROR, "No 1st newline in response '%s': %s\n",
 			response, query);
-		close(fd);
 		free(sources);
 		free(response);
-		exit(1);
+		return NULL;
 	}
 
 	free(response);
 	return sources;
 }
 
+/*
+ * Requests come from chunks of BGPQ_REQUEST_CHUNK, and go back to the
+ * free list of the expander when answered, with the query text inline
+ * unless it is longer than BGPQ_REQUEST_TEXT. Expanding a large set thus
+ * allocates a few chunks rather than two blocks per query.
+ */
 static struct request *
-request_alloc(char *request, int (*callback)(char *, struct bgpq_expander *,
-    struct request *), void *udata)
+request_alloc(struct bgpq_expander *b, char *request,
+    int (*callback)(char *, struct bgpq_expander *, struct request *),
+    void *udata)
 {
-	struct request *bp;
+	struct request_chunk	*rc;
+	struct request		*bp;
+	size_t			 len, i;
 
-	if ((bp = malloc(sizeof(struct request))) == NULL)
-		err(1, NULL);
+	if (STAILQ_EMPTY(&b->reqfree)) {
+		if ((rc = malloc(sizeof(struct request_chunk))) == NULL)
+			err(1, NULL);
+		SLIST_INSERT_HEAD(&b->reqchunks, rc, next);
+		for (i = 0; i < BGPQ_REQUEST_CHUNK; i++)
+			STAILQ_INSERT_TAIL(&b->reqfree, &rc->req[i], next);
+	}
 
-	if (!bp)
-		return NULL;
+	bp = STAILQ_FIRST(&b->reqfree);
+	STAILQ_REMOVE_HEAD(&b->reqfree, next);
 
-	memset(bp, 0, sizeof(struct request));
-	bp->request = strdup(request);
-	bp->offset = 0;
-	bp->size = strlen(bp->request);
+	len = strlen(request);
+	memset(bp, 0, offsetof(struct request, text));
+	if (len < sizeof(bp->text))
+		bp->request = bp->text;
+	else if ((bp->request = malloc(len + 1)) == NULL)
+		err(1, NULL);
+	memcpy(bp->request, request, len + 1);
+	bp->size = len;
 	bp->callback = callback;
 	bp->udata = udata;
 
@@ -534,12 +987,12 @@ request_alloc(char *request, int (*callback)(char *, struct bgpq_expander *,
 }
 
 static void
-request_free(struct request *req)
+request_free(struct bgpq_expander *b, struct request *req)
 {
-	if (req->request)
+	if (req->request != req->text)
 		free(req->request);
 
-	free(req);
+	STAILQ_INSERT_HEAD(&b->reqfree, req, next);
 }
 
 struct request *
@@ -549,7 +1002,6 @@ bgpq_pipeline(struct bgpq_expander *b,
 {
 	struct request		*bp = NULL;
 	char			 request[256];
-	int			 ret;
 	va_list			 ap;
 
 	va_start(ap, fmt);
@@ -558,7 +1010,7 @@ bgpq_pipeline(struct bgpq_expander *b,
 
 	SX_DEBUG(debug_expander,"expander: sending %s", request);
 
-	bp = request_alloc(request, callback, udata);
+	bp = request_alloc(b, request, callback, udata);
 
 	if (!bp) {
 		sx_report(SX_FATAL,"Unable to allocate %lu bytes: %s\n",
@@ -566,49 +1018,105 @@ bgpq_pipeline(struct bgpq_expander *b,
 		    strerror(errno));
 	}
 
-	if (STAILQ_EMPTY(&b->wq)) {
-		ret = write(b->fd, request, bp->size);
-		if (ret < 0) {
-			if (errno == EAGAIN) {
-				STAILQ_INSERT_TAIL(&b->wq, bp, next);
-				return bp;
-			}
-			sx_report(SX_FATAL, "Error writing request: %s\n",
-			    strerror(errno));
-		}
-
-		bp->offset=ret;
-
-		if (ret == bp->size)
-			STAILQ_INSERT_TAIL(&b->rq, bp, next);
-		else
-			STAILQ_INSERT_TAIL(&b->wq, bp, next);
-
+	/* bgpq_read() hands it to a server */
+	clock_gettime(CLOCK_MONOTONIC, &bp->queued);
+	if (b->cursources != NULL) {
+		bp->sources = b->cursources->sources;
+		STAILQ_INSERT_TAIL(&b->cursources->wq, bp, next);
 	} else
 		STAILQ_INSERT_TAIL(&b->wq, bp, next);
+	b->piped++;
 
 	return bp;
 }
 
+/*
+ * Queue the prefix queries for an AS number. They always go with the
+ * default sources, whatever set the AS number was found in.
+ */
 static void
-bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
+bgpq_pipeline_asn(struct bgpq_expander *b, uint32_t asn)
 {
-	char			*eptr;
-	unsigned long		 asn = 0;
-	struct asn_entry	 find, *res;
+	struct sourceset	*cur = b->cursources;
+
+	b->cursources = NULL;
+	if (b->family == AF_INET6 || b->tree6 != NULL)
+		bgpq_pipeline(b, bgpq_expanded_v6prefix, NULL,
+		    "!6as%" PRIu32 "\n", asn);
+	if (b->family == AF_INET)
+		bgpq_pipeline(b, bgpq_expanded_prefix, NULL,
+		    "!gas%" PRIu32 "\n", asn);
+	b->cursources = cur;
+}
 
-	if (!strncmp(q, "!gas", 4) || !strncmp(q, "!6as", 4)) {
-		errno = 0;
-		asn = strtoul(q + 4, &eptr, 10);
-		if (*eptr != '\n') {
-			sx_report(SX_ERROR, "bad number in query: %s\n", q);
-			return;
-		}
-		if (errno == ERANGE && asn == ULONG_MAX) {
-			sx_report(SX_ERROR, "overflow: %s\n", q);
+/*
+ * Set the sources for the queries pipelined from now on. Nothing is sent
+ * here, a server gets a !s when a query needs other sources than the ones
+ * it has.
+ */
+static void
+bgpq_pipeline_sources(struct bgpq_expander *b, const char *sources)
+{
+	struct sourceset	*ss;
+
+	SX_DEBUG(debug_expander, "expander: sources %s\n", sources);
+
+	if (b->defaultsources && strcmp(sources, b->defaultsources) == 0) {
+		b->cursources = NULL;
+		return;
+	}
+
+	STAILQ_FOREACH(ss, &b->sourcesets, entry) {
+		if (strcmp(ss->sources, sources) == 0) {
+			b->cursources = ss;
 			return;
 		}
-		if (asn == 0 || asn >= 4294967295) {
+	}
+
+	if ((ss = calloc(1, sizeof(*ss))) == NULL ||
+	    (ss->sources = strdup(sources)) == NULL)
+		err(1, NULL);
+
+	STAILQ_INIT(&ss->wq);
+	STAILQ_INSERT_TAIL(&b->sourcesets, ss, entry);
+	b->cursources = ss;
+}
+
+/* The queue of the queries waiting for the given sources. */
+static struct requests *
+bgpq_sourceset_wq(struct bgpq_expander *b, const char *sources)
+{
+	struct sourceset	*ss;
+
+	if (sources == NULL)
+		return &b->wq;
+
+	STAILQ_FOREACH(ss, &b->sourcesets, entry)
+		if (ss->sources == sources)
+			return &ss->wq;
+
+	return &b->wq;
+}
+
+static void
+bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
+{
+	char			*eptr;
+	unsigned long		 asn = 0;
+	struct asn_entry	 find, *res;
+
+	if (!strncmp(q, "!gas", 4) || !strncmp(q, "!6as", 4)) {
+		errno = 0;
+		asn = strtoul(q + 4, &eptr, 10);
+		if (*eptr != '\n') {
+			sx_report(SX_ERROR, "bad number in query: %s\n", q);
+			return;
+		}
+		if (errno == ERANGE && asn == ULONG_MAX) {
+			sx_report(SX_ERROR, "overflow: %s\n", q);
+			return;
+		}
+		if (asn == 0 || asn >= 4294967295) {
 			sx_report(SX_ERROR, "out of range: %s\n", q);
 			return;
 		}
@@ -621,26 +1129,482 @@ bgpq_expander_invalidate_asn(struct bgpq_expander *b, const char *q)
 	}
 }
 
+/*
+ * Select the sources given with -S on a freshly connected server. The
+ * caller closes fd if that fails.
+ */
+static int
+bgpq_select_sources(struct bgpq_expander *b, int fd)
+{
+	int	 ret, slen;
+
+	slen = strlen(b->sources) + 4;
+	if (slen < 256)
+		slen = 256;
+	char sources[slen];
+	slen = snprintf(sources, sizeof(sources), "!s%s\n", b->sources);
+	if (slen > 0) {
+		SX_DEBUG(debug_expander, "Requesting sources %s", sources);
+		if ((ret = bgpq_irrd_write(fd, sources, slen)) != slen) {
+			sx_report(SX_ERROR, "Partial write of sources to "
+			    "IRRd: %i bytes, %s\n", ret, strerror(errno));
+			return 0;
+		}
+		memset(sources, 0, sizeof(sources));
+		if (0 < bgpq_irrd_read(fd, sources, sizeof(sources))) {
+			SX_DEBUG(debug_expander, "Got answer %s", sources);
+			if (sources[0] != 'C') {
+				sx_report(SX_ERROR, "Invalid source(s) "
+				    "'%s': %s\n", b->sources, sources);
+				return 0;
+			}
+		} else {
+			sx_report(SX_ERROR, "failed to read sources\n");
+			return 0;
+		}
+	} else {
+		sx_report(SX_ERROR, "snprintf(sources) failed\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+#define BGPQ_WINDOW	128	/* queries in flight on one server */
+#define BGPQ_SAMPLES	16	/* answers before a server's speed counts */
+#define BGPQ_SLOW	4	/* drop servers this many times slower */
+#define BGPQ_STALL	15	/* seconds without an answer to drop a server */
+#define BGPQ_RETRIES	3	/* reconnects to a failed server in a row */
+
+static double
+bgpq_since(const struct timespec *ts)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - ts->tv_sec) + (now.tv_nsec - ts->tv_nsec) / 1e9;
+}
+
+/* Servers that are connected or about to be reconnected. */
+static unsigned int
+bgpq_servers_up(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	unsigned int		 up = 0;
+
+	STAILQ_FOREACH(s, &b->servers, entry)
+		if (s->fd != -1 || s->reconnect)
+			up++;
+
+	return up;
+}
+
+static void
+bgpq_server_queue(struct bgpq_expander *b, struct bgpq_server *s,
+    struct request *req)
+{
+	struct request	*sr;
+	const char	*sources;
+	size_t		 len;
+
+	if (req->sources != s->sources) {
+		sources = req->sources ? req->sources : b->defaultsources;
+		len = strlen(sources) + 4;
+		char query[len];
+		snprintf(query, len, "!s%s\n", sources);
+		sr = request_alloc(b, query, NULL, NULL);
+		sr->flags = REQ_SOURCES;
+		sr->server = s;
+		STAILQ_INSERT_TAIL(&s->wq, sr, next);
+		s->queued++;
+		s->sources = req->sources;
+	}
+
+	req->server = s;
+	req->offset = 0;
+	STAILQ_INSERT_TAIL(&s->wq, req, next);
+	s->queued++;
+}
+
+/*
+ * The least busy server that can take one more query, other than the
+ * one given.
+ */
+static struct bgpq_server *
+bgpq_server_pick(struct bgpq_expander *b, struct bgpq_server *other)
+{
+	struct bgpq_server	*s, *best = NULL;
+
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1 || s == other || s->queued >= BGPQ_WINDOW)
+			continue;
+		if (best == NULL || s->queued < best->queued)
+			best = s;
+	}
+
+	return best;
+}
+
+/*
+ * The queue a server takes its next query from: the one for the sources
+ * it already has while it isn't empty, so that queries with the same
+ * sources go together and a !s is only sent when there is nothing left
+ * for the current ones.
+ */
+static struct requests *
+bgpq_schedule_wq(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	struct sourceset	*ss;
+	struct requests		*wq;
+
+	wq = bgpq_sourceset_wq(b, s->sources);
+	if (!STAILQ_EMPTY(wq))
+		return wq;
+
+	if (!STAILQ_EMPTY(&b->wq))
+		return &b->wq;
+
+	STAILQ_FOREACH(ss, &b->sourcesets, entry)
+		if (!STAILQ_EMPTY(&ss->wq))
+			return &ss->wq;
+
+	return NULL;
+}
+
+static void
+bgpq_schedule(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s, *s2;
+	struct request		*req, *twin;
+	struct requests		*wq;
+
+	while ((s = bgpq_server_pick(b, NULL)) != NULL) {
+		if ((wq = bgpq_schedule_wq(b, s)) == NULL)
+			break;
+
+		req = STAILQ_FIRST(wq);
+		STAILQ_REMOVE_HEAD(wq, next);
+		bgpq_server_queue(b, s, req);
+
+		/* -Q: send it to a second server, the first answer wins */
+		if (!b->race || (s2 = bgpq_server_pick(b, s)) == NULL)
+			continue;
+
+		twin = request_alloc(b, req->request, req->callback,
+		    req->udata);
+		twin->depth = req->depth;
+		twin->sources = req->sources;
+		twin->queued = req->queued;
+		twin->twin = req;
+		req->twin = twin;
+		bgpq_server_queue(b, s2, twin);
+	}
+}
+
+/*
+ * The twin of an answered query is taken back if it wasn't written yet,
+ * its answer is skipped otherwise.
+ */
+static void
+bgpq_request_lose(struct bgpq_expander *b, struct request *req)
+{
+	struct bgpq_server	*s = req->server;
+
+	req->twin = NULL;
+
+	if (req->offset == 0) {
+		STAILQ_REMOVE(&s->wq, req, request, next);
+		s->queued--;
+		request_free(b, req);
+	} else
+		req->flags |= REQ_LOST;
+}
+
+/*
+ * Put the queries of a dropped server that need the given sources back
+ * in front of their queue, in the order they were sent.
+ */
+static void
+bgpq_requeue(struct requests *back, const char *sources, struct requests *wq)
+{
+	struct requests	 mine = STAILQ_HEAD_INITIALIZER(mine);
+	struct requests	 rest = STAILQ_HEAD_INITIALIZER(rest);
+	struct request	*req;
+
+	while ((req = STAILQ_FIRST(back)) != NULL) {
+		STAILQ_REMOVE_HEAD(back, next);
+		if (req->sources == sources)
+			STAILQ_INSERT_TAIL(&mine, req, next);
+		else
+			STAILQ_INSERT_TAIL(&rest, req, next);
+	}
+
+	STAILQ_CONCAT(&mine, wq);
+	STAILQ_CONCAT(wq, &mine);
+	STAILQ_CONCAT(back, &rest);
+}
+
+/*
+ * Stop using a server. The queries it didn't answer go back to the queue
+ * unless their twin is still waiting elsewhere.
+ */
+static void
+bgpq_server_drop(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	struct requests		 back = STAILQ_HEAD_INITIALIZER(back);
+	struct request		*req;
+	struct sourceset	*ss;
+
+	STAILQ_CONCAT(&s->rq, &s->wq);
+
+	while ((req = STAILQ_FIRST(&s->rq)) != NULL) {
+		STAILQ_REMOVE_HEAD(&s->rq, next);
+		if (req->flags & (REQ_SOURCES | REQ_LOST)) {
+			request_free(b, req);
+		} else if (req->twin != NULL) {
+			req->twin->twin = NULL;
+			request_free(b, req);
+		} else {
+			req->server = NULL;
+			req->offset = 0;
+			STAILQ_INSERT_TAIL(&back, req, next);
+		}
+	}
+
+	bgpq_requeue(&back, NULL, &b->wq);
+	STAILQ_FOREACH(ss, &b->sourcesets, entry)
+		bgpq_requeue(&back, ss->sources, &ss->wq);
+
+	if (b->fd == s->fd)
+		b->fd = -1;
+	close(s->fd);
+	s->fd = -1;
+	s->queued = 0;
+	s->len = 0;
+	s->sources = NULL;
+}
+
+static void
+bgpq_requests_free(struct bgpq_expander *b, struct requests *rq)
+{
+	struct request	*req;
+
+	while ((req = STAILQ_FIRST(rq)) != NULL) {
+		STAILQ_REMOVE_HEAD(rq, next);
+		request_free(b, req);
+	}
+}
+
+/*
+ * Close every connection and drop the queries still queued, after the run
+ * was given up on or past its -q run= deadline.
+ */
+static void
+bgpq_drop_all(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	struct sourceset	*ss;
+
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd != -1)
+			bgpq_server_drop(b, s);
+		s->reconnect = 0;
+	}
+	bgpq_requests_free(b, &b->wq);
+	STAILQ_FOREACH(ss, &b->sourcesets, entry)
+		bgpq_requests_free(b, &ss->wq);
+	b->piped = 0;
+}
+
+/*
+ * The run can't go on, bgpq_expand() returns 0 once it is unwound.
+ */
+static void
+bgpq_abort(struct bgpq_expander *b)
+{
+	b->failed = 1;
+	bgpq_drop_all(b);
+}
+
+/*
+ * A server failed. Its unanswered queries are queued again, and it is
+ * reconnected unless that already failed BGPQ_RETRIES times in a row.
+ */
 static void
-bgpq_write(struct bgpq_expander *b)
+bgpq_server_fail(struct bgpq_expander *b, struct bgpq_server *s,
+    const char *fmt, ...)
+{
+	char		what[256];
+	va_list		ap;
+
+	va_start(ap, fmt);
+	vsnprintf(what, sizeof(what), fmt, ap);
+	va_end(ap);
+
+	bgpq_server_drop(b, s);
+
+	if (s->retries < BGPQ_RETRIES) {
+		sx_report(SX_NOTICE, "%s:%s: %s, reconnecting\n", s->host,
+		    s->port, what);
+		s->reconnect = 1;
+		clock_gettime(CLOCK_MONOTONIC, &s->retry);
+		if (s->retries > 0)
+			s->retry.tv_sec += 1 << s->retries;
+		return;
+	}
+
+	if (bgpq_servers_up(b) == 0) {
+		sx_report(SX_ERROR, "%s\n", what);
+		bgpq_abort(b);
+		return;
+	}
+
+	sx_report(SX_NOTICE, "%s:%s: %s, using the other servers\n",
+	    s->host, s->port, what);
+}
+
+/*
+ * Connect a failed server again, with the same preamble as the first
+ * time. The queries it had are back on the queue already.
+ */
+static int
+bgpq_server_reconnect(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	int	fd;
+
+	if ((fd = bgpq_connect(s->host, s->port, b->identify,
+	    b->ctimeout)) == -1)
+		return 0;
+
+	if (b->sources && b->sources[0] != 0 && !bgpq_select_sources(b, fd)) {
+		close(fd);
+		return 0;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK|(fcntl(fd, F_GETFL)));
+	s->fd = fd;
+	clock_gettime(CLOCK_MONOTONIC, &s->lastread);
+
+	return 1;
+}
+
+/*
+ * Reconnect the servers that are due, backing off between attempts.
+ * Returns the milliseconds until the next attempt, or -1 for none.
+ */
+static int
+bgpq_servers_retry(struct bgpq_expander *b)
 {
-	while(!STAILQ_EMPTY(&b->wq)) {
-		struct request *req = STAILQ_FIRST(&b->wq);
+	struct bgpq_server	*s;
+	double			 wait;
+	int			 next = -1;
 
-		int ret = write(b->fd, req->request + req->offset,
-		    req->size-req->offset);
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (!s->reconnect)
+			continue;
+
+		if ((wait = -bgpq_since(&s->retry)) > 0) {
+			if (next == -1 || wait * 1000 + 1 < next)
+				next = wait * 1000 + 1;
+			continue;
+		}
+
+		s->retries++;
+		SX_DEBUG(debug_expander, "reconnecting to %s:%s, attempt %u "
+		    "of %u\n", s->host, s->port, s->retries, BGPQ_RETRIES);
+
+		if (bgpq_server_reconnect(b, s)) {
+			s->reconnect = 0;
+		} else if (s->retries < BGPQ_RETRIES) {
+			clock_gettime(CLOCK_MONOTONIC, &s->retry);
+			s->retry.tv_sec += 1 << s->retries;
+			if (next == -1 || (1 << s->retries) * 1000 < next)
+				next = (1 << s->retries) * 1000;
+		} else {
+			s->reconnect = 0;
+			sx_report(SX_NOTICE, "%s:%s: unable to reconnect, "
+			    "giving up on it\n", s->host, s->port);
+		}
+	}
+
+	if (bgpq_servers_up(b) == 0) {
+		sx_report(SX_ERROR, "Unable to reconnect to IRRd\n");
+		bgpq_abort(b);
+		return -1;
+	}
+
+	return next;
+}
+
+/*
+ * With more than one server up, drop the ones that stopped answering or
+ * are much slower than the fastest.
+ */
+static void
+bgpq_servers_check(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s, *best = NULL;
+	unsigned int		 up = 0;
+
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1)
+			continue;
+		up++;
+		if (s->samples >= BGPQ_SAMPLES
+		    && (best == NULL || s->srtt < best->srtt))
+			best = s;
+	}
+
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1 || up < 2)
+			continue;
+		if (!STAILQ_EMPTY(&s->rq)
+		    && bgpq_since(&s->lastread) > BGPQ_STALL) {
+			sx_report(SX_NOTICE, "%s:%s: no answer for %i seconds,"
+			    " using the other servers\n", s->host, s->port,
+			    BGPQ_STALL);
+		} else if (best != NULL && s != best
+		    && s->samples >= BGPQ_SAMPLES
+		    && s->srtt > BGPQ_SLOW * best->srtt) {
+			SX_DEBUG(debug_expander, "%s:%s answers in %.1f ms, "
+			    "%s:%s in %.1f ms, dropping it\n", s->host,
+			    s->port, s->srtt * 1000, best->host, best->port,
+			    best->srtt * 1000);
+		} else
+			continue;
+		bgpq_server_drop(b, s);
+		up--;
+	}
+}
+
+static void
+bgpq_write(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	struct request	*req;
+	int		 ret;
+
+	while ((req = STAILQ_FIRST(&s->wq)) != NULL) {
+		ret = bgpq_irrd_write(s->fd, req->request + req->offset,
+		    req->size - req->offset);
 
 		if (ret < 0) {
 			if (errno == EAGAIN)
 				return;
-			sx_report(SX_FATAL, "error writing data: %s\n",
+			bgpq_server_fail(b, s, "error writing data: %s",
 			    strerror(errno));
+			return;
 		}
 
 		if (ret == req->size - req->offset) {
 			/* this request was dequeued */
-			STAILQ_REMOVE_HEAD(&b->wq, next);
-			STAILQ_INSERT_TAIL(&b->rq, req, next);
+			STAILQ_REMOVE_HEAD(&s->wq, next);
+			if (STAILQ_EMPTY(&s->rq))
+				clock_gettime(CLOCK_MONOTONIC, &s->lastread);
+			clock_gettime(CLOCK_MONOTONIC, &req->sent);
+			req->first.tv_sec = req->first.tv_nsec = 0;
+			req->offset = req->size;
+			STAILQ_INSERT_TAIL(&s->rq, req, next);
 		} else {
 			req->offset += ret;
 			break;
@@ -648,226 +1612,603 @@ bgpq_write(struct bgpq_expander *b)
 	}
 }
 
+/*
+ * Process the answer to a query: the first line of it, with the data of
+ * an A response NUL-terminated in body.
+ */
 static int
-bgpq_selread(struct bgpq_expander *b, char *buffer, int size)
+bgpq_answer(struct bgpq_expander *b, struct bgpq_server *s,
+    struct request *req, char *response, int rlen, char *body,
+    unsigned long togot)
 {
-	fd_set		rfd, wfd;
-	int		ret;
+	char	*c;
+	double	 t;
+	int	 rval = 1;
 
-repeat:
-	FD_ZERO(&rfd);
-	FD_SET(b->fd, &rfd);
-	FD_ZERO(&wfd);
+	if (req->flags & REQ_LOST) {
+		request_free(b, req);
+		return 1;
+	}
 
-	if (!STAILQ_EMPTY(&b->wq))
-		FD_SET(b->fd, &wfd);
+	s->retries = 0;
 
-	ret = select(b->fd + 1, &rfd, &wfd, NULL, NULL);
+	if (!(req->flags & REQ_SOURCES)) {
+		t = bgpq_since(&req->sent);
+		s->srtt = s->samples++ ? s->srtt + (t - s->srtt) / 8 : t;
+		b->piped--;
+	}
 
-	if (ret == 0)
-		sx_report(SX_FATAL, "select failed\n");
-	else if (ret == -1 && errno == EINTR)
-		goto repeat;
-	else if (ret == -1)
-		sx_report(SX_FATAL, "select error %i: %s\n", errno,
+	if (req->twin != NULL)
+		bgpq_request_lose(b, req->twin);
+
+	if (response[0] == 'A') {
+		SX_DEBUG(debug_expander >= 3, "Got %s (%lu bytes) in response "
+		    "to %s", body, togot, req->request);
+
+		for (c = body; c < body + togot;) {
+			size_t spn = strcspn(c, " \n");
+			if (spn)
+				c[spn] = 0;
+			if (c[0] == 0)
+				break;
+			if (req->callback && !req->callback(c, b, req))
+				rval = 0;
+			c += spn + 1;
+		}
+		assert(c == body + togot);
+	} else if (response[0] == 'C') {
+		/* No data */
+		SX_DEBUG(debug_expander,"No data expanding %s",
+		    req->request);
+		if (b->validate_asns)
+			bgpq_expander_invalidate_asn(b, req->request);
+	} else if (response[0] == 'D') {
+		SX_DEBUG(debug_expander, "Key not found expanding %s",
+		    req->request);
+		if (b->validate_asns)
+			bgpq_expander_invalidate_asn(b, req->request);
+		rval = 0;
+	} else if (response[0] == 'E') {
+		sx_report(SX_ERROR, "Multiple keys expanding %s: %.*s",
+		    req->request, rlen, response);
+		rval = 0;
+	} else if (response[0] == 'F') {
+		sx_report(SX_ERROR, "Error expanding %s: %.*s",
+		    req->request, rlen, response);
+		rval = 0;
+	} else {
+		sx_report(SX_ERROR,"Wrong reply: %.*s to %s", rlen, response,
+		    req->request);
+		exit(1);
+	}
+
+	request_free(b, req);
+
+	return rval;
+}
+
+/* With -Z, note when the answer to the oldest query started to arrive. */
+static void
+bgpq_first_byte(struct bgpq_expander *b, struct bgpq_server *s,
+    const char *p, const char *end)
+{
+	struct request	*req;
+
+	if (b->stats == NULL || p == end)
+		return;
+
+	if ((req = STAILQ_FIRST(&s->rq)) != NULL && req->first.tv_sec == 0
+	    && req->first.tv_nsec == 0)
+		req->first = s->lastread;
+}
+
+/* Hand the complete answers in a server's buffer to their queries. */
+static int
+bgpq_server_parse(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	struct request	*req;
+	char		*p = s->buf, *end = s->buf + s->len, *nl, *eon;
+	char		*body;
+	unsigned long	 togot;
+	int		 rval = 1;
+
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		bgpq_first_byte(b, s, p, end);
+
+		if ((req = STAILQ_FIRST(&s->rq)) == NULL) {
+			bgpq_server_fail(b, s, "Unexpected data from IRRd: "
+			    "%.*s", (int)(nl - p), p);
+			return rval;
+		}
+
+		body = NULL;
+		togot = 0;
+
+		if (p[0] == 'A') {
+			togot = strtoul(p + 1, &eon, 10);
+			if (eon != nl) {
+				sx_report(SX_ERROR,"A-code finished with wrong"
+				    " char '%c'(%.*s)\n", *eon, (int)(nl - p),
+				    p);
+				exit(1);
+			}
+			body = nl + 1;
+			/* the data, then the line with the final code */
+			if ((unsigned long)(end - body) <= togot)
+				break;
+			if ((nl = memchr(body + togot, '\n',
+			    end - body - togot)) == NULL)
+				break;
+			body[togot] = 0;
+		}
+
+		STAILQ_REMOVE_HEAD(&s->rq, next);
+		s->queued--;
+		clock_gettime(CLOCK_MONOTONIC, &s->answered);
+
+		if (b->stats != NULL && !(req->flags & REQ_LOST))
+			bgpq_stats_query(b->stats, req, nl + 1 - p);
+
+		if (!bgpq_answer(b, s, req, p, nl - p + 1, body, togot))
+			rval = 0;
+
+		p = nl + 1;
+	}
+
+	bgpq_first_byte(b, s, p, end);
+
+	memmove(s->buf, p, end - p);
+	s->len = end - p;
+
+	return rval;
+}
+
+static int
+bgpq_server_read(struct bgpq_expander *b, struct bgpq_server *s)
+{
+	ssize_t	 ret;
+
+	if (s->size - s->len < 4096) {
+		s->size = s->size ? s->size * 2 : 16384;
+		if ((s->buf = realloc(s->buf, s->size)) == NULL)
+			err(1, NULL);
+	}
+
+	ret = bgpq_irrd_read(s->fd, s->buf + s->len, s->size - s->len);
+	if (ret == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 1;
+		bgpq_server_fail(b, s, "Error reading data from IRRd: %s",
 		    strerror(errno));
+		return 1;
+	} else if (ret == 0) {
+		bgpq_server_fail(b, s, "EOF from IRRd");
+		return 1;
+	}
+
+	s->len += ret;
+	clock_gettime(CLOCK_MONOTONIC, &s->lastread);
+	if (b->stats != NULL)
+		b->stats->bytes += ret;
+
+	return bgpq_server_parse(b, s);
+}
+
+/* Queries sent and not answered yet, over all servers. */
+static unsigned int
+bgpq_inflight(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	struct request		*req;
+	unsigned int		 n = 0;
+
+	STAILQ_FOREACH(s, &b->servers, entry)
+		STAILQ_FOREACH(req, &s->rq, next)
+			n++;
+
+	return n;
+}
+
+/* A query as it is printed in messages, without the newline. */
+static int
+bgpq_reqlen(const struct request *req)
+{
+	return req->size > 0 && req->request[req->size - 1] == '\n' ?
+	    req->size - 1 : req->size;
+}
+
+/* The oldest of the queries on a queue, by the time they were pipelined. */
+static struct request *
+bgpq_oldest(struct requests *rq, struct request *oldest, unsigned int *n)
+{
+	struct request	*req;
+
+	STAILQ_FOREACH(req, rq, next) {
+		if (req->flags & (REQ_SOURCES | REQ_LOST))
+			continue;
+		(*n)++;
+		if (oldest == NULL || bgpq_since(&req->queued) >
+		    bgpq_since(&oldest->queued))
+			oldest = req;
+	}
+
+	return oldest;
+}
+
+/*
+ * The run took longer than -q run=. Name the oldest query still waiting,
+ * then either give up or drop everything that is left and go on with what
+ * was collected.
+ */
+static void
+bgpq_run_expired(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	struct sourceset	*ss;
+	struct request		*req, *oldest = NULL;
+	unsigned int		 n = 0;
+
+	if (!b->timedout && !b->failed) {
+		STAILQ_FOREACH(s, &b->servers, entry) {
+			STAILQ_FOREACH(req, &s->rq, next)
+				SX_DEBUG(debug_expander, "%s:%s: %.*s waiting "
+				    "for %.1f seconds\n", s->host, s->port,
+				    bgpq_reqlen(req), req->request,
+				    bgpq_since(&req->queued));
+			oldest = bgpq_oldest(&s->rq, oldest, &n);
+			oldest = bgpq_oldest(&s->wq, oldest, &n);
+		}
+		oldest = bgpq_oldest(&b->wq, oldest, &n);
+		STAILQ_FOREACH(ss, &b->sourcesets, entry)
+			oldest = bgpq_oldest(&ss->wq, oldest, &n);
+
+		sx_report(SX_ERROR, "Run not finished after %i seconds, %u "
+		    "queries unanswered, the oldest waiting for %.1f seconds: "
+		    "%.*s%s\n", b->rtimeout, n,
+		    oldest ? bgpq_since(&oldest->queued) : 0.0,
+		    oldest ? bgpq_reqlen(oldest) : 0,
+		    oldest ? oldest->request : "",
+		    b->expire == BGPQ_EXPIRE_PARTIAL ? ", the output is "
+		    "incomplete" : "");
+		if (b->expire == BGPQ_EXPIRE_PARTIAL)
+			b->timedout = b->partial = 1;
+		else
+			b->failed = 1;
+	}
+
+	bgpq_drop_all(b);
+}
+
+/*
+ * A server didn't finish answering a query within -q query= seconds. The
+ * query is sent again after a reconnect, possibly to another server, or
+ * given up on, or the run ends.
+ */
+static void
+bgpq_query_expired(struct bgpq_expander *b, struct bgpq_server *s,
+    struct request *req)
+{
+	if (b->expire == BGPQ_EXPIRE_FAIL) {
+		sx_report(SX_ERROR, "%s:%s: no answer to %.*s within %i "
+		    "seconds\n", s->host, s->port, bgpq_reqlen(req),
+		    req->request, b->qtimeout);
+		bgpq_abort(b);
+		return;
+	}
+
+	if (b->expire == BGPQ_EXPIRE_RETRY && req->retries >= BGPQ_RETRIES) {
+		sx_report(SX_ERROR, "%s:%s: no answer to %.*s within %i "
+		    "seconds, sent %u times\n", s->host, s->port,
+		    bgpq_reqlen(req), req->request, b->qtimeout,
+		    req->retries + 1);
+		bgpq_abort(b);
+		return;
+	}
+
+	if (b->expire == BGPQ_EXPIRE_RETRY) {
+		req->retries++;
+		bgpq_server_fail(b, s, "no answer to %.*s within %i seconds",
+		    bgpq_reqlen(req), req->request, b->qtimeout);
+		return;
+	}
+
+	/* the server is dropped with it, and frees it as lost */
+	if (req->twin != NULL) {
+		req->twin->twin = NULL;
+		req->twin = NULL;
+	} else
+		b->piped--;
+	req->flags |= REQ_LOST;
+	b->partial = 1;
+
+	bgpq_server_fail(b, s, "no answer to %.*s within %i seconds, the "
+	    "output is incomplete", bgpq_reqlen(req), req->request,
+	    b->qtimeout);
+}
+
+/*
+ * Enforce the -q deadlines. A server answers in order, so the query it is
+ * working on is the first one it has, since it was sent or since the
+ * answer before it, whichever came last. Returns the milliseconds until
+ * the next deadline, or -1 for none.
+ */
+static int
+bgpq_deadlines(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	struct request		*req;
+	double			 left, t;
+	int			 next = -1;
+
+	if (b->rtimeout > 0) {
+		if ((left = b->rtimeout - bgpq_since(&b->started)) <= 0) {
+			bgpq_run_expired(b);
+			return -1;
+		}
+		next = left * 1000 + 1;
+	}
+
+	if (b->qtimeout == 0)
+		return next;
+
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1 || (req = STAILQ_FIRST(&s->rq)) == NULL)
+			continue;
+		t = bgpq_since(&req->sent);
+		if (bgpq_since(&s->answered) < t)
+			t = bgpq_since(&s->answered);
+		if ((left = b->qtimeout - t) <= 0) {
+			bgpq_query_expired(b, s, req);
+			continue;
+		}
+		if (next == -1 || left * 1000 + 1 < next)
+			next = left * 1000 + 1;
+	}
+
+	return next;
+}
+
+/*
+ * Run the pipelined queries until all of them are answered, spreading
+ * them over the servers that are up.
+ */
+static int
+bgpq_read(struct bgpq_expander *b)
+{
+	struct bgpq_server	*s;
+	struct timespec		 polled;
+	unsigned int		 nservers = 0;
+	int			 n, i, ret, retry, timeout, deadline;
+	int			 rval = 1;
+
+	STAILQ_FOREACH(s, &b->servers, entry)
+		nservers++;
+
+	struct pollfd		 pfd[nservers];
+	struct bgpq_server	*ps[nservers];
+
+	/* queued after the run was given up on */
+	if (b->failed) {
+		bgpq_drop_all(b);
+		return 0;
+	}
+
+	while (b->piped > 0) {
+		/* the last queries may be given up on */
+		deadline = bgpq_deadlines(b);
+		if (b->piped == 0)
+			break;
+		retry = bgpq_servers_retry(b);
+		if (b->failed)
+			break;
+		bgpq_schedule(b);
+
+		n = 0;
+		STAILQ_FOREACH(s, &b->servers, entry) {
+			if (s->fd == -1)
+				continue;
+			pfd[n].fd = s->fd;
+			pfd[n].events = POLLIN;
+			if (!STAILQ_EMPTY(&s->wq))
+				pfd[n].events |= POLLOUT;
+			ps[n++] = s;
+		}
+
+		timeout = n > 1 ? 1000 : -1;
+		if (retry != -1 && (timeout == -1 || retry < timeout))
+			timeout = retry;
+		if (deadline != -1 && (timeout == -1 || deadline < timeout))
+			timeout = deadline;
+
+		if (b->stats != NULL) {
+			bgpq_stats_inflight(b->stats, bgpq_inflight(b));
+			clock_gettime(CLOCK_MONOTONIC, &polled);
+		}
+
+		ret = poll(pfd, n, timeout);
+
+		if (b->stats != NULL)
+			b->stats->wait += bgpq_since(&polled);
+
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			sx_report(SX_ERROR, "poll error %i: %s\n", errno,
+			    strerror(errno));
+			bgpq_abort(b);
+			break;
+		}
 
-	if (!STAILQ_EMPTY(&b->wq) && FD_ISSET(b->fd, &wfd))
-		bgpq_write(b);
+		for (i = 0; i < n; i++) {
+			s = ps[i];
+			if (s->fd != -1 && pfd[i].revents & POLLOUT)
+				bgpq_write(b, s);
+			if (s->fd != -1
+			    && pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+				if (!bgpq_server_read(b, s))
+					rval = 0;
+		}
 
-	if (FD_ISSET(b->fd, &rfd))
-		return read(b->fd, buffer, size);
+		if (n > 1)
+			bgpq_servers_check(b);
+	}
 
-	goto repeat;
+	return b->failed ? 0 : rval;
 }
 
+/*
+ * Without pipelining, open a new connection to the server in place of
+ * one that stopped answering, with the same sources.
+ */
 static int
-bgpq_read(struct bgpq_expander *b)
+bgpq_sync_reconnect(struct bgpq_expander *b)
 {
-	static char response[256];
-	static int off = 0;
-	int rval = 1;
-
-	if (!STAILQ_EMPTY(&b->wq))
-		bgpq_write(b);
-
-	while(!STAILQ_EMPTY(&b->rq)) {
-		int			 ret = 0;
-		char			*cres;
-		struct request	*req = STAILQ_FIRST(&b->rq);
+	struct bgpq_server	*s;
+	char			*sources;
+	int			 fd;
 
-		SX_DEBUG(debug_expander > 2, "waiting for answer to %s,"
-		    "init %i '%.*s'\n", req->request, off, off, response);
+	STAILQ_FOREACH(s, &b->servers, entry)
+		if (s->fd == b->fd)
+			break;
 
-		if ((cres=strchr(response, '\n')) != NULL)
-			goto have;
+	close(b->fd);
+	b->fd = -1;
+	if (s == NULL)
+		return 0;
+	s->fd = -1;
 
-repeat:
-		ret = bgpq_selread(b, response + off, sizeof(response) - off);
-		if (ret < 0) {
-			if (errno == EAGAIN)
-				goto repeat;
-			sx_report(SX_FATAL,"Error reading data from IRRd: "
-			    "%s (dequeue)\n", strerror(errno));
-		} else if (ret == 0) {
-			sx_report(SX_FATAL,"EOF from IRRd (dequeue)\n");
-		}
-		off += ret;
+	if ((fd = bgpq_connect(s->host, s->port, b->identify,
+	    b->ctimeout)) == -1)
+		return 0;
+	if (b->sources && b->sources[0] != 0 && !bgpq_select_sources(b, fd)) {
+		close(fd);
+		return 0;
+	}
+	s->fd = b->fd = fd;
 
-		if (!(cres = strchr(response, '\n')))
-			goto repeat;
+	if ((sources = b->fdsources) != NULL) {
+		b->fdsources = NULL;
+		bgpq_expand_irrd(b, NULL, NULL, "!s%s", sources);
+		free(sources);
+	}
 
-have:
-		SX_DEBUG(debug_expander > 5, "got response of %.*s\n", off,
-		    response);
+	return !b->failed;
+}
 
-		if (response[0] == 'A') {
-			char		*eon, *c;
-			unsigned long	 offset = 0;
-			unsigned long 	 togot = strtoul(response + 1, &eon, 10);
-			char 		*recvbuffer = malloc(togot + 2);
+/*
+ * Without pipelining, a query or the run is past its -q deadline. Returns
+ * 1 to send the query again on a new connection, 0 to go on without it or
+ * after giving up on the run.
+ */
+static int
+bgpq_sync_expired(struct bgpq_expander *b, struct request *req)
+{
+	if (b->rtimeout > 0 && bgpq_since(&b->started) >= b->rtimeout) {
+		sx_report(SX_ERROR, "Run not finished after %i seconds, "
+		    "waiting for %.1f seconds: %.*s%s\n", b->rtimeout,
+		    bgpq_since(&req->sent), bgpq_reqlen(req), req->request,
+		    b->expire == BGPQ_EXPIRE_PARTIAL ? ", the output is "
+		    "incomplete" : "");
+		if (b->expire == BGPQ_EXPIRE_PARTIAL)
+			b->timedout = b->partial = 1;
+		else
+			bgpq_abort(b);
+		return 0;
+	}
 
-			if (recvbuffer == NULL)
-				err(1, NULL);
+	if (b->expire == BGPQ_EXPIRE_FAIL) {
+		sx_report(SX_ERROR, "No answer to %.*s within %i seconds\n",
+		    bgpq_reqlen(req), req->request, b->qtimeout);
+		bgpq_abort(b);
+		return 0;
+	}
 
-			memset(recvbuffer, 0, togot + 2);
+	if (b->expire == BGPQ_EXPIRE_RETRY && req->retries >= BGPQ_RETRIES) {
+		sx_report(SX_ERROR, "No answer to %.*s within %i seconds, sent "
+		    "%u times\n", bgpq_reqlen(req), req->request, b->qtimeout,
+		    req->retries + 1);
+		bgpq_abort(b);
+		return 0;
+	}
 
-			if (!eon || *eon != '\n') {
-				sx_report(SX_ERROR,"A-code finished with wrong"
-				    " char '%c'(%s)\n", eon ? *eon : '0',
-				    response);
-				exit(1);
-			}
+	sx_report(SX_NOTICE, "No answer to %.*s within %i seconds, "
+	    "reconnecting%s\n", bgpq_reqlen(req), req->request, b->qtimeout,
+	    b->expire == BGPQ_EXPIRE_PARTIAL ? ", the output is incomplete" :
+	    "");
 
-			if ((unsigned)(off - ((eon + 1) - response)) > togot) {
-				// full response and more data is already in buffer
-				memcpy(recvbuffer, eon + 1, togot);
-				offset = togot;
-				memmove(response, eon + 1 + togot,
-				    off - ((eon + 1) - response) - togot);
-				off -= togot + ((eon + 1) - response);
-				memset(response + off, 0,
-				    sizeof(response) - off);
-			} else {
-				/* response is not yet fully buffered */
-				memcpy(recvbuffer, eon + 1,
-				    off - ((eon + 1) - response));
-				offset = off - ((eon + 1) - response);
-				memset(response, 0, sizeof(response));
-				off = 0;
-			}
+	if (!bgpq_sync_reconnect(b)) {
+		bgpq_abort(b);
+		return 0;
+	}
 
-			SX_DEBUG(debug_expander > 5,
-			    "starting read with ready '%.*s', waiting for "
-			    "%lu\n", (int)offset, recvbuffer, togot - offset);
+	if (b->expire == BGPQ_EXPIRE_RETRY) {
+		req->retries++;
+		return 1;
+	}
 
-			if (off > 0)
-				goto have3;
-			if (offset == togot)
-				goto reread2;
+	b->partial = 1;
 
-reread:
+	return 0;
+}
 
-			ret = bgpq_selread(b, recvbuffer + offset, togot - offset);
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					goto reread;
-				sx_report(SX_FATAL,"Error reading IRRd: %s "
-				    "(dequeue, result)\n", strerror(errno));
-			} else if (ret == 0) {
-				sx_report(SX_FATAL,"EOF from IRRd (dequeue, "
-				    "result)\n");
-			}
-			SX_DEBUG(debug_expander > 5,
-				"Read1: got '%.*s'\n", ret,
-				    recvbuffer + offset);
-			offset += ret;
-			if (offset < togot) {
-				SX_DEBUG(debug_expander > 5, "expected %lu, got "
-				    "%lu expanding %s", togot,
-				    strlen(recvbuffer), req->request);
-				goto reread;
-			}
+/*
+ * Read the answer to a query without pipelining. Fails with ETIMEDOUT once
+ * the query or the run is past its -q deadline.
+ */
+static int
+bgpq_selread(struct bgpq_expander *b, struct request *req, char *buffer,
+    int size)
+{
+	fd_set		 rfd;
+	struct timespec	 selected;
+	struct timeval	 tv, *tvp;
+	double		 left, run;
+	int		 ret;
 
-reread2:
-			ret = bgpq_selread(b, response + off,
-			    sizeof(response) - off);
-
-			if (ret < 0) {
-				if (errno == EAGAIN)
-					goto reread2;
-				sx_report(SX_FATAL,"Error reading IRRd: %s "
-				    "(dequeue,final)\n", strerror(errno));
-			} else if (ret == 0) {
-				sx_report(SX_FATAL,"EOF from IRRd (dequeue,"
-				    "final)\n");
-			}
+repeat:
+	FD_ZERO(&rfd);
+	FD_SET(b->fd, &rfd);
 
-			SX_DEBUG(debug_expander > 5,
-				"Read2: got '%.*s'\n", ret, response + off);
+	tvp = NULL;
+	if (b->qtimeout > 0 || b->rtimeout > 0) {
+		left = b->qtimeout > 0 ?
+		    b->qtimeout - bgpq_since(&req->sent) : b->rtimeout;
+		run = b->rtimeout > 0 ?
+		    b->rtimeout - bgpq_since(&b->started) : left;
+		if (run < left)
+			left = run;
+		if (left <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		tv.tv_sec = left;
+		tv.tv_usec = (left - tv.tv_sec) * 1000000;
+		tvp = &tv;
+	}
 
-			off += ret;
+	if (b->stats != NULL)
+		clock_gettime(CLOCK_MONOTONIC, &selected);
 
-have3:
-			if (!(cres = strchr(response, '\n')))
-				goto reread2;
-
-			SX_DEBUG(debug_expander>=3,"Got %s (%lu bytes of %lu) "
-			    "in response to %sfinal code: %.*s", recvbuffer,
-			    strlen(recvbuffer), togot, req->request,
-			    off, response);
-
-			for (c = recvbuffer; c < recvbuffer + togot;) {
-				size_t spn=strcspn(c," \n");
-				if (spn)
-					c[spn] = 0;
-				if (c[0] == 0)
-					break;
-				if (!req->callback(c, b, req)) rval = 0;
-				c += spn + 1;
-			}
-			assert(c == recvbuffer + togot);
-			memset(recvbuffer, 0, togot + 2);
-			free(recvbuffer);
-		} else if (response[0] == 'C') {
-			/* No data */
-			SX_DEBUG(debug_expander,"No data expanding %s",
-			    req->request);
-			if (b->validate_asns)
-				bgpq_expander_invalidate_asn(b, req->request);
-		} else if (response[0] == 'D') {
-			SX_DEBUG(debug_expander, "Key not found expanding %s",
-			    req->request);
-			if (b->validate_asns)
-				bgpq_expander_invalidate_asn(b, req->request);
-			rval = 0;
-		} else if (response[0] == 'E') {
-			sx_report(SX_ERROR, "Multiple keys expanding %s: %s",
-			    req->request, response);
-			rval = 0;
-		} else if ( response[0] == 'F') {
-			sx_report(SX_ERROR, "Error expanding %s: %s",
-			    req->request, response);
-			rval = 0;
-		} else {
-			sx_report(SX_ERROR,"Wrong reply: %s to %s", response,
-			    req->request);
-			exit(1);
-		}
+	ret = select(b->fd + 1, &rfd, NULL, NULL, tvp);
 
-		memmove(response, cres + 1, off - ((cres + 1) - response));
-		off -= (cres + 1) - response;
-		memset(response + off, 0, sizeof(response) - off);
-		SX_DEBUG(debug_expander > 5,
-		    "fixed response of %i, %.*s\n", off, off, response);
+	if (b->stats != NULL)
+		b->stats->wait += bgpq_since(&selected);
 
-		STAILQ_REMOVE_HEAD(&b->rq, next);
-		b->piped--;
+	if (ret == 0)
+		goto repeat;
+	else if (ret == -1 && errno == EINTR)
+		goto repeat;
+	else if (ret == -1)
+		return -1;
 
-		request_free(req);
+	if (FD_ISSET(b->fd, &rfd)) {
+		ret = bgpq_irrd_read(b->fd, buffer, size);
+		if (b->stats != NULL && ret > 0)
+			b->stats->bytes += ret;
+		return ret;
 	}
 
-	return rval;
+	goto repeat;
 }
 
 int
@@ -878,37 +2219,64 @@ bgpq_expand_irrd(struct bgpq_expander *b,
 	char			 request[256], response[256];
 	va_list			 ap;
 	ssize_t			 ret;
-	int			 off = 0;
+	int			 off;
 	struct request	*req;
+	unsigned long		 received = 0;
 	int rval = 1;
 
+	/*
+	 * Past the -q run= deadline, going on with what was collected, or
+	 * the run was given up on.
+	 */
+	if (b->timedout || b->failed)
+		return 0;
+
 	va_start(ap, fmt);
 	vsnprintf(request, sizeof(request), fmt, ap);
 	va_end(ap);
 
-	req = request_alloc(request, callback, udata);
+	/* -T: the connection already has these sources */
+	if (strncmp(request, "!s", 2) == 0 && b->fdsources != NULL &&
+	    strcmp(request + 2, b->fdsources) == 0) {
+		SX_DEBUG(debug_expander, "expander: skipping %s", request);
+		return 1;
+	}
+
+	req = request_alloc(b, request, callback, udata);
 
+send:
 	SX_DEBUG(debug_expander, "expander sending: %s", request);
 
-	if ((ret = write(b->fd, request, strlen(request)) == 0) || ret == -1) {
+	if ((ret = bgpq_irrd_write(b->fd, request, strlen(request))) <= 0) {
 		sx_report(SX_ERROR,
 			"Partial write of request to IRRd: %li bytes, %s\n",
 			ret, strerror(errno));
-		exit(1);
+		goto fail;
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &req->sent);
+	if (b->stats != NULL)
+		received = b->stats->bytes;
+
 	memset(response, 0, sizeof(response));
+	off = 0;
 
 repeat:
-	ret = bgpq_selread(b, response+off, sizeof(response)-off);
+	ret = bgpq_selread(b, req, response+off, sizeof(response)-off);
+	if (ret == -1 && errno == ETIMEDOUT)
+		goto expired;
 	if (ret < 0) {
 		sx_report(SX_ERROR, "Error reading IRRd: %s\n",
 		    strerror(errno));
-		exit(1);
+		goto fail;
 	} else if (ret == 0) {
-		sx_report(SX_FATAL, "EOF reading IRRd\n");
+		sx_report(SX_ERROR, "EOF reading IRRd\n");
+		goto fail;
 	}
 
+	if (b->stats != NULL && off == 0)
+		clock_gettime(CLOCK_MONOTONIC, &req->first);
+
 	off += ret;
 
 	if (strchr(response, '\n') == NULL)
@@ -955,24 +2323,42 @@ repeat:
 			goto reread2;
 
 reread:
-		ret = bgpq_selread(b, recvbuffer + offset, togot - offset);
+		ret = bgpq_selread(b, req, recvbuffer + offset,
+		    togot - offset);
+		if (ret == -1 && errno == ETIMEDOUT) {
+			free(recvbuffer);
+			goto expired;
+		}
 		if (ret == 0) {
-			sx_report(SX_FATAL,"EOF from IRRd (expand,result)\n");
+			sx_report(SX_ERROR,"EOF from IRRd (expand,result)\n");
+			free(recvbuffer);
+			goto fail;
 		} else if (ret < 0) {
-			sx_report(SX_FATAL,"Error reading IRRd: %s "
+			sx_report(SX_ERROR,"Error reading IRRd: %s "
 			    "(expand,result)\n", strerror(errno));
+			free(recvbuffer);
+			goto fail;
 		}
 		offset += ret;
 		if (offset < togot)
 			goto reread;
 
 reread2:
-		ret = bgpq_selread(b, response+off, sizeof(response) - off);
+		ret = bgpq_selread(b, req, response+off,
+		    sizeof(response) - off);
+		if (ret == -1 && errno == ETIMEDOUT) {
+			free(recvbuffer);
+			goto expired;
+		}
 		if (ret < 0) {
-			sx_report(SX_FATAL, "error reading IRRd: %s\n",
+			sx_report(SX_ERROR, "error reading IRRd: %s\n",
 			    strerror(errno));
+			free(recvbuffer);
+			goto fail;
 		} else if (ret == 0) {
-			sx_report(SX_FATAL, "eof reading IRRd\n");
+			sx_report(SX_ERROR, "eof reading IRRd\n");
+			free(recvbuffer);
+			goto fail;
 		}
 		off += ret;
 
@@ -1001,6 +2387,11 @@ have3:
 		/* no data */
 		if (b->validate_asns)
 			bgpq_expander_invalidate_asn(b, request);
+		if (strncmp(request, "!s", 2) == 0) {
+			free(b->fdsources);
+			if ((b->fdsources = strdup(request + 2)) == NULL)
+				err(1, NULL);
+		}
 	} else if (response[0] == 'D') {
 		SX_DEBUG(debug_expander, "Key not found expanding %s",
 			req->request);
@@ -1017,129 +2408,353 @@ have3:
 		sx_report(SX_ERROR,"Wrong reply: %s", response);
 		exit(1);
 	}
-	request_free(req);
+
+	if (b->stats != NULL)
+		bgpq_stats_query(b->stats, req, b->stats->bytes - received);
+
+	request_free(b, req);
 
 	return rval;
+
+expired:
+	if (bgpq_sync_expired(b, req))
+		goto send;
+
+	request_free(b, req);
+
+	return 0;
+
+fail:
+	bgpq_abort(b);
+	request_free(b, req);
+
+	return 0;
 }
 
-int
-bgpq_expand(struct bgpq_expander *b)
+#define BGPQ_ATTEMPT_DELAY	250	/* ms between connection attempts */
+
+/*
+ * Start a non-blocking connection attempt. Returns the socket, or -1 with
+ * errno set if the attempt failed right away.
+ */
+static int
+bgpq_connect_start(const struct addrinfo *ai)
 {
-	char			*source;
-	struct slentry		*mc;
-	struct addrinfo 	 hints, *res = NULL, *rp;
-	struct linger		 sl;
-	struct asn_entry	*asne;
-	int			 fd = -1, err, ret, aquery = 0, nodelay = 1;
-	int			 slen;
+	struct linger	sl;
+	int		fd, err;
 
 	sl.l_onoff = 1;
 	sl.l_linger = 5;
 
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, 0)) == -1)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &sl,
+	    sizeof(struct linger)) == -1 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+		goto fail;
+
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ||
+	    errno == EINPROGRESS)
+		return fd;
+
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/*
+ * Connect to the first address of the server that answers, the way RFC
+ * 8305 (Happy Eyeballs) does it: the addresses are tried alternating
+ * between address families, and a new attempt is started every
+ * BGPQ_ATTEMPT_DELAY ms, or as soon as one fails, without waiting for the
+ * ones still pending. A dead address family costs a quarter of a second
+ * rather than a SYN timeout. Gives up after timeout seconds, 0 for none.
+ */
+static int
+bgpq_connect_tcp(const char *server, const char *port, int timeout)
+{
+	struct addrinfo 	 hints, *res = NULL, *rp, **ai;
+	struct pollfd		*pfd;
+	struct timespec		 start, last;
+	struct timeval		 tv;
+	socklen_t		 len;
+	double			 left;
+	int			 fd = -1, error, nodelay = 1, lasterr = 0;
+	int			 n = 0, np = 0, next = 0, pending = 0, hurry = 0;
+	int			 i, k, wait;
+
 	memset(&hints, 0, sizeof(struct addrinfo));
 
 	hints.ai_socktype = SOCK_STREAM;
 
-	err=getaddrinfo(b->server, b->port, &hints, &res);
+	error = getaddrinfo(server, port, &hints, &res);
 
-	if (err) {
-		sx_report(SX_ERROR,"Unable to resolve %s: %s\n", b->server,
-		    gai_strerror(err));
-		exit(1);
+	if (error) {
+		sx_report(SX_ERROR,"Unable to resolve %s: %s\n", server,
+		    gai_strerror(error));
+		return -1;
+	}
+
+	for (rp = res; rp; rp = rp->ai_next)
+		n++;
+
+	if ((ai = calloc(2 * n, sizeof(*ai))) == NULL ||
+	    (pfd = calloc(n, sizeof(*pfd))) == NULL)
+		err(1, NULL);
+
+	/* the family getaddrinfo() put first, alternating with the others */
+	for (rp = res; rp; rp = rp->ai_next)
+		if (rp->ai_family == res->ai_family)
+			ai[n + np++] = rp;
+	k = n + np;
+	for (rp = res; rp; rp = rp->ai_next)
+		if (rp->ai_family != res->ai_family)
+			ai[k++] = rp;
+	for (i = 0, k = 0; i < n; i++) {
+		if ((i % 2 == 0 && k < np) || i - k >= n - np)
+			ai[i] = ai[n + k++];
+		else
+			ai[i] = ai[n + np + i - k];
 	}
 
-	for (rp=res; rp; rp = rp->ai_next) {
-		fd = socket(rp->ai_family, rp->ai_socktype, 0);
-		if (fd == -1) {
-			if (errno == EPROTONOSUPPORT || errno == EAFNOSUPPORT)
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+
+	while (fd == -1) {
+		if (next < n && (pending == 0 || hurry ||
+		    bgpq_since(&last) * 1000 >= BGPQ_ATTEMPT_DELAY)) {
+			SX_DEBUG(debug_expander, "expander: connecting to %s, "
+			    "address %d of %d\n", server, next + 1, n);
+			clock_gettime(CLOCK_MONOTONIC, &last);
+			hurry = 0;
+			if ((pfd[pending].fd =
+			    bgpq_connect_start(ai[next++])) == -1) {
+				if (errno != EPROTONOSUPPORT &&
+				    errno != EAFNOSUPPORT)
+					lasterr = errno;
+				hurry = 1;
 				continue;
-			sx_report(SX_ERROR,"Unable to create socket: %s\n",
-			    strerror(errno));
-			exit(1);
+			}
+			pfd[pending].events = POLLOUT;
+			pfd[pending].revents = 0;
+			pending++;
 		}
-		if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &sl,
-		    sizeof(struct linger))) {
-			sx_report(SX_ERROR,"Unable to set linger on socket: "
-			    "%s\n", strerror(errno));
-			close(fd);
-			exit(1);
+
+		if (pending == 0)
+			break;
+
+		wait = -1;
+		if (next < n) {
+			wait = BGPQ_ATTEMPT_DELAY - bgpq_since(&last) * 1000;
+			if (wait < 0)
+				wait = 0;
 		}
-		err = connect(fd, rp->ai_addr, rp->ai_addrlen);
-		if (err) {
-			close(fd);
-			fd = -1;
-			continue;
+		if (timeout > 0) {
+			if ((left = timeout - bgpq_since(&start)) <= 0) {
+				lasterr = ETIMEDOUT;
+				break;
+			}
+			if (wait == -1 || wait > left * 1000)
+				wait = left * 1000 + 1;
 		}
 
-		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
-		    sizeof(nodelay)) == -1)
-			SX_DEBUG(debug_expander, "Unable to set TCP_NODELAY on"
-			    " socket: %s\n", strerror(errno));
+		if (poll(pfd, pending, wait) == -1) {
+			if (errno == EINTR)
+				continue;
+			lasterr = errno;
+			break;
+		}
 
-		break;
+		for (i = 0; i < pending && fd == -1; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			len = sizeof(error);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &error,
+			    &len) == -1)
+				error = errno;
+			if (error == 0) {
+				fd = pfd[i].fd;
+				pfd[i] = pfd[--pending];
+				break;
+			}
+			/* a failed attempt doesn't delay the next one */
+			lasterr = error;
+			hurry = 1;
+			close(pfd[i].fd);
+			pfd[i--] = pfd[--pending];
+		}
 	}
 
+	for (i = 0; i < pending; i++)
+		close(pfd[i].fd);
+	free(pfd);
+	free(ai);
 	freeaddrinfo(res);
 
 	if (fd == -1) {
 		/* all our attempts to connect failed */
 		sx_report(SX_ERROR,"All attempts to connect %s failed, last"
-		    " error: %s\n", b->server, strerror(errno));
-		exit(1);
+		    " error: %s\n", server, strerror(lasterr));
+		return -1;
 	}
 
-	b->fd = fd;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	/* the same limit for the answers to the preamble */
+	if (timeout > 0) {
+		tv.tv_sec = timeout;
+		tv.tv_usec = 0;
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof(tv)) == -1)
+			SX_DEBUG(debug_expander, "Unable to set SO_RCVTIMEO "
+			    "on socket: %s\n", strerror(errno));
+	}
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+	    sizeof(nodelay)) == -1)
+		SX_DEBUG(debug_expander, "Unable to set TCP_NODELAY on"
+		    " socket: %s\n", strerror(errno));
+
+	return fd;
+}
+
+/*
+ * Connect to an IRRd, or to the stand-in replaying a recording (-y),
+ * switch it to multiple command mode and identify ourselves. Connecting,
+ * and waiting for an answer before the queries start, give up after
+ * timeout seconds, 0 waits as long as the system does. Returns the
+ * socket, or -1 after reporting what failed.
+ */
+/* see bgpq_irrd_write() */
+static void
+bgpq_nosigpipe(int fd)
+{
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+	int	one = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+	(void)fd;
+#endif
+}
+
+int
+bgpq_connect(const char *server, const char *port, int identify, int timeout)
+{
+	int	fd, ret;
+
+	if (bgpq_session_replaying())
+		fd = bgpq_session_connect();
+	else
+		fd = bgpq_connect_tcp(server, port, timeout);
+
+	if (fd == -1)
+		return -1;
+
+	bgpq_nosigpipe(fd);
+	bgpq_session_open(fd, server, port);
 
 	SX_DEBUG(debug_expander, "Sending '!!' to server to request for the"
 	    " connection to remain open\n");
-	if ((ret = write(fd, "!!\n", 3)) != 3) {
+	if ((ret = bgpq_irrd_write(fd, "!!\n", 3)) != 3) {
 		sx_report(SX_ERROR, "Partial write of multiple command mode "
 		    "to IRRd: %i bytes, %s\n", ret, strerror(errno));
 		close(fd);
-		exit(1);
+		return -1;
 	}
 
-	if (b->identify) {
+	if (identify) {
 		SX_DEBUG(debug_expander, "b->identify: Sending '!n "
 		    PACKAGE_STRING "' to server.\n");
 		char ident[128];
 		int ilen = snprintf(ident, sizeof(ident), "!n" PACKAGE_STRING "\n");
 		if (ilen > 0) {
-			if ((ret = write(fd, ident, ilen)) != ilen) {
+			if ((ret = bgpq_irrd_write(fd, ident, ilen)) != ilen) {
 				sx_report(SX_ERROR, "Partial write of "
 				    "identifier to IRRd: %i bytes, %s\n",
 				    ret, strerror(errno));
 				close(fd);
-				exit(1);
+				return -1;
 			}
 			memset(ident, 0, sizeof(ident));
-			if (0 < read(fd, ident, sizeof(ident))) {
+			if (0 < bgpq_irrd_read(fd, ident, sizeof(ident))) {
 				SX_DEBUG(debug_expander, "Got answer %s", ident);
 			} else {
 				sx_report(SX_ERROR, "ident, failed read from IRRd\n");
 				close(fd);
-				exit(1);
+				return -1;
 			}
 		} else {
 			sx_report(SX_ERROR, "snprintf(ident) failed\n");
 			close(fd);
-			exit(1);
+			return -1;
 		}
 	}
 
+	return fd;
+}
+
+int
+bgpq_expand(struct bgpq_expander *b)
+{
+	char			*source, sbuf[256];
+	struct slentry		*mc;
+	struct asn_entry	*asne;
+	struct bgpq_server	*s;
+	int			 fd, ret, aquery = 0;
+
+	if (STAILQ_EMPTY(&b->servers))
+		bgpq_server_alloc(b, b->server, b->port);
+
+	clock_gettime(CLOCK_MONOTONIC, &b->started);
+
+	if (b->stats != NULL) {
+		clock_gettime(CLOCK_MONOTONIC, &b->stats->start);
+		bgpq_stats_phase(b->stats, PHASE_CONNECT);
+	}
+
+	/*
+	 * Pipelined queries are spread over all servers, without pipelining
+	 * the first one that can be reached is used.
+	 */
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		/* a daemon may hand over a connection it opened in advance */
+		if (s == STAILQ_FIRST(&b->servers) && b->fd != -1) {
+			s->fd = b->fd;
+			bgpq_nosigpipe(s->fd);
+		} else
+			s->fd = bgpq_connect(s->host, s->port,
+			    b->identify, b->ctimeout);
+		if (s->fd != -1 && !b->pipelining)
+			break;
+	}
+
+	STAILQ_FOREACH(s, &b->servers, entry)
+		if (s->fd != -1)
+			break;
+	if (s == NULL)
+		return 0;
+
+	b->fd = fd = s->fd;
+
+	if (b->stats != NULL)
+		bgpq_stats_phase(b->stats, PHASE_SOURCES);
+
 	/* Test whether the server has support for the A query */
 	if (b->generation >= T_PREFIXLIST && !STAILQ_EMPTY(&b->macroses)) {
 		char aret[128];
 		char aresp[] = "F Missing required set name for A query";
 		SX_DEBUG(debug_expander, "Testing support for A queries\n");
-		if ((ret = write(fd, "!a\n", 3)) != 3) {
+		if ((ret = bgpq_irrd_write(fd, "!a\n", 3)) != 3) {
 			sx_report(SX_ERROR, "Partial write of '!a' test query "
 			    "to IRRd: %i bytes, %s\n", ret, strerror(errno));
-			close(fd);
-			exit(1);
+			goto fail;
 		}
 		memset(aret, 0, sizeof(aret));
-		if (0 < read(fd, aret, sizeof(aret))) {
+		if (0 < bgpq_irrd_read(fd, aret, sizeof(aret))) {
 			if (strncmp(aret, aresp, strlen(aresp)) == 0) {
 				SX_DEBUG(debug_expander, "Server supports A query\n");
 				aquery = 1;
@@ -1148,68 +2763,49 @@ bgpq_expand(struct bgpq_expander *b)
 			}
 		} else {
 			sx_report(SX_ERROR, "A query test failed read from IRRd\n");
-			close(fd);
-			exit(1);
+			goto fail;
 		}
 	}
 
 	if (b->sources && b->sources[0] != 0) {
-		b->defaultsources = strdup(b->sources);
-	} else if (b->usesource) {
-		if (b->sources && b->sources[0] != 0) {
-			b->defaultsources = strdup(b->sources);
-		} else {
-			b->defaultsources = bgpq_get_irrd_sources(b->fd);
-		}
-	} else {
-		b->defaultsources = bgpq_get_irrd_sources(b->fd);
-	}
+		if ((b->defaultsources = strdup(b->sources)) == NULL)
+			err(1, NULL);
+	} else if ((b->defaultsources = bgpq_get_irrd_sources(b->fd)) == NULL)
+		goto fail;
 
-	if (b->sources && b->sources[0] != 0) {
-		slen = strlen(b->sources) + 4;
-		if (slen < 256)
-			slen = 256;
-		char sources[slen];
-		slen = snprintf(sources, sizeof(sources), "!s%s\n", b->sources);
-		if (slen > 0) {
-			SX_DEBUG(debug_expander, "Requesting sources %s", sources);
-			if ((ret = write(fd, sources, slen)) != slen) {
-				sx_report(SX_ERROR, "Partial write of sources to "
-				    "IRRd: %i bytes, %s\n", ret, strerror(errno));
-				close(fd);
-				exit(1);
-			}
-			memset(sources, 0, sizeof(sources));
-			if (0 < read(fd, sources, sizeof(sources))) {
-				SX_DEBUG(debug_expander, "Got answer %s", sources);
-				if (sources[0] != 'C') {
-					sx_report(SX_ERROR, "Invalid source(s) "
-					    "'%s': %s\n", b->sources, sources);
-					close(fd);
-					exit(1);
-				}
-			} else {
-				sx_report(SX_ERROR, "failed to read sources\n");
-				close(fd);
-				exit(1);
-			}
-		} else {
-			sx_report(SX_ERROR, "snprintf(sources) failed\n");
-			close(fd);
-			exit(1);
-		}
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1)
+			continue;
+		if (b->sources && b->sources[0] != 0
+		    && !bgpq_select_sources(b, s->fd))
+			goto fail;
+		if (b->pipelining)
+			fcntl(s->fd, F_SETFL, O_NONBLOCK|(fcntl(s->fd, F_GETFL)));
 	}
 
-	if (pipelining)
-		fcntl(fd, F_SETFL, O_NONBLOCK|(fcntl(fd, F_GETFL)));
+	if (b->stats != NULL)
+		bgpq_stats_phase(b->stats, PHASE_RECURSION);
+
+	/*
+	 * When pipelining, the prefixes of every AS number are queued as
+	 * soon as it is found, so the recursion and the prefix queries go
+	 * out together and are read in one go.
+	 */
+	if (b->pipelining &&
+	    (b->generation >= T_PREFIXLIST || b->validate_asns)) {
+		b->fetchasns = 1;
+		RB_FOREACH(asne, asn_tree, &b->asnlist)
+			bgpq_pipeline_asn(b, asne->asn);
+	}
 
 	STAILQ_FOREACH(mc, &b->macroses, entry) {
 		if (!b->maxdepth && RB_EMPTY(&b->stoplist)) {
 			if (b->usesource) {
-				source = bgpq_get_source(mc->text);
+				source = bgpq_get_source(mc->text, sbuf,
+				    sizeof(sbuf));
 				if (source){
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n", source);
+					if (b->pipelining){
+						bgpq_pipeline_sources(b, source);
 						bgpq_pipeline(b, bgpq_expanded_macro_limit, b,
 							"!i%s\n", bgpq_get_asset(mc->text));
 					} else {
@@ -1217,10 +2813,9 @@ bgpq_expand(struct bgpq_expander *b)
 						bgpq_expand_irrd(b, bgpq_expanded_macro_limit,
 							b, "!i%s\n", bgpq_get_asset(mc->text));
 					}
-					free(source);
 				} else {
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n",
+					if (b->pipelining){
+						bgpq_pipeline_sources(b,
 							b->defaultsources);
 						bgpq_pipeline(b, bgpq_expanded_macro_limit, b,
 							"!i%s\n", bgpq_get_asset(mc->text));
@@ -1231,17 +2826,35 @@ bgpq_expand(struct bgpq_expander *b)
 							"!i%s\n", bgpq_get_asset(mc->text));
 					}
 				}
-			} else if (aquery)
+			} else if (aquery && b->pipelining) {
+				b->aqueried = 1;
+				bgpq_pipeline(b, bgpq_expanded_prefix, b,
+				    "!a%s%s\n",
+				    b->family == AF_INET ? "4" : "6",
+				    bgpq_get_asset(mc->text));
+				if (b->tree6 != NULL)
+					bgpq_pipeline(b, bgpq_expanded_prefix,
+					    b, "!a6%s\n",
+					    bgpq_get_asset(mc->text));
+			} else if (aquery) {
+				b->aqueried = 1;
 				bgpq_expand_irrd(b, bgpq_expanded_prefix, b,
 				    "!a%s%s\n",
 				    b->family == AF_INET ? "4" : "6",
 				    bgpq_get_asset(mc->text));
+				if (b->tree6 != NULL)
+					bgpq_expand_irrd(b, bgpq_expanded_prefix,
+					    b, "!a6%s\n",
+					    bgpq_get_asset(mc->text));
+			} else if (b->pipelining)
+				bgpq_pipeline(b, bgpq_expanded_macro, b,
+				    "!i%s,1\n", bgpq_get_asset(mc->text));
 			else
 				bgpq_expand_irrd(b, bgpq_expanded_macro, b,
 				    "!i%s,1\n", bgpq_get_asset(mc->text));
 		} else {
 			bgpq_expander_add_already(b, bgpq_get_asset(mc->text));
-			if (pipelining)
+			if (b->pipelining)
 				bgpq_pipeline(b, bgpq_expanded_macro_limit,
 				    NULL, "!i%s\n", bgpq_get_asset(mc->text));
 			else
@@ -1250,26 +2863,28 @@ bgpq_expand(struct bgpq_expander *b)
 		}
 	}
 
-	if (pipelining){
-		bgpq_pipeline(b, NULL, NULL, "!s%s\n", b->defaultsources);
+	if (b->pipelining){
+		bgpq_pipeline_sources(b, b->defaultsources);
+		if (!b->fetchasns)
+			bgpq_read(b);
 	} else {
 		bgpq_expand_irrd(b, NULL, NULL, "!s%s\n", b->defaultsources);
 	}
 
-	if (pipelining) {
-		if (!STAILQ_EMPTY(&b->wq))
-			bgpq_write(b);
-		if (!STAILQ_EMPTY(&b->rq))
-			bgpq_read(b);
-	}
+	if (b->failed)
+		goto done;
+
+	if (b->stats != NULL)
+		bgpq_stats_phase(b->stats, PHASE_PREFIXES);
 
 	if (b->generation >= T_PREFIXLIST || b->validate_asns) {
 		STAILQ_FOREACH(mc, &b->rsets, entry) {
 			if (b->usesource) {
-				source = bgpq_get_source(mc->text);
+				source = bgpq_get_source(mc->text, sbuf,
+				    sizeof(sbuf));
 				if (source){
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n", source);
+					if (b->pipelining){
+						bgpq_pipeline_sources(b, source);
 						if (b->family == AF_INET)
 							bgpq_pipeline(b, bgpq_expanded_prefix,
 				    			NULL, "!i%s\n", bgpq_get_rset(mc->text));
@@ -1285,10 +2900,9 @@ bgpq_expand(struct bgpq_expander *b)
 							bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
 								NULL, "!i%s\n", bgpq_get_rset(mc->text));
 					}
-					free(source);
 				} else {
-					if (pipelining){
-						bgpq_pipeline(b, NULL, NULL, "!s%s\n",
+					if (b->pipelining){
+						bgpq_pipeline_sources(b,
 							b->defaultsources);
 						if (b->family == AF_INET)
 							bgpq_pipeline(b, bgpq_expanded_prefix,
@@ -1308,9 +2922,8 @@ bgpq_expand(struct bgpq_expander *b)
 					}
 				}
 			} else {
-				if (pipelining){
-					bgpq_pipeline(b, NULL, NULL, "!s%s\n",
-						b->defaultsources);
+				if (b->pipelining){
+					bgpq_pipeline_sources(b, b->defaultsources);
 					if (b->family == AF_INET)
 						bgpq_pipeline(b, bgpq_expanded_prefix,
 							NULL, "!i%s,1\n", bgpq_get_rset(mc->text));
@@ -1330,49 +2943,51 @@ bgpq_expand(struct bgpq_expander *b)
 			}
 		}
 
-		RB_FOREACH(asne, asn_tree, &b->asnlist) {
-			if (b->family == AF_INET6) {
-				if (!pipelining) {
+		if (!b->pipelining) {
+			RB_FOREACH(asne, asn_tree, &b->asnlist) {
+				if (b->family == AF_INET6 || b->tree6 != NULL)
 					bgpq_expand_irrd(b, bgpq_expanded_v6prefix,
 					    NULL, "!6as%" PRIu32 "\n", asne->asn);
-				} else {
-					bgpq_pipeline(b, bgpq_expanded_v6prefix,
-					    NULL, "!6as%" PRIu32 "\n", asne->asn);
-				}
-			} else {
-				if (!pipelining) {
+				if (b->family == AF_INET)
 					bgpq_expand_irrd(b, bgpq_expanded_prefix,
 					    NULL, "!gas%" PRIu32 "\n", asne->asn);
-				} else {
-					bgpq_pipeline(b, bgpq_expanded_prefix,
-					    NULL, "!gas%" PRIu32 "\n", asne->asn);
-				}
 			}
-		}
+		} else
+			bgpq_read(b);
+		b->fetchasns = 0;
+	}
 
-		if (pipelining) {
-			if (!STAILQ_EMPTY(&b->wq))
-				bgpq_write(b);
-			if (!STAILQ_EMPTY(&b->rq))
-				bgpq_read(b);
+done:
+	STAILQ_FOREACH(s, &b->servers, entry) {
+		if (s->fd == -1)
+			continue;
+		if ((ret = bgpq_irrd_write(s->fd, "!q\n", 3)) != 3) {
+			sx_report(SX_ERROR, "Partial write of quit to IRRd: "
+			    "%i bytes, %s\n", ret, strerror(errno));
+			// not worth exiting due to this
 		}
+		if (b->pipelining) {
+			int fl = fcntl(s->fd, F_GETFL);
+			fl &= ~O_NONBLOCK;
+			fcntl(s->fd, F_SETFL, fl);
+		}
+		close(s->fd);
+		s->fd = -1;
 	}
+	b->fd = -1;
+	free(b->fdsources);
+	b->fdsources = NULL;
 
-	if ((ret = write(fd, "!q\n", 3)) != 3) {
-		sx_report(SX_ERROR, "Partial write of quit to IRRd: %i bytes, %s\n",
-		    ret, strerror(errno));
-		// not worth exiting due to this
-	}
-	if (pipelining) {
-		int fl = fcntl(fd, F_GETFL);
-		fl &= ~O_NONBLOCK;
-		fcntl(fd, F_SETFL, fl);
+	if (b->stats != NULL) {
+		b->stats->elapsed = bgpq_since(&b->stats->start);
+		bgpq_stats_phase(b->stats, PHASE_NONE);
 	}
 
-	close(fd);
-	free(b->defaultsources);
+	return !b->failed;
 
-	return 1;
+fail:
+	bgpq_abort(b);
+	goto done;
 }
 
 void
@@ -1451,7 +3066,54 @@ expander_freeall(struct bgpq_expander *expander)
 		free(asne);
 	}
 
+	while (!STAILQ_EMPTY(&expander->servers)) {
+		struct bgpq_server *s = STAILQ_FIRST(&expander->servers);
+		STAILQ_REMOVE_HEAD(&expander->servers, entry);
+		STAILQ_CONCAT(&s->rq, &s->wq);
+		while (!STAILQ_EMPTY(&s->rq)) {
+			struct request *req = STAILQ_FIRST(&s->rq);
+			STAILQ_REMOVE_HEAD(&s->rq, next);
+			request_free(expander, req);
+		}
+		if (s->fd != -1)
+			close(s->fd);
+		free(s->host);
+		free(s->port);
+		free(s->buf);
+		free(s);
+	}
+
+	while (!STAILQ_EMPTY(&expander->wq)) {
+		struct request *req = STAILQ_FIRST(&expander->wq);
+		STAILQ_REMOVE_HEAD(&expander->wq, next);
+		request_free(expander, req);
+	}
+
+	while (!STAILQ_EMPTY(&expander->sourcesets)) {
+		struct sourceset *ss = STAILQ_FIRST(&expander->sourcesets);
+		STAILQ_REMOVE_HEAD(&expander->sourcesets, entry);
+		while (!STAILQ_EMPTY(&ss->wq)) {
+			struct request *req = STAILQ_FIRST(&ss->wq);
+			STAILQ_REMOVE_HEAD(&ss->wq, next);
+			request_free(expander, req);
+		}
+		free(ss->sources);
+		free(ss);
+	}
+	free(expander->fdsources);
+
+	while (!SLIST_EMPTY(&expander->reqchunks)) {
+		struct request_chunk *rc = SLIST_FIRST(&expander->reqchunks);
+		SLIST_REMOVE_HEAD(&expander->reqchunks, next);
+		free(rc);
+	}
+	STAILQ_INIT(&expander->reqfree);
+
+	free(expander->defaultsources);
 	sx_radix_tree_freeall(expander->tree);
+	if (expander->tree6 != NULL)
+		sx_radix_tree_freeall(expander->tree6);
+	sx_prefix_set_free(expander->seen);
 
 	bgpq_prequest_freeall(expander->firstpipe);
 	bgpq_prequest_freeall(expander->lastpipe);
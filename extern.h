@@ -27,6 +27,8 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 
+#include <time.h>
+
 #include "sx_prefix.h"
 
 struct slentry {
@@ -64,6 +66,7 @@ typedef enum {
 	V_NOKIA_MD,
 	V_ARISTA,
 	V_NOKIA_SRL,
+	V_BINARY,
 } bgpq_vendor_t;
 
 typedef enum {
@@ -77,8 +80,90 @@ typedef enum {
 	T_ROUTE_FILTER_LIST
 } bgpq_gen_t;
 
+/*
+ * Binary output (-Y). All integers are big-endian. The header is followed
+ * by namelen bytes of list name, zero-padded to a multiple of 8, and then
+ * by count records of recsize bytes each: struct bgpq4_bin_prefix for
+ * prefix-lists, a 4-byte AS number for as-paths and as-sets.
+ */
+#define BGPQ4_BIN_MAGIC		"BGQ4"
+#define BGPQ4_BIN_VERSION	1
+#define BGPQ4_BIN_PREFIXES	1
+#define BGPQ4_BIN_ASNS		2
+
+struct bgpq4_bin_header {
+	char		magic[4];
+	uint8_t		version;
+	uint8_t		kind;
+	uint8_t		recsize;
+	uint8_t		family;		/* 4, 6, or 0 for AS numbers */
+	uint32_t	count;
+	uint32_t	namelen;
+};
+
+struct bgpq4_bin_prefix {
+	uint8_t		family;		/* 4 or 6 */
+	uint8_t		len;
+	uint8_t		ge;
+	uint8_t		le;
+	uint8_t		addr[16];	/* IPv4 in the first 4 bytes */
+};
+
+/*
+ * Snapshot of an expansion (-C/-c): the 24 byte header, the IRR sources used
+ * (srclen bytes, zero-padded to a multiple of 8), nprefixes prefix records
+ * as in the binary output and nasns 4-byte AS numbers, all big-endian.
+ */
+#define BGPQ4_SNAP_MAGIC	"BGQS"
+#define BGPQ4_SNAP_VERSION	2
+#define BGPQ4_SNAP_AGGREGATED	0x01
+#define BGPQ4_SNAP_REFINED	0x02
+#define BGPQ4_SNAP_PREFIXES	0x04	/* the prefixes were collected */
+#define BGPQ4_SNAP_ASNS		0x08	/* the AS numbers were collected */
+
+struct bgpq4_snap_header {
+	char		magic[4];
+	uint8_t		version;
+	uint8_t		family;		/* 4 or 6 */
+	uint8_t		flags;
+	uint8_t		reserved;
+	uint32_t	nprefixes;
+	uint32_t	nasns;
+	uint32_t	srclen;
+	uint32_t	created;	/* UNIX time */
+};
+
+/*
+ * Daemon (-k) protocol. A request is the command line arguments, each
+ * terminated by a NUL byte, followed by an empty argument. The response
+ * is a sequence of frames: a type byte, a 4-byte big-endian length and
+ * that many bytes of data. 'O' frames carry standard output, 'E' frames
+ * standard error and the last, 'X', the 4-byte exit status.
+ */
+#define BGPQ4_DAEMON_STDOUT	'O'
+#define BGPQ4_DAEMON_STDERR	'E'
+#define BGPQ4_DAEMON_EXIT	'X'
+#define BGPQ4_DAEMON_MAXREQ	65536
+
+/*
+ * IRRd session recording (-O/-y): the magic line, then frames of a type
+ * byte, a space, the connection number, a space and the data length in
+ * decimal, a newline, the data and another newline. An 'o' frame starts
+ * a connection and holds the server's host:port, '>' frames hold bytes
+ * sent to it and '<' frames bytes received from it.
+ */
+#define BGPQ4_SESSION_MAGIC	"bgpq4 session 1\n"
+#define BGPQ4_SESSION_OPEN	'o'
+#define BGPQ4_SESSION_SENT	'>'
+#define BGPQ4_SESSION_RECV	'<'
+
 struct bgpq_expander;
 
+struct bgpq_server;
+
+#define BGPQ_REQUEST_TEXT	128	/* longer queries are allocated */
+#define BGPQ_REQUEST_CHUNK	256	/* requests allocated at once */
+
 struct request {
 	STAILQ_ENTRY(request)	 next;
 	char			*request;
@@ -87,10 +172,133 @@ struct request {
 	unsigned int	 	 depth;
 	int	 	 	 (*callback)(char *, struct bgpq_expander *,
 				    struct request *);
+	const char		*sources;	/* !s in effect, NULL: the run's */
+	struct bgpq_server	*server;	/* where it was queued */
+	struct request		*twin;		/* -Q: the same query elsewhere */
+	int			 flags;
+	unsigned int		 retries;	/* -q expire=retry */
+	struct timespec		 queued;	/* when it was pipelined */
+	struct timespec		 sent;
+	struct timespec		 first;		/* first byte of the answer */
+	char			 text[BGPQ_REQUEST_TEXT];
+};
+
+#define REQ_SOURCES	0x01	/* !s sent ahead of a query */
+#define REQ_LOST	0x02	/* the twin was answered first */
+
+STAILQ_HEAD(requests, request);
+
+/*
+ * Pipelined queries wait for a server in one queue per set of sources,
+ * so that a server can be kept on the sources it has and !s is sent
+ * once per switch rather than once per query.
+ */
+struct sourceset {
+	STAILQ_ENTRY(sourceset)	 entry;
+	struct requests		 wq;
+	char			*sources;
 };
 
+/* Requests are carved from chunks and recycled, see request_alloc(). */
+struct request_chunk {
+	SLIST_ENTRY(request_chunk)	 next;
+	struct request			 req[BGPQ_REQUEST_CHUNK];
+};
+
+/*
+ * One of the IRRd servers given with -h. Pipelined queries are spread
+ * over all servers that are up, and each server tracks the sources it
+ * was last switched to so that !s is sent only when they change.
+ */
+struct bgpq_server {
+	STAILQ_ENTRY(bgpq_server) entry;
+	char			*host;
+	char			*port;
+	int			 fd;
+	const char		*sources;	/* last !s sent, NULL: the run's */
+	struct requests		 wq, rq;
+	unsigned int		 queued;	/* requests on wq and rq */
+	char			*buf;		/* received, not yet parsed */
+	size_t			 len, size;
+	struct timespec		 lastread;
+	struct timespec		 answered;	/* the last complete answer */
+	double			 srtt;		/* smoothed answer time, seconds */
+	unsigned int		 samples;
+	int			 reconnect;	/* failed, reconnect at retry */
+	unsigned int		 retries;	/* since the last answer */
+	struct timespec		 retry;
+};
+
+/*
+ * Query statistics (-Z). Answer times are counted per kind of query in
+ * buckets of up to 1, 2, 4 ... 16384 milliseconds and one for the rest.
+ */
+#define BGPQ_QTYPES		6	/* !i, !gas, !6as, !a, !s, other */
+#define BGPQ_STATS_BUCKETS	16
+
+struct bgpq_histogram {
+	unsigned long		 count[BGPQ_STATS_BUCKETS];
+	double			 sum, max;	/* milliseconds */
+};
+
+struct bgpq_qstats {
+	unsigned long		 queries;
+	unsigned long		 bytes;
+	struct bgpq_histogram	 first;		/* sent to first byte */
+	struct bgpq_histogram	 done;		/* sent to complete */
+};
+
+struct bgpq_inflight {
+	unsigned long		 tick;
+	unsigned int		 n;
+};
+
+/* Phases of a run timed by -Z, in the order they happen. */
+typedef enum {
+	PHASE_NONE = 0,
+	PHASE_CONNECT,
+	PHASE_SOURCES,
+	PHASE_RECURSION,	/* as-sets and route-sets, !a queries */
+	PHASE_PREFIXES,		/* !gas/!6as, building the tree */
+	PHASE_AGGREGATE,	/* -A, and -R and -r with it */
+	PHASE_PRINT,
+	PHASE_TEARDOWN,
+	BGPQ_PHASES
+} bgpq_phase_t;
+
+struct bgpq_phase {
+	int			 used;
+	double			 wall, cpu;	/* seconds */
+	long			 maxrss;	/* KB, at the end of the phase */
+};
+
+struct bgpq_stats {
+	struct timespec		 start;
+	double			 elapsed;
+	double			 wait;		/* blocked waiting for IRRd */
+	unsigned long		 bytes;
+	struct bgpq_qstats	 type[BGPQ_QTYPES];
+	unsigned int		 maxinflight;
+	struct bgpq_inflight	*inflight;
+	size_t			 ninflight, sinflight;
+	bgpq_phase_t		 phase;		/* the one running */
+	struct timespec		 phasestart;
+	double			 phasecpu;
+	struct bgpq_phase	 phases[BGPQ_PHASES];
+	unsigned long		 asns, nodes, glue;
+	unsigned long		 outbytes;
+};
+
+#define BGPQ_CONNECT_TIMEOUT	15	/* -q default, seconds */
+
+/* what -q expire= does when a deadline passes */
+#define BGPQ_EXPIRE_FAIL	0	/* exit with an error */
+#define BGPQ_EXPIRE_RETRY	1	/* send the query again elsewhere */
+#define BGPQ_EXPIRE_PARTIAL	2	/* go on without it, warn */
+
 struct bgpq_expander {
 	struct sx_radix_tree	 	*tree;
+	struct sx_radix_tree	 	*tree6;	/* -4 -6: IPv6 half, tree is IPv4 */
 	int			 	 family;
 	char				*sources;
 	char				*defaultsources;
@@ -112,10 +320,34 @@ struct bgpq_expander {
 	char				*port;
 	char				*format;
 	unsigned int		 	 maxlen;
+	int			 	 stream;
+	unsigned int			 streamed;	/* -i: prefixes printed */
+	struct sx_prefix_set		*seen;
 	int			 	 fd;
+	int			 	 race;
+	int				 pipelining;	/* 0 with -T */
+	int				 specialasn;	/* -p */
+	int				 aqueried;	/* !a: AS numbers unknown */
+	int				 threads;	/* -V, 0: one per CPU */
+	int				 ctimeout;	/* -q connect=, seconds */
+	int				 qtimeout;	/* -q query=, 0: none */
+	int				 rtimeout;	/* -q run=, 0: none */
+	int				 expire;	/* -q expire= */
+	int				 partial;	/* queries were given up */
+	int				 timedout;	/* past the run= deadline */
+	int				 failed;	/* the run can't go on */
+	struct timespec			 started;
+	int				 fetchasns;	/* queue !gas as found */
+	struct sourceset		*cursources;	/* NULL: the run's */
+	char				*fdsources;	/* -T: last !s sent */
+	struct bgpq_stats		*stats;
 	RB_HEAD(asn_tree, asn_entry)	 asnlist;
-	STAILQ_HEAD(requests, request)	 wq, rq;
+	struct requests			 wq;		/* the run's sources */
+	struct requests			 reqfree;
+	SLIST_HEAD(, request_chunk)	 reqchunks;
+	STAILQ_HEAD(servers, bgpq_server) servers;
 	STAILQ_HEAD(slentries, slentry)	 macroses, rsets;
+	STAILQ_HEAD(sourcesets, sourceset) sourcesets;
 	RB_HEAD(tentree, sx_tentry)	 already, stoplist;
 };
 
@@ -129,13 +361,21 @@ int bgpq_expander_add_as(struct bgpq_expander *b, char *as);
 int bgpq_expander_add_prefix(struct bgpq_expander *b, char *prefix);
 int bgpq_expander_add_prefix_range(struct bgpq_expander *b, char *prefix);
 int bgpq_expander_add_stop(struct bgpq_expander *b, char *object);
+int bgpq_expander_add_server(struct bgpq_expander *b, const char *server);
+int bgpq_expander_load(struct bgpq_expander *b, const char *file, int *flags);
+int bgpq_expander_save(struct bgpq_expander *b, const char *file, int flags);
 
 char* bgpq_get_asset(char *object);
 char* bgpq_get_rset(char *object);
-char* bgpq_get_source(char *object);
+char* bgpq_get_source(char *object, char *buf, size_t len);
 
+int bgpq_connect(const char *server, const char *port, int identify,
+    int timeout);
 int bgpq_expand(struct bgpq_expander *b);
 
+void bgpq4_aswidth_default(struct bgpq_expander *b);
+int bgpq4_print_supported(const struct bgpq_expander *b);
+void bgpq4_print_target(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_prefixlist(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_eacl(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_aspath(FILE *f, struct bgpq_expander *b);
@@ -143,6 +383,36 @@ void bgpq4_print_asset(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_oaspath(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_aslist(FILE *f, struct bgpq_expander *b);
 void bgpq4_print_route_filter_list(FILE *f, struct bgpq_expander *b);
+void bgpq4_print_stream_prefix(FILE *f, struct bgpq_expander *b,
+    struct sx_prefix *p);
+void bgpq4_print_stream_end(FILE *f, struct bgpq_expander *b);
+void bgpq4_print_diff(FILE *f, struct bgpq_expander *b,
+    struct bgpq_expander *prev);
+void bgpq4_count_binary_prefix(struct sx_radix_node *n, void *count);
+void bgpq4_print_binary_prefix(struct sx_radix_node *n, void *f);
+
+void bgpq_stats_query(struct bgpq_stats *st, const struct request *req,
+    size_t bytes);
+void bgpq_stats_inflight(struct bgpq_stats *st, unsigned int n);
+void bgpq_stats_phase(struct bgpq_stats *st, bgpq_phase_t phase);
+void bgpq_stats_count(struct bgpq_stats *st, struct bgpq_expander *b);
+int bgpq_stats_write(const struct bgpq_stats *st, const char *file);
+void bgpq_stats_free(struct bgpq_stats *st);
+
+int bgpq_session_record(const char *file);
+int bgpq_session_replay(const char *file);
+int bgpq_session_replaying(void);
+int bgpq_session_connect(void);
+void bgpq_session_open(int fd, const char *server, const char *port);
+int bgpq_session_end(void);
+ssize_t bgpq_irrd_read(int fd, void *buf, size_t len);
+ssize_t bgpq_irrd_write(int fd, const void *buf, size_t len);
+
+int bgpq4_daemon(const char *path, const char *hosts, const char *server,
+    const char *port, int ttl, int ctimeout, int (*run)(int, char **));
+int bgpq4_daemon_irrd(const char *server, const char *port);
+extern const char bgpq4_optstring[];
+int bgpq4_client(const char *path, int argc, char *argv[]);
 
 void sx_radix_node_freeall(struct sx_radix_node *n);
 void sx_radix_tree_freeall(struct sx_radix_tree *t);
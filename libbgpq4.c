@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The library interface of bgpq4.h: a handle wraps an expander and the
+ * settings the command line keeps outside of it, and maps the public
+ * enums onto the internal ones so that those can change.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bgpq4.h"
+#include "extern.h"
+#include "sx_report.h"
+
+struct bgpq4 {
+	struct bgpq_expander	 b;		/* first, see bgpq4_new() */
+	char			*name;
+	char			*sources;
+	char			*format;
+	int			 aggregate;
+	int			 expanded;
+};
+
+struct bgpq4_walk {
+	void			(*cb)(const struct bgpq4_prefix *, void *);
+	void			*arg;
+};
+
+static const bgpq_vendor_t vendors[] = {
+	[BGPQ4_VENDOR_CISCO] = V_CISCO,
+	[BGPQ4_VENDOR_JUNIPER] = V_JUNIPER,
+	[BGPQ4_VENDOR_CISCO_XR] = V_CISCO_XR,
+	[BGPQ4_VENDOR_JSON] = V_JSON,
+	[BGPQ4_VENDOR_BIRD] = V_BIRD,
+	[BGPQ4_VENDOR_OPENBGPD] = V_OPENBGPD,
+	[BGPQ4_VENDOR_FORMAT] = V_FORMAT,
+	[BGPQ4_VENDOR_NOKIA] = V_NOKIA,
+	[BGPQ4_VENDOR_HUAWEI] = V_HUAWEI,
+	[BGPQ4_VENDOR_HUAWEI_XPL] = V_HUAWEI_XPL,
+	[BGPQ4_VENDOR_MIKROTIK6] = V_MIKROTIK6,
+	[BGPQ4_VENDOR_MIKROTIK7] = V_MIKROTIK7,
+	[BGPQ4_VENDOR_NOKIA_MD] = V_NOKIA_MD,
+	[BGPQ4_VENDOR_ARISTA] = V_ARISTA,
+	[BGPQ4_VENDOR_NOKIA_SRL] = V_NOKIA_SRL,
+	[BGPQ4_VENDOR_BINARY] = V_BINARY,
+};
+
+static const bgpq_gen_t lists[] = {
+	[BGPQ4_LIST_PREFIX] = T_PREFIXLIST,
+	[BGPQ4_LIST_EACL] = T_EACL,
+	[BGPQ4_LIST_ROUTE_FILTER] = T_ROUTE_FILTER_LIST,
+	[BGPQ4_LIST_ASPATH] = T_ASPATH,
+	[BGPQ4_LIST_OASPATH] = T_OASPATH,
+	[BGPQ4_LIST_ASLIST] = T_ASLIST,
+	[BGPQ4_LIST_ASSET] = T_ASSET,
+};
+
+static char *
+bgpq4_strdup(const char *s)
+{
+	char	*d;
+
+	if ((d = strdup(s)) == NULL)
+		err(1, NULL);
+
+	return d;
+}
+
+struct bgpq4 *
+bgpq4_new(int af)
+{
+	struct bgpq4	*q;
+
+	if (af != AF_INET && af != AF_INET6) {
+		sx_report(SX_ERROR, "Unsupported address family %i\n", af);
+		return NULL;
+	}
+
+	if ((q = calloc(1, sizeof(struct bgpq4))) == NULL)
+		err(1, NULL);
+
+	/* on failure the expander is freed, and with it the handle */
+	if (!bgpq_expander_init(&q->b, af)) {
+		sx_report(SX_ERROR, "Unable to initialize the expander\n");
+		return NULL;
+	}
+
+	q->b.generation = T_PREFIXLIST;
+	q->b.maxlen = af == AF_INET ? 32 : 128;
+
+	return q;
+}
+
+void
+bgpq4_free(struct bgpq4 *q)
+{
+	if (q == NULL)
+		return;
+
+	expander_freeall(&q->b);
+	free(q->name);
+	free(q->sources);
+	free(q->format);
+	free(q);
+}
+
+int
+bgpq4_add_server(struct bgpq4 *q, const char *server)
+{
+	if (!bgpq_expander_add_server(&q->b, server)) {
+		sx_report(SX_ERROR, "Invalid server '%s'\n", server);
+		return 0;
+	}
+
+	return 1;
+}
+
+int
+bgpq4_set_sources(struct bgpq4 *q, const char *sources)
+{
+	free(q->sources);
+	q->b.sources = q->sources = bgpq4_strdup(sources);
+
+	return 1;
+}
+
+int
+bgpq4_set_name(struct bgpq4 *q, const char *name)
+{
+	free(q->name);
+	q->b.name = q->name = bgpq4_strdup(name);
+
+	return 1;
+}
+
+int
+bgpq4_set_output(struct bgpq4 *q, enum bgpq4_vendor vendor,
+    enum bgpq4_list list)
+{
+	if ((unsigned int)vendor >= sizeof(vendors) / sizeof(vendors[0])
+	    || (unsigned int)list >= sizeof(lists) / sizeof(lists[0])) {
+		sx_report(SX_ERROR, "Unknown output format %i or list %i\n",
+		    vendor, list);
+		return 0;
+	}
+
+	q->b.vendor = vendors[vendor];
+	q->b.generation = lists[list];
+	/* as -e does, Arista prefix-lists are always numbered */
+	q->b.sequence = q->b.vendor == V_ARISTA;
+	bgpq4_aswidth_default(&q->b);
+
+	return 1;
+}
+
+int
+bgpq4_set_format(struct bgpq4 *q, const char *format)
+{
+	free(q->format);
+	q->b.format = q->format = bgpq4_strdup(format);
+
+	return 1;
+}
+
+int
+bgpq4_set_asn(struct bgpq4 *q, uint32_t asn)
+{
+	if (asn == 0) {
+		sx_report(SX_ERROR, "Invalid AS number: 0\n");
+		return 0;
+	}
+
+	q->b.asnumber = asn;
+
+	return 1;
+}
+
+int
+bgpq4_set_aggregate(struct bgpq4 *q, int aggregate)
+{
+	q->aggregate = aggregate != 0;
+
+	return 1;
+}
+
+int
+bgpq4_set_maxlen(struct bgpq4 *q, unsigned int maxlen)
+{
+	unsigned int	max = q->b.family == AF_INET ? 32 : 128;
+
+	if (maxlen < 1 || maxlen > max) {
+		sx_report(SX_ERROR, "Invalid value for max-prefixlen: %u "
+		    "(1-%u)\n", maxlen, max);
+		return 0;
+	}
+
+	q->b.maxlen = maxlen;
+
+	return 1;
+}
+
+/*
+ * Objects are classified as on the command line: as-sets and route-sets,
+ * with an optional SOURCE:: prefix, AS numbers, prefixes and prefix
+ * ranges.
+ */
+int
+bgpq4_add(struct bgpq4 *q, const char *object)
+{
+	char	*o, *obj, *ec;
+	int	 ret;
+
+	if (q->expanded) {
+		sx_report(SX_ERROR, "Objects can't be added after the "
+		    "expansion\n");
+		return 0;
+	}
+
+	obj = o = bgpq4_strdup(object);
+	if ((ec = strstr(o, "::")) != NULL) {
+		q->b.usesource = 1;
+		obj = ec + 2;
+	}
+
+	if (!strncasecmp(obj, "AS-", 3)) {
+		ret = bgpq_expander_add_asset(&q->b, o);
+	} else if (!strncasecmp(obj, "RS-", 3)) {
+		ret = bgpq_expander_add_rset(&q->b, o);
+	} else if (!strncasecmp(obj, "AS", 2)) {
+		if ((ec = strchr(obj, ':')) == NULL)
+			ret = bgpq_expander_add_as(&q->b, o);
+		else if (!strncasecmp(ec + 1, "AS-", 3))
+			ret = bgpq_expander_add_asset(&q->b, o);
+		else if (!strncasecmp(ec + 1, "RS-", 3))
+			ret = bgpq_expander_add_rset(&q->b, o);
+		else {
+			sx_report(SX_ERROR, "Unknown sub-as object %s\n", o);
+			ret = 0;
+		}
+	} else if (strchr(o, '^') == NULL) {
+		if ((ret = bgpq_expander_add_prefix(&q->b, o)) == 0)
+			sx_report(SX_ERROR, "Unable to add prefix %s (bad "
+			    "prefix or address-family)\n", o);
+	} else if ((ret = bgpq_expander_add_prefix_range(&q->b, o)) == 0) {
+		sx_report(SX_ERROR, "Unable to add prefix-range %s (bad "
+		    "range or address-family)\n", o);
+	}
+
+	free(o);
+
+	return ret;
+}
+
+int
+bgpq4_add_except(struct bgpq4 *q, const char *object)
+{
+	char	*o;
+	int	 ret;
+
+	o = bgpq4_strdup(object);
+	ret = bgpq_expander_add_stop(&q->b, o);
+	free(o);
+
+	return ret;
+}
+
+/*
+ * Expand over fd, a connection to an IRRd the caller opened, or with
+ * fd -1 over connections to the servers added, rr.ntt.net without any.
+ * The connections are closed when done.
+ */
+int
+bgpq4_expand(struct bgpq4 *q, int fd)
+{
+	if (q->expanded) {
+		sx_report(SX_ERROR, "Objects can only be expanded once\n");
+		return 0;
+	}
+
+	q->b.fd = fd;
+	if (!bgpq_expand(&q->b))
+		return 0;
+	q->expanded = 1;
+
+	if (q->aggregate)
+		sx_radix_tree_aggregate(q->b.tree);
+
+	return 1;
+}
+
+/*
+ * Render the list as bgpq4(8) prints it into a buffer the caller frees.
+ */
+int
+bgpq4_render(struct bgpq4 *q, char **buf, size_t *len)
+{
+	struct bgpq_expander	*b = &q->b;
+	FILE			*f;
+
+	if (!bgpq4_print_supported(b)) {
+		sx_report(SX_ERROR, "Sorry, the list can't be rendered in "
+		    "this output format\n");
+		return 0;
+	}
+
+	if (b->generation < T_ASSET && b->asnumber == 0) {
+		sx_report(SX_ERROR, "Sorry, as-paths and as-lists need an AS "
+		    "number\n");
+		return 0;
+	}
+
+	/* the lists that have no way to say a range of lengths */
+	if (q->aggregate && b->generation >= T_PREFIXLIST
+	    && ((b->vendor == V_JUNIPER && b->generation == T_PREFIXLIST)
+	    || ((b->vendor == V_NOKIA || b->vendor == V_NOKIA_MD
+	    || b->vendor == V_NOKIA_SRL) && b->generation != T_PREFIXLIST))) {
+		sx_report(SX_ERROR, "Sorry, aggregated prefixes can't be "
+		    "rendered in this list\n");
+		return 0;
+	}
+
+	if ((f = open_memstream(buf, len)) == NULL)
+		err(1, NULL);
+
+	bgpq4_print_target(f, b);
+
+	if (fclose(f) != 0)
+		err(1, NULL);
+
+	return 1;
+}
+
+static void
+bgpq4_walk_prefix(struct sx_radix_node *n, void *arg)
+{
+	struct bgpq4_walk	*w = arg;
+	struct bgpq4_prefix	 p;
+
+	if (n->isGlue)
+		goto checkSon;
+
+	memset(&p, 0, sizeof(p));
+	p.family = n->prefix->family;
+	p.len = n->prefix->masklen;
+	sx_radix_node_range(n, &p.ge, &p.le);
+	memcpy(p.addr, n->prefix->addr.addrs, p.family == AF_INET ? 4 : 16);
+
+	w->cb(&p, w->arg);
+
+checkSon:
+	if (n->son)
+		bgpq4_walk_prefix(n->son, arg);
+}
+
+/*
+ * The expanded prefixes in the order the prefix-lists print them.
+ */
+void
+bgpq4_foreach_prefix(struct bgpq4 *q,
+    void (*cb)(const struct bgpq4_prefix *, void *), void *arg)
+{
+	struct bgpq4_walk	 w = { .cb = cb, .arg = arg };
+
+	sx_radix_tree_foreach(q->b.tree, bgpq4_walk_prefix, &w);
+}
+
+void
+bgpq4_foreach_asn(struct bgpq4 *q, void (*cb)(uint32_t, void *), void *arg)
+{
+	struct asn_entry	*asne;
+
+	RB_FOREACH(asne, asn_tree, &q->b.asnlist)
+		cb(asne->asn, arg);
+}
@@ -33,6 +33,9 @@
 #include <sys/socket.h>
 
 #include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,14 +47,27 @@
 
 extern int debug_expander;
 extern int debug_aggregation;
-extern int pipelining;
-extern int expand_special_asn;
+
+struct output {
+	STAILQ_ENTRY(output)	 entry;
+	char			*file;
+	FILE			*f;
+	bgpq_vendor_t		 vendor;
+	bgpq_gen_t		 generation;
+	int			 sequence;
+	int			 aswidth;
+};
+
+STAILQ_HEAD(outputs, output);
+
+const char bgpq4_optstring[] = "23467a:AbBc:C:dDEeF:g:S:I:ijJKk:f:l:L:m:M:"
+    "NnO:o:pq:QW:r:R:G:H:tTh:UuwxXy:YsvV:zZ:";
 
 static int
 usage(int ecode)
 {
 	printf("\nUsage: bgpq4 [-h host[:port]] [-S sources] [-E|G|H <num>"
-	    "|f <num>|t] [-46ABbdJjKNnpwXz] [-R len] <OBJECTS> ... "
+	    "|f <num>|t] [-46ABbdiJjKNnpwXYz] [-R len] <OBJECTS> ... "
 	    "[EXCEPT <OBJECTS> ...]\n");
 	printf("\nVendor targets:\n");
 	printf(" no option : Cisco IOS Classic (default)\n");
@@ -59,6 +75,7 @@ usage(int ecode)
 	printf(" -U        : Huawei\n");
 	printf(" -u        : Huawei XPL\n");
 	printf(" -j        : JSON\n");
+	printf(" -Y        : binary (see bgpq4(8) for the layout)\n");
 	printf(" -J        : Juniper Junos\n");
 	printf(" -K        : MikroTik RouterOSv6\n");
 	printf(" -K7       : MikroTik RouterOSv7\n");
@@ -73,6 +90,8 @@ usage(int ecode)
 	printf("\nInput filters:\n");
 	printf(" -4        : generate IPv4 prefix-lists (default)\n");
 	printf(" -6        : generate IPv6 prefix-lists\n");
+	printf(" -4 -6     : generate both, suffixing the names with -v4 and "
+	    "-v6\n");
 	printf(" -m len    : maximum prefix length (default: 32 for IPv4, "
 		"128 for IPv6)\n");
 	printf(" -L depth  : limit recursion depth (default: unlimited)\n"),
@@ -91,7 +110,16 @@ usage(int ecode)
 	printf(" -f number : generate input as-path access-list\n");
 	printf(" -G number : generate output as-path access-list\n");
 	printf(" -H number : generate origin as-lists (JunOS only)\n");
+	printf(" -I file   : only print the changes against file, the -Y output "
+	    "or -C\n"
+	    "             snapshot of a previous run (Cisco, Juniper and Nokia "
+	    "MD-CLI)\n");
+	printf(" -i        : print prefixes as they arrive, unsorted (JSON and "
+	    "-F only)\n");
 	printf(" -M match  : extra match conditions for JunOS route-filters\n");
+	printf(" -o flags=f: render to file f with the vendor/generation flags "
+	    "(e.g. JE=f),\n"
+	    "             may be repeated, use '-' for stdout\n");
 	printf(" -l name   : use specified name for generated access/prefix/.."
 		" list\n");
 	printf(" -p        : allow special ASNs like 23456 or in the private range\n");
@@ -105,11 +133,32 @@ usage(int ecode)
 		"infinity)\n");
 
 	printf("\nUtility operations:\n");
+	printf(" -C file   : save the expansion to a snapshot file\n");
+	printf(" -c file   : render a snapshot file instead of querying IRRd\n");
 	printf(" -d        : generate some debugging output\n");
+	printf(" -g secs   : cache daemon responses for secs seconds (default: 300)\n");
 	printf(" -h host   : host running IRRD software (default: rr.ntt.net)\n"
-		    "             use 'host:port' to specify alternate port\n");
+		    "             use 'host:port' to specify alternate port,\n"
+		    "             separate several equivalent servers by commas\n");
+	printf(" -k path   : run as a daemon serving requests on socket path\n");
+	printf(" -O file   : record the IRRd sessions to file\n");
+	printf(" -q list   : timeouts in seconds, connect=secs (default: 15), "
+	    "query=secs and\n"
+	    "             run=secs, and what to do when they pass: "
+	    "expire=fail (default),\n"
+	    "             retry or partial (see bgpq4(8))\n");
+	printf(" -Q        : send each query to two servers, use the first answer\n");
 	printf(" -T        : disable pipelining (not recommended)\n");
 	printf(" -v        : print version and exit\n");
+	printf(" -V threads: format prefix lists in that many threads "
+	    "(default: one per\n             CPU for long lists)\n");
+	printf(" -x path   : send the request to the daemon on socket path\n"
+		    "             (must be the first option)\n");
+	printf(" -y file   : replay the IRRd sessions recorded with -O instead of "
+	    "connecting\n");
+	printf(" -Z file   : write query and phase statistics as JSON to file, "
+	    "use '-'\n"
+	    "             for stderr\n");
 	printf("\n" PACKAGE_NAME " version: " PACKAGE_VERSION " "
 	    "(https://github.com/bgp/bgpq4)\n");
 	exit(ecode);
@@ -137,7 +186,7 @@ static void
 vendor_exclusive(void)
 {
 	fprintf(stderr, "-b (BIRD), -B (OpenBGPD), -F (formatted), -J (Junos),"
-	    " -j (JSON), -K[7] (Microtik ROS), -N (Nokia SR OS Classic),"
+	    " -j (JSON), -Y (binary), -K[7] (Microtik ROS), -N (Nokia SR OS Classic),"
 	    " -n (Nokia SR OS MD-CLI), -U (Huawei), -u (Huawei XPL),"
 	    "-e (Arista) and -X (IOS XR) options are mutually exclusive\n");
 	exit(1);
@@ -179,29 +228,377 @@ parseasnumber(struct bgpq_expander *expander, char *asnstr)
 	return 0;
 }
 
-int
-main(int argc, char* argv[])
+/*
+ * Checks that depend on the vendor and generation.  They are run for the
+ * command line target and, with -o, for every output target.
+ */
+static void
+check_target(struct bgpq_expander *b, int aggregate, int refine,
+    int refineLow)
+{
+	if (b->vendor == V_CISCO_XR
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_OASPATH) {
+		sx_report(SX_FATAL, "Sorry, only prefix-sets and as-paths "
+		    "supported for IOS XR\n");
+	}
+	if (b->vendor == V_BIRD
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_ASSET) {
+		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
+		    "supported for BIRD output\n");
+	}
+	if (b->vendor == V_JSON
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_ASSET) {
+		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
+		    "supported for JSON output\n");
+	}
+	if (b->vendor == V_BINARY
+	    && b->generation != T_PREFIXLIST
+	    && b->generation != T_ASPATH
+	    && b->generation != T_ASSET) {
+		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
+		    "supported for binary output\n");
+	}
+
+	if (b->vendor == V_FORMAT
+	    && b->generation != T_PREFIXLIST)
+		sx_report(SX_FATAL, "Sorry, only prefix-lists supported in formatted "
+		    "output\n");
+
+	if (b->vendor == V_HUAWEI
+	    && b->generation != T_ASPATH
+	    && b->generation != T_OASPATH
+	    && b->generation != T_PREFIXLIST)
+		sx_report(SX_FATAL, "Sorry, only as-paths and prefix-lists supported "
+		    "for Huawei output\n");
+
+	if (b->generation == T_ROUTE_FILTER_LIST
+	    && b->vendor != V_JUNIPER)
+		sx_report(SX_FATAL, "Route-filter-lists (-z) supported for Juniper (-J)"
+		    " output only\n");
+
+	if (b->generation == T_ASSET
+	    && b->vendor != V_JSON
+	    && b->vendor != V_BINARY
+	    && b->vendor != V_OPENBGPD
+	    && b->vendor != V_BIRD)
+		sx_report(SX_FATAL, "As-Sets (-t) supported for JSON (-j), binary "
+		    "(-Y), OpenBGPD (-B) and BIRD (-b) output only\n");
+
+	if (aggregate
+	    && b->vendor == V_JUNIPER
+	    && b->generation == T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, aggregation (-A) does not work in"
+		    " Juniper prefix-lists\nYou can try route-filters (-E) "
+		    "or route-filter-lists (-z) instead of prefix-lists\n.");
+		exit(1);
+	}
+
+	if (aggregate
+	    && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA || b->vendor == V_NOKIA_SRL)
+	    && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, aggregation (-A) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (refine
+	    && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA || b->vendor == V_NOKIA_SRL)
+	    && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, more-specifics (-R) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (refineLow
+	     && (b->vendor == V_NOKIA_MD || b->vendor == V_NOKIA || b->vendor == V_NOKIA_SRL)
+	     && b->generation != T_PREFIXLIST) {
+		sx_report(SX_FATAL, "Sorry, more-specifics (-r) is not supported with "
+		    "ip-prefix-lists (-E) on Nokia.\n");
+		exit(1);
+	}
+
+	if (b->vendor == V_ARISTA
+	    && b->generation == T_EACL
+	    && (b->family == AF_INET6 || b->tree6 != NULL)) {
+		sx_report(SX_FATAL, "Sorry, extended access-lists is not compatible "
+		    "with Arista EOS and IPv6\n");
+		exit(1);
+	}
+
+	if (b->sequence
+	    && (b->vendor != V_CISCO && b->vendor != V_ARISTA)) {
+		sx_report(SX_FATAL, "Sorry, prefix-lists sequencing (-s) supported"
+		    " only for IOS and EOS\n");
+		exit(1);
+	}
+
+	if (refine || refineLow) {
+		if (b->vendor == V_JUNIPER && b->generation == T_PREFIXLIST) {
+			if (refine) {
+				sx_report(SX_FATAL, "Sorry, more-specific filters (-R %u) "
+				    "is not supported for Juniper prefix-lists.\n"
+				    "Use router-filters (-E) or route-filter-lists (-z) "
+				    "instead\n", refine);
+			} else {
+				sx_report(SX_FATAL, "Sorry, more-specific filters (-r %u) "
+				    "is not supported for Juniper prefix-lists.\n"
+				    "Use route-filters (-E) or route-filter-lists (-z) "
+				    "instead\n", refineLow);
+			}
+		}
+	}
+
+	if (b->generation == T_EACL && b->vendor == V_CISCO
+	    && (b->family == AF_INET6 || b->tree6 != NULL)) {
+		sx_report(SX_FATAL,"Sorry, ipv6 access-lists not supported "
+		    "for Cisco yet.\n");
+	}
+
+	if (b->match != NULL
+	    && (b->vendor != V_JUNIPER || b->generation != T_EACL)) {
+		sx_report(SX_FATAL, "Sorry, extra match conditions (-M) can be used "
+		    "only with Juniper route-filters\n");
+	}
+}
+
+/*
+ * Parse an -o target: the vendor and generation flags of a single run,
+ * without dashes, followed by '=' and the file to write to ('-' for
+ * standard output).  "JE=junos.conf" renders Juniper route-filters.
+ */
+static struct output *
+parseoutput(char *arg)
+{
+	struct output	*o;
+	char		*c, *eq;
+	int		 vendorset = 0;
+
+	if ((eq = strchr(arg, '=')) == NULL || eq[1] == '\0') {
+		sx_report(SX_FATAL, "Invalid output target (-o): %s, expected "
+		    "flags=file\n", arg);
+		exit(1);
+	}
+
+	if ((o = calloc(1, sizeof(struct output))) == NULL)
+		err(1, NULL);
+
+	o->file = eq + 1;
+	o->vendor = V_CISCO;
+	o->generation = T_NONE;
+
+	for (c = arg; c < eq; c++) {
+		if (*c == '7' && o->vendor == V_MIKROTIK6) {
+			o->vendor = V_MIKROTIK7;
+			continue;
+		}
+		if (*c == '2' && o->vendor == V_NOKIA_MD) {
+			o->vendor = V_NOKIA_SRL;
+			continue;
+		}
+		if (*c == 'E' || *c == 'z') {
+			if (o->generation != T_NONE) {
+				sx_report(SX_FATAL, "-E and -z are mutually "
+				    "exclusive (-o %s)\n", arg);
+				exit(1);
+			}
+			o->generation = *c == 'E' ? T_EACL :
+			    T_ROUTE_FILTER_LIST;
+			continue;
+		}
+		if (vendorset)
+			vendor_exclusive();
+		vendorset = 1;
+		switch (*c) {
+		case 'b':
+			o->vendor = V_BIRD;
+			break;
+		case 'B':
+			o->vendor = V_OPENBGPD;
+			break;
+		case 'e':
+			o->vendor = V_ARISTA;
+			o->sequence = 1;
+			break;
+		case 'J':
+			o->vendor = V_JUNIPER;
+			break;
+		case 'j':
+			o->vendor = V_JSON;
+			break;
+		case 'K':
+			o->vendor = V_MIKROTIK6;
+			break;
+		case 'N':
+			o->vendor = V_NOKIA;
+			break;
+		case 'n':
+			o->vendor = V_NOKIA_MD;
+			break;
+		case 'U':
+			o->vendor = V_HUAWEI;
+			break;
+		case 'u':
+			o->vendor = V_HUAWEI_XPL;
+			break;
+		case 'X':
+			o->vendor = V_CISCO_XR;
+			break;
+		case 'Y':
+			o->vendor = V_BINARY;
+			break;
+		default:
+			sx_report(SX_FATAL, "Unsupported flag '%c' in output "
+			    "target (-o %s)\n", *c, arg);
+			exit(1);
+		}
+	}
+
+	return o;
+}
+
+/*
+ * Parse -q: a comma separated list of connect=, query= and run= seconds
+ * and expire=fail|retry|partial. A number alone is the connect timeout.
+ */
+static void
+parsetimeouts(struct bgpq_expander *b, char *arg)
+{
+	char	*list, *p, *c, *eq, *end;
+	long	 secs;
+	int	*t;
+
+	if ((list = p = strdup(arg)) == NULL)
+		err(1, NULL);
+
+	while ((c = strsep(&p, ",")) != NULL) {
+		if ((eq = strchr(c, '=')) == NULL) {
+			t = &b->ctimeout;
+			eq = c;
+		} else {
+			*eq++ = '\0';
+			if (strcmp(c, "expire") == 0) {
+				if (strcmp(eq, "fail") == 0)
+					b->expire = BGPQ_EXPIRE_FAIL;
+				else if (strcmp(eq, "retry") == 0)
+					b->expire = BGPQ_EXPIRE_RETRY;
+				else if (strcmp(eq, "partial") == 0)
+					b->expire = BGPQ_EXPIRE_PARTIAL;
+				else
+					goto invalid;
+				continue;
+			}
+			if (strcmp(c, "connect") == 0)
+				t = &b->ctimeout;
+			else if (strcmp(c, "query") == 0)
+				t = &b->qtimeout;
+			else if (strcmp(c, "run") == 0)
+				t = &b->rtimeout;
+			else
+				goto invalid;
+		}
+		secs = strtol(eq, &end, 10);
+		if (eq[0] == '\0' || *end != '\0' || secs < 0 ||
+		    secs > INT_MAX)
+			goto invalid;
+		*t = secs;
+	}
+
+	free(list);
+	return;
+
+invalid:
+	sx_report(SX_FATAL, "Invalid timeouts (-q): %s, expected a list of "
+	    "connect=, query= and run= seconds and expire=fail, retry or "
+	    "partial\n", arg);
+	exit(1);
+}
+
+/*
+ * Print the expansion, or its changes against prev, to f. With -Z the
+ * output is rendered in memory first to count its bytes.
+ */
+static void
+print_counted(FILE *f, struct bgpq_expander *b, struct bgpq_expander *prev,
+    struct bgpq_stats *st)
+{
+	FILE	*m = f;
+	char	*buf = NULL;
+	size_t	 len = 0;
+
+	if (st != NULL && (m = open_memstream(&buf, &len)) == NULL)
+		err(1, NULL);
+
+	if (prev != NULL)
+		bgpq4_print_diff(m, b, prev);
+	else
+		bgpq4_print_target(m, b);
+
+	if (st == NULL)
+		return;
+
+	if (fclose(m) != 0)
+		err(1, NULL);
+	fwrite(buf, 1, len, f);
+	st->outbytes += len;
+	free(buf);
+}
+
+/* Write the -Z statistics once the run is over. */
+static void
+stats_done(struct bgpq_stats *st, const char *file)
+{
+	if (st == NULL)
+		return;
+
+	bgpq_stats_phase(st, PHASE_NONE);
+	if (!bgpq_stats_write(st, file))
+		exit(1);
+	bgpq_stats_free(st);
+}
+
+static int
+run(int argc, char* argv[])
 {
 	int c;
-	struct bgpq_expander expander;
-	int af = AF_INET, selectedipv4 = 0, exceptmode = 0;
+	struct bgpq_expander expander, previous;
+	struct bgpq_stats *stats = NULL;
+	int af = AF_INET, selectedipv4 = 0, selectedipv6 = 0, exceptmode = 0;
 	int widthSet = 0, aggregate = 0, refine = 0, refineLow = 0;
 	unsigned long maxlen = 0;
+	char *diffbase = NULL, *snapshot = NULL, *savefile = NULL;
+	char *statsfile = NULL, *recordfile = NULL, *replayfile = NULL;
+	int snapflags = 0;
+	char *daemonpath = NULL, *hosts = NULL, *hl, *hp, *h;
+	int cachettl = 300, cliopts = 0;
+	struct outputs outputs = STAILQ_HEAD_INITIALIZER(outputs);
+	struct output *o;
+	int matched = 0;
 
 #ifdef HAVE_PLEDGE
-	if (pledge("stdio inet dns", NULL) == -1) {
+	if (pledge("stdio rpath wpath cpath inet dns unix proc", NULL) == -1) {
 		sx_report(SX_ERROR, "pledge() failed");
 		exit(1);
 	}
 #endif
 
+	/* the rest of the command line is for the daemon */
+	if (argc > 2 && !strcmp(argv[1], "-x"))
+		return bgpq4_client(argv[2], argc - 3, argv + 3);
+
 	bgpq_expander_init(&expander, af);
 
 	if (getenv("IRRD_SOURCES"))
 		expander.sources=getenv("IRRD_SOURCES");
 
-	while ((c = getopt(argc, argv,
-	    "23467a:AbBdDEeF:S:jJKf:l:L:m:M:NnpW:r:R:G:H:tTh:UuwXsvz")) != EOF) {
+	while ((c = getopt(argc, argv, bgpq4_optstring)) != EOF) {
+	if (c != 'd' && c != 'g' && c != 'h' && c != 'k' && c != 'q')
+		cliopts++;
 	switch (c) {
 	case '2':
 		if (expander.vendor != V_NOKIA_MD) {
@@ -215,22 +612,10 @@ main(int argc, char* argv[])
 		break;
 	case '4':
 		/* do nothing, expander already configured for IPv4 */
-		if (expander.family == AF_INET6) {
-			sx_report(SX_FATAL, "-4 and -6 are mutually "
-			    "exclusive\n");
-			exit(1);
-		}
 		selectedipv4 = 1;
 		break;
 	case '6':
-		if (selectedipv4) {
-			sx_report(SX_FATAL, "-4 and -6 are mutually "
-			    "exclusive\n");
-			exit(1);
-		}
-		af = AF_INET6;
-		expander.family = AF_INET6;
-		expander.tree->family = AF_INET6;
+		selectedipv6 = 1;
 		break;
 	case '7':
 		if (expander.vendor != V_MIKROTIK6) {
@@ -257,6 +642,12 @@ main(int argc, char* argv[])
 			vendor_exclusive();
 		expander.vendor = V_OPENBGPD;
 		break;
+	case 'c':
+		snapshot = optarg;
+		break;
+	case 'C':
+		savefile = optarg;
+		break;
 	case 'd':
 		debug_expander++;
 		break;
@@ -296,15 +687,22 @@ main(int argc, char* argv[])
 		parseasnumber(&expander, optarg);
 		break;
 	case 'h':
-		{
-			char *d = strchr(optarg, ':');
-			expander.server = optarg;
-			if (d) {
-				*d = 0;
-				expander.port = d + 1;
-			}
+		hosts = optarg;
+		break;
+	case 'g':
+		cachettl = strtol(optarg, NULL, 10);
+		if (cachettl < 0) {
+			sx_report(SX_FATAL, "Invalid cache time (-g): %s\n",
+			    optarg);
+			exit(1);
 		}
 		break;
+	case 'I':
+		diffbase = optarg;
+		break;
+	case 'i':
+		expander.stream = 1;
+		break;
 	case 'J':
 		if (expander.vendor)
 			vendor_exclusive();
@@ -320,6 +718,9 @@ main(int argc, char* argv[])
 			vendor_exclusive();
 		expander.vendor = V_MIKROTIK6;
 		break;
+	case 'k':
+		daemonpath = optarg;
+		break;
 	case 'r':
 		refineLow = strtoul(optarg, NULL, 10);
 		if (!refineLow) {
@@ -407,8 +808,21 @@ main(int argc, char* argv[])
 			vendor_exclusive();
 		expander.vendor = V_NOKIA_MD;
 		break;
+	case 'O':
+		recordfile = optarg;
+		break;
+	case 'o':
+		o = parseoutput(optarg);
+		STAILQ_INSERT_TAIL(&outputs, o, entry);
+		break;
 	case 'p':
-		expand_special_asn = 1;
+		expander.specialasn = 1;
+		break;
+	case 'q':
+		parsetimeouts(&expander, optarg);
+		break;
+	case 'Q':
+		expander.race = 1;
 		break;
 	case 't':
 		if (expander.generation)
@@ -416,7 +830,7 @@ main(int argc, char* argv[])
 		expander.generation = T_ASSET;
 		break;
 	case 'T':
-		pipelining = 0;
+		expander.pipelining = 0;
 		break;
 	case 's':
 		expander.sequence = 1;
@@ -445,19 +859,41 @@ main(int argc, char* argv[])
 	case 'w':
 		expander.validate_asns = 1;
 		break;
+	case 'x':
+		sx_report(SX_FATAL, "-x must be the first option\n");
+		exit(1);
 	case 'X':
 		if (expander.vendor)
 			vendor_exclusive();
 		expander.vendor = V_CISCO_XR;
 		break;
+	case 'y':
+		replayfile = optarg;
+		break;
+	case 'Y':
+		if (expander.vendor)
+			vendor_exclusive();
+		expander.vendor = V_BINARY;
+		break;
 	case 'v':
 		version();
 		break;
+	case 'V':
+		expander.threads = strtol(optarg, NULL, 10);
+		if (expander.threads < 1 || expander.threads > 256) {
+			sx_report(SX_FATAL, "Invalid number of threads (-V): "
+			    "%s\n", optarg);
+			exit(1);
+		}
+		break;
 	case 'z':
 		if (expander.generation)
 			exclusive();
 		expander.generation = T_ROUTE_FILTER_LIST;
 		break;
+	case 'Z':
+		statsfile = optarg;
+		break;
 	default:
 		usage(1);
 	}
@@ -466,135 +902,142 @@ main(int argc, char* argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (!widthSet) {
-		if (expander.generation == T_ASPATH) {
-			int vendor = expander.vendor;
-			switch (vendor) {
-			case V_ARISTA:
-			case V_CISCO:
-			case V_MIKROTIK6:
-			case V_MIKROTIK7:
-				expander.aswidth = 4;
-				break;
-			case V_CISCO_XR:
-				expander.aswidth = 6;
-				break;
-			case V_JUNIPER:
-			case V_NOKIA:
-			case V_NOKIA_MD:
-			case V_NOKIA_SRL:
-				expander.aswidth = 8;
-				break;
-			case V_BIRD:
-				expander.aswidth = 10;
-				break;
-			}
-		} else if (expander.generation == T_OASPATH) {
-			int vendor = expander.vendor;
-			switch (vendor) {
-			case V_ARISTA:
-			case V_CISCO:
-				expander.aswidth = 5;
-				break;
-			case V_CISCO_XR:
-				expander.aswidth = 7;
-				break;
-			case V_JUNIPER:
-			case V_NOKIA:
-			case V_NOKIA_MD:
-			case V_NOKIA_SRL:
-				expander.aswidth = 8;
-				break;
-			}
-		} else if (expander.generation == T_ASLIST) {
-			int vendor = expander.vendor;
-			switch (vendor) {
-			case V_JUNIPER:
-				expander.aswidth = 8;
-				break;
+	if (selectedipv4 && selectedipv6) {
+		/* dual-stack: IPv4 in expander.tree, IPv6 in tree6 */
+		if ((expander.tree6 = sx_radix_tree_new(AF_INET6)) == NULL)
+			err(1, NULL);
+	} else if (selectedipv6) {
+		af = AF_INET6;
+		expander.family = AF_INET6;
+		expander.tree->family = AF_INET6;
+	}
+
+	if (hosts) {
+		if ((hl = hp = strdup(hosts)) == NULL)
+			err(1, NULL);
+		while ((h = strsep(&hp, ",")) != NULL) {
+			if (!bgpq_expander_add_server(&expander, h)) {
+				sx_report(SX_FATAL, "Invalid server '%s' in "
+				    "-h %s\n", h, hosts);
+				exit(1);
 			}
 		}
+		free(hl);
 	}
 
-	if (!expander.generation)
-		expander.generation = T_PREFIXLIST;
-
-	if (expander.vendor == V_CISCO_XR
-	    && expander.generation != T_PREFIXLIST
-	    && expander.generation != T_ASPATH
-	    && expander.generation != T_OASPATH) {
-		sx_report(SX_FATAL, "Sorry, only prefix-sets and as-paths "
-		    "supported for IOS XR\n");
+	if (daemonpath) {
+		if (cliopts || argv[0]) {
+			sx_report(SX_FATAL, "Only -d, -g, -h and -q can be used "
+			    "with daemon mode (-k)\n");
+			exit(1);
+		}
+		return bgpq4_daemon(daemonpath, hosts, expander.server,
+		    expander.port, cachettl, expander.ctimeout, run);
 	}
-	if (expander.vendor == V_BIRD
-	    && expander.generation != T_PREFIXLIST
-	    && expander.generation != T_ASPATH
-	    && expander.generation != T_ASSET) {
-		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
-		    "supported for BIRD output\n");
+
+	if (snapshot && (recordfile || replayfile)) {
+		sx_report(SX_FATAL, "IRRd sessions can't be recorded or replayed "
+		    "(-O/-y) when rendering a snapshot (-c)\n");
+		exit(1);
 	}
-	if (expander.vendor == V_JSON
-	    && expander.generation != T_PREFIXLIST
-	    && expander.generation != T_ASPATH
-	    && expander.generation != T_ASSET) {
-		sx_report(SX_FATAL, "Sorry, only prefix-lists and as-paths/as-sets "
-		    "supported for JSON output\n");
+
+	if (recordfile && !bgpq_session_record(recordfile))
+		exit(1);
+
+	if (replayfile && !bgpq_session_replay(replayfile))
+		exit(1);
+
+#ifdef HAVE_PLEDGE
+	if (replayfile) {
+		/* the stand-in IRRd runs in a child */
+		if (pledge("stdio rpath wpath cpath proc", NULL) == -1) {
+			sx_report(SX_ERROR, "pledge() failed");
+			exit(1);
+		}
+	} else if (!diffbase && !snapshot && !savefile && !statsfile
+	    && !recordfile && STAILQ_EMPTY(&outputs)) {
+		if (pledge("stdio inet dns", NULL) == -1) {
+			sx_report(SX_ERROR, "pledge() failed");
+			exit(1);
+		}
+	} else if (pledge("stdio rpath wpath cpath inet dns", NULL) == -1) {
+		sx_report(SX_ERROR, "pledge() failed");
+		exit(1);
 	}
+#endif
 
-	if (expander.vendor == V_FORMAT
-	    && expander.generation != T_PREFIXLIST)
-		sx_report(SX_FATAL, "Sorry, only prefix-lists supported in formatted "
-		    "output\n");
+	if (!STAILQ_EMPTY(&outputs)) {
+		if (expander.vendor != V_CISCO) {
+			sx_report(SX_FATAL, "Vendor options can't be combined "
+			    "with output targets (-o), give them in the target "
+			    "instead\n");
+			exit(1);
+		}
+		if (expander.stream || diffbase) {
+			sx_report(SX_FATAL, "Sorry, output targets (-o) can't be "
+			    "used with streaming (-i) or incremental (-I) "
+			    "output\n");
+			exit(1);
+		}
+	}
 
-	if (expander.vendor == V_HUAWEI
-	    && expander.generation != T_ASPATH
-	    && expander.generation != T_OASPATH
-	    && expander.generation != T_PREFIXLIST)
-		sx_report(SX_FATAL, "Sorry, only as-paths and prefix-lists supported "
-		    "for Huawei output\n");
+	if (!widthSet && STAILQ_EMPTY(&outputs))
+		bgpq4_aswidth_default(&expander);
 
-	if (expander.generation == T_ROUTE_FILTER_LIST
-	    && expander.vendor != V_JUNIPER)
-		sx_report(SX_FATAL, "Route-filter-lists (-z) supported for Juniper (-J)"
-		    " output only\n");
+	if (!expander.generation)
+		expander.generation = T_PREFIXLIST;
 
-	if (expander.generation == T_ASSET
-	    && expander.vendor != V_JSON
-	    && expander.vendor != V_OPENBGPD
-	    && expander.vendor != V_BIRD)
-		sx_report(SX_FATAL, "As-Sets (-t) supported for JSON (-j), OpenBGPD "
-		    "(-B) and BIRD (-b) output only\n");
+	if (expander.tree6 != NULL) {
+		if (expander.generation < T_PREFIXLIST) {
+			sx_report(SX_FATAL, "Sorry, dual-stack output (-4 -6) "
+			    "supported only for prefix filters\n");
+			exit(1);
+		}
+		if (expander.stream || diffbase || snapshot || savefile) {
+			sx_report(SX_FATAL, "Sorry, dual-stack output (-4 -6) "
+			    "can't be used with streaming (-i), incremental (-I) "
+			    "output or snapshots (-c/-C)\n");
+			exit(1);
+		}
+		if (maxlen || refine || refineLow) {
+			sx_report(SX_FATAL, "Sorry, prefix lengths (-m, -R, -r) "
+			    "are per address family and can't be used with "
+			    "dual-stack output (-4 -6)\n");
+			exit(1);
+		}
+	}
 
-	if (aggregate
-	    && expander.vendor == V_JUNIPER
-	    && expander.generation == T_PREFIXLIST) {
-		sx_report(SX_FATAL, "Sorry, aggregation (-A) does not work in"
-		    " Juniper prefix-lists\nYou can try route-filters (-E) "
-		    "or route-filter-lists (-z) instead of prefix-lists\n.");
+	if (expander.stream
+	    && ((expander.vendor != V_JSON && expander.vendor != V_FORMAT)
+	    || expander.generation != T_PREFIXLIST)) {
+		sx_report(SX_FATAL, "Sorry, streaming output (-i) supported only "
+		    "for JSON (-j) and formatted (-F) prefix-lists\n");
 		exit(1);
 	}
 
-	if (aggregate
-	    && (expander.vendor == V_NOKIA_MD || expander.vendor == V_NOKIA || expander.vendor == V_NOKIA_SRL)
-	    && expander.generation != T_PREFIXLIST) {
-		sx_report(SX_FATAL, "Sorry, aggregation (-A) is not supported with "
-		    "ip-prefix-lists (-E) on Nokia.\n");
+	if (expander.stream && (aggregate || refine || refineLow)) {
+		sx_report(SX_FATAL, "Sorry, streaming output (-i) can't be used "
+		    "with aggregation (-A) or more-specifics (-R/-r)\n");
 		exit(1);
 	}
 
-	if (refine
-	    && (expander.vendor == V_NOKIA_MD || expander.vendor == V_NOKIA || expander.vendor == V_NOKIA_SRL)
-	    && expander.generation != T_PREFIXLIST) {
-		sx_report(SX_FATAL, "Sorry, more-specifics (-R) is not supported with "
-		    "ip-prefix-lists (-E) on Nokia.\n");
+	if (diffbase
+	    && (expander.generation < T_PREFIXLIST
+	    || (expander.vendor != V_CISCO && expander.vendor != V_JUNIPER
+	    && expander.vendor != V_NOKIA_MD)
+	    || (expander.vendor == V_CISCO
+	    && expander.generation != T_PREFIXLIST)
+	    || (expander.vendor == V_NOKIA_MD
+	    && expander.generation == T_ROUTE_FILTER_LIST))) {
+		sx_report(SX_FATAL, "Sorry, incremental output (-I) supported "
+		    "only for Cisco (prefix-lists), Juniper and Nokia MD-CLI "
+		    "prefix filters\n");
 		exit(1);
 	}
 
-	if (refineLow
-	     && (expander.vendor == V_NOKIA_MD || expander.vendor == V_NOKIA || expander.vendor == V_NOKIA_SRL)
-	     && expander.generation != T_PREFIXLIST) {
-		sx_report(SX_FATAL, "Sorry, more-specifics (-r) is not supported with "
-		    "ip-prefix-lists (-E) on Nokia.\n");
+	if (diffbase && expander.sequence) {
+		sx_report(SX_FATAL, "Sorry, incremental output (-I) can't be "
+		    "used with sequence numbers (-s)\n");
 		exit(1);
 	}
 
@@ -604,21 +1047,6 @@ main(int argc, char* argv[])
 		exit(1);
 	}
 
-	if (expander.vendor == V_ARISTA
-	    && expander.generation == T_EACL
-	    && expander.family == AF_INET6) {
-		sx_report(SX_FATAL, "Sorry, extended access-lists is not compatible "
-		    "with Arista EOS and IPv6\n");
-		exit(1);
-	}
-	
-	if (expander.sequence
-	    && (expander.vendor != V_CISCO && expander.vendor != V_ARISTA)) {
-		sx_report(SX_FATAL, "Sorry, prefix-lists sequencing (-s) supported"
-		    " only for IOS and EOS\n");
-		exit(1);
-	}
-
 	if (expander.sequence && expander.generation < T_PREFIXLIST) {
 		sx_report(SX_FATAL, "Sorry, prefix-lists sequencing (-s) can't be "
 		    " used for non prefix-list\n");
@@ -651,20 +1079,6 @@ main(int argc, char* argv[])
 			    " IPv4)\n", refineLow);
 		}
 
-		if (expander.vendor == V_JUNIPER && expander.generation == T_PREFIXLIST) {
-			if (refine) {
-				sx_report(SX_FATAL, "Sorry, more-specific filters (-R %u) "
-				    "is not supported for Juniper prefix-lists.\n"
-				    "Use router-filters (-E) or route-filter-lists (-z) "
-				    "instead\n", refine);
-			} else {
-				sx_report(SX_FATAL, "Sorry, more-specific filters (-r %u) "
-				    "is not supported for Juniper prefix-lists.\n"
-				    "Use route-filters (-E) or route-filter-lists (-z) "
-				    "instead\n", refineLow);
-			}
-		}
-
 		if (expander.generation < T_PREFIXLIST) {
 			if (refine)
 				sx_report(SX_FATAL, "Sorry, more-specific filter (-R %u) "
@@ -694,18 +1108,6 @@ main(int argc, char* argv[])
 	else if (expander.family == AF_INET6)
 		expander.maxlen = 128;
 
-	if (expander.generation == T_EACL && expander.vendor == V_CISCO
-	    && expander.family == AF_INET6) {
-		sx_report(SX_FATAL,"Sorry, ipv6 access-lists not supported "
-		    "for Cisco yet.\n");
-	}
-
-	if (expander.match != NULL
-	    && (expander.vendor != V_JUNIPER || expander.generation != T_EACL)) {
-		sx_report(SX_FATAL, "Sorry, extra match conditions (-M) can be used "
-		    "only with Juniper route-filters\n");
-	}
-
 	if ((expander.generation == T_ASPATH
 	    || expander.generation == T_OASPATH
 	    || expander.generation == T_ASLIST)
@@ -722,9 +1124,94 @@ main(int argc, char* argv[])
 		    "(-f/-G) generation\n");
 	}
 
-	if (!argv[0])
+	if (STAILQ_EMPTY(&outputs))
+		check_target(&expander, aggregate, refine, refineLow);
+
+	STAILQ_FOREACH(o, &outputs, entry) {
+		struct bgpq_expander target = expander;
+
+		if (o->generation == T_NONE) {
+			o->generation = expander.generation;
+		} else if (expander.generation != T_PREFIXLIST
+		    && expander.generation != o->generation) {
+			sx_report(SX_FATAL, "Sorry, E and z in output targets (-o) "
+			    "can be used only for prefix filters\n");
+			exit(1);
+		}
+		o->sequence |= expander.sequence;
+
+		target.vendor = o->vendor;
+		target.generation = o->generation;
+		target.sequence = o->sequence;
+		if (!widthSet)
+			bgpq4_aswidth_default(&target);
+		o->aswidth = target.aswidth;
+		/* -M applies to the Juniper route-filter targets only */
+		if (target.vendor == V_JUNIPER && target.generation == T_EACL)
+			matched = 1;
+		else
+			target.match = NULL;
+		check_target(&target, aggregate, refine, refineLow);
+	}
+
+	if (expander.match != NULL && !STAILQ_EMPTY(&outputs) && !matched) {
+		sx_report(SX_FATAL, "Sorry, extra match conditions (-M) need a "
+		    "Juniper route-filter output target (-o JE=file)\n");
+	}
+
+	STAILQ_FOREACH(o, &outputs, entry) {
+		if (!strcmp(o->file, "-")) {
+			o->f = stdout;
+		} else if ((o->f = fopen(o->file, "w")) == NULL) {
+			sx_report(SX_ERROR, "Unable to open %s: %s\n", o->file,
+			    strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (expander.stream && (snapshot || savefile)) {
+		sx_report(SX_FATAL, "Sorry, streaming output (-i) can't be used "
+		    "with snapshots (-c/-C)\n");
+		exit(1);
+	}
+
+	if (snapshot && statsfile) {
+		sx_report(SX_FATAL, "Query statistics (-Z) can't be collected "
+		    "when rendering a snapshot (-c)\n");
+		exit(1);
+	}
+
+	if (snapshot && argv[0]) {
+		sx_report(SX_FATAL, "Objects can't be given when rendering a "
+		    "snapshot (-c)\n");
+		exit(1);
+	}
+
+	if (!argv[0] && !snapshot)
 		usage(1);
 
+	if (diffbase) {
+		bgpq_expander_init(&previous, af);
+		previous.generation = expander.generation;
+		if (!bgpq_expander_load(&previous, diffbase, NULL))
+			exit(1);
+	}
+
+	if (snapshot) {
+		if (!bgpq_expander_load(&expander, snapshot, &snapflags))
+			exit(1);
+		if (aggregate && (snapflags & BGPQ4_SNAP_AGGREGATED)) {
+			sx_report(SX_FATAL, "Snapshot %s is already aggregated "
+			    "(-A)\n", snapshot);
+			exit(1);
+		}
+		if ((refine || refineLow) && (snapflags & BGPQ4_SNAP_REFINED)) {
+			sx_report(SX_FATAL, "Snapshot %s already has more-specifics "
+			    "(-R/-r) applied\n", snapshot);
+			exit(1);
+		}
+	}
+
 	while (argv[0]) {
 		char *obj = argv[0];
 		char *delim = strstr(argv[0], "::");
@@ -772,46 +1259,111 @@ main(int argc, char* argv[])
 		argc--;
 	}
 
-	if (!bgpq_expand(&expander))
-		exit(1);
-
-	if (refine)
-		sx_radix_tree_refine(expander.tree, refine);
+	if (!snapshot) {
+		/* in daemon mode, take the connection opened in advance */
+		expander.fd = bgpq4_daemon_irrd(expander.server, expander.port);
+		if (statsfile && (stats =
+		    calloc(1, sizeof(struct bgpq_stats))) == NULL)
+			err(1, NULL);
+		expander.stats = stats;
+		if (!bgpq_expand(&expander))
+			exit(1);
+		if (!bgpq_session_end())
+			exit(1);
+	}
 
-	if (refineLow)
-		sx_radix_tree_refineLow(expander.tree, refineLow);
+	if (expander.stream) {
+		bgpq4_print_stream_end(stdout, &expander);
+		if (stats != NULL) {
+			bgpq_stats_count(stats, &expander);
+			bgpq_stats_phase(stats, PHASE_TEARDOWN);
+		}
+		expander_freeall(&expander);
+		stats_done(stats, statsfile);
+		return expander.partial ? 2 : 0;
+	}
 
-	if (aggregate)
-		sx_radix_tree_aggregate(expander.tree);
+	/*
+	 * Refining and aggregating take one walk of the tree. Without
+	 * aggregation, the refining is done by the walk printing it.
+	 */
+	if (aggregate) {
+		if (stats != NULL)
+			bgpq_stats_phase(stats, PHASE_AGGREGATE);
+		if (refine || refineLow)
+			sx_radix_tree_refine(expander.tree, refine, refineLow, 1);
+		else
+			sx_radix_tree_aggregate(expander.tree);
+		if (expander.tree6 != NULL)
+			sx_radix_tree_aggregate(expander.tree6);
+	} else if (refine || refineLow)
+		sx_radix_tree_refine(expander.tree, refine, refineLow, 0);
 
-	switch (expander.generation) {
-		case T_NONE:
-			sx_report(SX_FATAL,"Unreachable point");
+	if (savefile) {
+		if (aggregate)
+			snapflags |= BGPQ4_SNAP_AGGREGATED;
+		if (refine || refineLow)
+			snapflags |= BGPQ4_SNAP_REFINED;
+		if (!bgpq_expander_save(&expander, savefile, snapflags))
 			exit(1);
-		case T_ASPATH:
-			bgpq4_print_aspath(stdout, &expander);
-			break;
-		case T_OASPATH:
-			bgpq4_print_oaspath(stdout, &expander);
-			break;
-		case T_ASLIST:
-			bgpq4_print_aslist(stdout, &expander);
-			break;
-		case T_ASSET:
-			bgpq4_print_asset(stdout, &expander);
-			break;
-		case T_PREFIXLIST:
-			bgpq4_print_prefixlist(stdout, &expander);
-			break;
-		case T_EACL:
-			bgpq4_print_eacl(stdout, &expander);
-			break;
-		case T_ROUTE_FILTER_LIST:
-			bgpq4_print_route_filter_list(stdout, &expander);
-			break;
 	}
 
+	if (stats != NULL) {
+		bgpq_stats_phase(stats, PHASE_PRINT);
+		bgpq_stats_count(stats, &expander);
+	}
+
+	if (diffbase) {
+		print_counted(stdout, &expander, &previous, stats);
+		if (stats != NULL)
+			bgpq_stats_phase(stats, PHASE_TEARDOWN);
+		expander_freeall(&previous);
+		expander_freeall(&expander);
+		stats_done(stats, statsfile);
+		return expander.partial ? 2 : 0;
+	}
+
+	if (STAILQ_EMPTY(&outputs)) {
+		print_counted(stdout, &expander, NULL, stats);
+	} else {
+		bgpq_vendor_t	vendor = expander.vendor;
+		bgpq_gen_t	generation = expander.generation;
+		int		sequence = expander.sequence;
+		int		aswidth = expander.aswidth;
+
+		while ((o = STAILQ_FIRST(&outputs)) != NULL) {
+			STAILQ_REMOVE_HEAD(&outputs, entry);
+			expander.vendor = o->vendor;
+			expander.generation = o->generation;
+			expander.sequence = o->sequence;
+			expander.aswidth = o->aswidth;
+			print_counted(o->f, &expander, NULL, stats);
+			if (o->f != stdout && fclose(o->f) != 0) {
+				sx_report(SX_ERROR, "Unable to write %s: %s\n",
+				    o->file, strerror(errno));
+				exit(1);
+			}
+			free(o);
+		}
+
+		expander.vendor = vendor;
+		expander.generation = generation;
+		expander.sequence = sequence;
+		expander.aswidth = aswidth;
+	}
+
+	if (stats != NULL)
+		bgpq_stats_phase(stats, PHASE_TEARDOWN);
+
         expander_freeall(&expander);
 
-	return 0;
+	stats_done(stats, statsfile);
+
+	return expander.partial ? 2 : 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	return run(argc, argv);
 }
@@ -31,9 +31,13 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <err.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <unistd.h>
 
 #include "extern.h"
 #include "sx_report.h"
@@ -47,6 +51,247 @@ extern int debug_expander;
     _a > _b ? _a : _b;       \
 })
 
+/*
+ * The list being printed, for the sx_radix_tree_foreach() callbacks that
+ * need more than the FILE: its name, the next sequence number (0 when the
+ * entries are not numbered) and whether an entry was printed already.
+ */
+struct fpcbdata {
+	FILE			*f;
+	struct bgpq_expander	*b;
+	const char		*name;
+	int			 seq;
+	int			 needscomma;
+	int			 prefixed;	/* Juniper: "route-filter " */
+};
+
+/*
+ * Printing a long prefix list, formatting the entries takes most of the
+ * time. The tree is then cut into pieces (sx_radix_tree_split) that
+ * threads print into buffers of their own, and the buffers are written
+ * out in the order of the pieces, so the output is that of a single
+ * sx_radix_tree_foreach_refined(). A first pass counts the entries each
+ * piece prints, for the sequence numbers and separators that depend on
+ * the entries printed before it: a callback prints one entry for each of a
+ * node and its sons that's not glue, numbered from seq when seq is set.
+ */
+#define PRINT_PIECES		8	/* per thread, subtrees vary in size */
+#define PRINT_MAXDEPTH		48
+#define PRINT_MINENTRIES	65536	/* below this, threads don't pay */
+#define PRINT_MAXTHREADS	64
+
+struct print_piece {
+	size_t			 entries;
+	size_t			 before;	/* entries of the pieces before */
+	char			*buf;
+	size_t			 len;
+	int			 done;
+};
+
+struct print_pool {
+	pthread_mutex_t		 mtx;
+	pthread_cond_t		 cond;
+	struct sx_radix_piece	*pieces;
+	struct print_piece	*out;
+	size_t			 npieces;
+	size_t			 next;		/* the next piece to take */
+	int			 counting;
+	void			(*cb)(struct sx_radix_node *, void *);
+	const struct fpcbdata	*p;
+};
+
+static void
+bgpq4_count_entry(struct sx_radix_node *n, void *arg)
+{
+	for (; n != NULL; n = n->son)
+		if (!n->isGlue)
+			(*(size_t *)arg)++;
+}
+
+static void *
+bgpq4_print_worker(void *arg)
+{
+	struct print_pool	*pp = arg;
+	struct print_piece	*o;
+	struct fpcbdata		 p;
+	size_t			 i;
+
+	for (;;) {
+		pthread_mutex_lock(&pp->mtx);
+		i = pp->next++;
+		pthread_mutex_unlock(&pp->mtx);
+
+		if (i >= pp->npieces)
+			return NULL;
+
+		o = &pp->out[i];
+
+		if (pp->counting) {
+			sx_radix_piece_foreach(&pp->pieces[i], bgpq4_count_entry,
+			    &o->entries);
+			continue;
+		}
+
+		p = *pp->p;
+		if (p.seq)
+			p.seq += o->before;
+		if (o->before)
+			p.needscomma = 1;
+
+		if ((p.f = open_memstream(&o->buf, &o->len)) == NULL)
+			err(1, NULL);
+		sx_radix_piece_foreach(&pp->pieces[i], pp->cb, &p);
+		if (fclose(p.f) != 0)
+			err(1, NULL);
+
+		pthread_mutex_lock(&pp->mtx);
+		o->done = 1;
+		pthread_cond_signal(&pp->cond);
+		pthread_mutex_unlock(&pp->mtx);
+	}
+}
+
+/* Start the threads on the pieces, returns how many could be started. */
+static int
+bgpq4_print_start(struct print_pool *pp, pthread_t *tids, int threads)
+{
+	int	i;
+
+	pp->next = 0;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, bgpq4_print_worker, pp)) {
+			SX_DEBUG(debug_expander, "Unable to start a printing "
+			    "thread, going on with %i\n", i);
+			break;
+		}
+	}
+
+	return i;
+}
+
+static void
+bgpq4_print_join(pthread_t *tids, int started)
+{
+	int	i;
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+}
+
+static int
+bgpq4_print_threads(const struct bgpq_expander *b)
+{
+	long	n;
+
+	if (b->threads)
+		return b->threads;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		return 1;
+
+	return n > PRINT_MAXTHREADS ? PRINT_MAXTHREADS : n;
+}
+
+/*
+ * sx_radix_tree_foreach_refined(b->tree, cb, p) for the callbacks that
+ * print an entry per node, in b->threads threads, or one per CPU for
+ * lists of PRINT_MINENTRIES entries or more.
+ */
+static void
+bgpq4_print_tree(struct bgpq_expander *b,
+    void (*cb)(struct sx_radix_node *, void *), struct fpcbdata *p)
+{
+	struct print_pool	 pp;
+	pthread_t		*tids;
+	size_t			 i, total = 0, subtrees;
+	unsigned int		 depth;
+	int			 threads, started;
+
+	if ((threads = bgpq4_print_threads(b)) <= 1)
+		goto serial;
+
+	/* one walk to count is cheaper than starting threads for a few */
+	if (b->threads == 0) {
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_count_entry,
+		    &total);
+		if (total < PRINT_MINENTRIES)
+			goto serial;
+		total = 0;
+	}
+
+	memset(&pp, 0, sizeof(pp));
+
+	/* deep enough for a few subtrees per thread, or the whole tree */
+	for (depth = 1; depth <= PRINT_MAXDEPTH; depth++) {
+		pp.npieces = sx_radix_tree_split(b->tree, depth, &pp.pieces);
+		for (i = subtrees = 0; i < pp.npieces; i++)
+			subtrees += pp.pieces[i].subtree;
+		if (subtrees == 0 || subtrees >= (size_t)threads * PRINT_PIECES
+		    || depth == PRINT_MAXDEPTH)
+			break;
+		free(pp.pieces);
+	}
+
+	if (pp.npieces == 0)
+		return;
+
+	if ((pp.out = calloc(pp.npieces, sizeof(struct print_piece))) == NULL)
+		err(1, NULL);
+	if ((tids = calloc(threads, sizeof(pthread_t))) == NULL)
+		err(1, NULL);
+
+	pthread_mutex_init(&pp.mtx, NULL);
+	pthread_cond_init(&pp.cond, NULL);
+	pp.cb = cb;
+	pp.p = p;
+
+	pp.counting = 1;
+	started = bgpq4_print_start(&pp, tids, threads);
+	bgpq4_print_worker(&pp);
+	bgpq4_print_join(tids, started);
+
+	for (i = 0; i < pp.npieces; i++) {
+		pp.out[i].before = total;
+		total += pp.out[i].entries;
+	}
+
+	SX_DEBUG(debug_expander, "Printing %zu entries in %zu pieces, depth "
+	    "%u, %i threads\n", total, pp.npieces, depth, threads);
+
+	pp.counting = 0;
+	started = bgpq4_print_start(&pp, tids, threads);
+	if (started == 0)
+		bgpq4_print_worker(&pp);
+
+	for (i = 0; i < pp.npieces; i++) {
+		pthread_mutex_lock(&pp.mtx);
+		while (!pp.out[i].done)
+			pthread_cond_wait(&pp.cond, &pp.mtx);
+		pthread_mutex_unlock(&pp.mtx);
+
+		fwrite(pp.out[i].buf, 1, pp.out[i].len, p->f);
+		free(pp.out[i].buf);
+	}
+
+	bgpq4_print_join(tids, started);
+
+	if (p->seq)
+		p->seq += total;
+	if (total)
+		p->needscomma = 1;
+
+	pthread_cond_destroy(&pp.cond);
+	pthread_mutex_destroy(&pp.mtx);
+	free(tids);
+	free(pp.out);
+	free(pp.pieces);
+	return;
+
+serial:
+	sx_radix_tree_foreach_refined(b->tree, cb, p);
+}
+
 static void 
 bgpq4_print_cisco_aspath(FILE *f, struct bgpq_expander *b)
 {
@@ -64,10 +309,12 @@ bgpq4_print_cisco_aspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "ip as-path access-list %s permit ^%u(_%u)*$\n",
 		    b->name, res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc)
 			fprintf(f, "ip as-path access-list %s permit"
 			    " ^%u(_[0-9]+)*_(%u", b->name, b->asnumber,
@@ -97,11 +344,13 @@ bgpq4_print_cisco_xr_aspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "\n  ios-regex '^%u(_%u)*$'", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		comma = 1;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f, "%s\n  ios-regex '^%u(_[0-9]+)*_(%u",
 			    comma ? "," : "",
@@ -141,10 +390,12 @@ bgpq4_print_cisco_oaspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "ip as-path access-list %s permit ^(_%u)*$\n",
 		    b->name, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc)
 			fprintf(f,"ip as-path access-list %s permit"
 			    " ^(_[0-9]+)*_(%u", b->name, asne->asn);
@@ -174,11 +425,13 @@ bgpq4_print_cisco_xr_oaspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "\n  ios-regex '^(_%u)*$'", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		comma = 1;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"%s\n  ios-regex '^(_[0-9]+)*_(%u",
 			    comma ? "," : "", asne->asn);
@@ -211,11 +464,13 @@ bgpq4_print_juniper_aspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  as-path a0 \"^%u(%u)*$\";\n", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 	
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f, "  as-path a%u \"^%u(.)*(%u",
 			    lineNo, b->asnumber,
@@ -253,11 +508,13 @@ bgpq4_print_juniper_oaspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  as-path a%u \"^%u(%u)*$\";\n", lineNo,
 		    res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"  as-path a%u \"^(.)*(%u",
 			    lineNo,
@@ -294,11 +551,13 @@ bgpq4_print_juniper_aslist(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  as-list a0 members %u;\n", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f, "  as-list a%u members [",
 			    lineNo);
@@ -352,11 +611,13 @@ bgpq4_print_nokia_aspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  entry 1 expression \"%u+\"\n", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"  entry %u expression \"%u.*[%u",
 			    lineNo, b->asnumber, asne->asn);
@@ -393,10 +654,12 @@ bgpq4_print_nokia_md_aspath(FILE *f, struct bgpq_expander *b)
 		fprintf(f,"  entry 1 {\n    expression \"%u+\"\n  }\n",
 		    res->asn);
 		lineNo++;
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"  entry %u {\n    expression \"%u.*[%u",
 			    lineNo, b->asnumber, asne->asn);
@@ -435,10 +698,12 @@ bgpq4_print_huawei_aspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "ip as-path-filter %s permit ^%u(_%u)*$\n",
 		    b->name, res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc)
 			fprintf(f, "ip as-path-filter %s permit ^%u(_[0-9]+)*"
 			    "_(%u", b->name, b->asnumber, asne->asn);
@@ -467,10 +732,12 @@ bgpq4_print_huawei_xpl_aspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "\n  regular ^%u(_%u)*$", res->asn, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f, "%s\n  regular ^%u(_[0-9]+)*_(%u",
 			    comma ? "," : "",
@@ -505,15 +772,19 @@ bgpq4_print_huawei_oaspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f,"ip as-path-filter %s permit ^(_%u)*$\n",
 		    b->name, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 	}
 
-	if (RB_EMPTY(&b->asnlist)) {
+	if (RB_EMPTY(&b->asnlist) || (res != NULL
+	    && RB_MIN(asn_tree, &b->asnlist) == res
+	    && RB_NEXT(asn_tree, &b->asnlist, res) == NULL)) {
 		fprintf(f, "ip as-path-filter %s deny .*\n", b->name);
 		return;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f, "ip as-path-filter %s permit ^(_[0-9]+)*_(%u",
 			    b->name, asne->asn);
@@ -543,11 +814,13 @@ bgpq4_print_huawei_xpl_oaspath(FILE *f, struct bgpq_expander *b)
 	find.asn = b->asnumber;
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "\n  regular ^(_%u)*$", res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		comma = 1;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"%s\n  regular ^(_[0-9]+)*_(%u",
 			    comma ? "," : "", asne->asn);
@@ -582,11 +855,13 @@ bgpq4_print_nokia_oaspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  entry %u expression \"%u+\"\n", lineNo,
 		    b->asnumber);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"  entry %u expression \".*[%u",
 			    lineNo, asne->asn);
@@ -620,11 +895,13 @@ bgpq4_print_nokia_md_oaspath(FILE *f, struct bgpq_expander *b)
 	if ((res = RB_FIND(asn_tree, &b->asnlist, &find)) != NULL) {
 		fprintf(f, "  entry %u {\n    expression \"%u+\"\n  }\n",
 		    lineNo, res->asn);
-		RB_REMOVE(asn_tree, &b->asnlist, res);
 		lineNo++;
 	}
 
 	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		if (asne == res)
+			continue;
+
 		if (!nc) {
 			fprintf(f,"  entry %u {\n    expression \".*[%u",
 			    lineNo, asne->asn);
@@ -650,7 +927,8 @@ static void
 bgpq4_print_jprefix(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (n->isGlue)
 		return;
@@ -662,13 +940,12 @@ bgpq4_print_jprefix(struct sx_radix_node *n, void *ff)
 	fprintf(f,"    %s;\n", prefix);
 }
 
-static int   needscomma = 0;
-
 static void
 bgpq4_print_json_prefix(struct sx_radix_node *n, void *ff)
 {
 	char	prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (n->isGlue)
 		goto checkSon;
@@ -680,19 +957,19 @@ bgpq4_print_json_prefix(struct sx_radix_node *n, void *ff)
 
 	if (!n->isAggregate) {
 		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": true }",
-		    needscomma ? "," : "", prefix);
+		    p->needscomma ? "," : "", prefix);
 	} else if (n->aggregateLow > n->prefix->masklen) {
 		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": false,\n"
 		    "      \"greater-equal\": %u, \"less-equal\": %u }",
-		    needscomma ? "," : "", prefix, n->aggregateLow,
+		    p->needscomma ? "," : "", prefix, n->aggregateLow,
 		    n->aggregateHi);
 	} else {
 		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": false, "
-		    "\"less-equal\": %u }", needscomma ? "," : "", prefix,
+		    "\"less-equal\": %u }", p->needscomma ? "," : "", prefix,
 		    n->aggregateHi);
 	}
 
-	needscomma = 1;
+	p->needscomma = 1;
 
 checkSon:
 	if (n->son)
@@ -702,7 +979,7 @@ checkSon:
 static void
 bgpq4_print_json_aspath(FILE *f, struct bgpq_expander *b)
 {
-	int			 nc = 0;
+	int			 nc = 0, needscomma = 0;
 	struct asn_entry	*asne;
 
 	fprintf(f, "{\"%s\": [", b->name);
@@ -728,11 +1005,108 @@ bgpq4_print_json_aspath(FILE *f, struct bgpq_expander *b)
 	fprintf(f,"\n]}\n");
 }
 
+static void
+bgpq4_print_binary_header(FILE *f, struct bgpq_expander *b, int kind,
+    int family, size_t recsize, uint32_t count)
+{
+	struct bgpq4_bin_header	 h;
+	static const char	 pad[8];
+	size_t			 namelen = strlen(b->name);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BGPQ4_BIN_MAGIC, sizeof(h.magic));
+	h.version = BGPQ4_BIN_VERSION;
+	h.kind = kind;
+	h.recsize = recsize;
+	h.family = family;
+	h.count = htonl(count);
+	h.namelen = htonl(namelen);
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(b->name, namelen, 1, f);
+	fwrite(pad, (8 - namelen % 8) % 8, 1, f);
+}
+
+/* the number of records bgpq4_print_binary_prefix() writes for a node */
+void
+bgpq4_count_binary_prefix(struct sx_radix_node *n, void *ff)
+{
+	uint32_t *count = ff;
+
+	if (!n->isGlue)
+		(*count)++;
+
+	if (n->son)
+		bgpq4_count_binary_prefix(n->son, ff);
+}
+
+/*
+ * Write the records of a node and its sons to the FILE ff, as the binary
+ * output (-Y) and the snapshots (-C) hold them.
+ */
+void
+bgpq4_print_binary_prefix(struct sx_radix_node *n, void *ff)
+{
+	struct bgpq4_bin_prefix	 r;
+	FILE			*f = (FILE*)ff;
+	unsigned int		 ge, le;
+
+	if (n->isGlue)
+		goto checkSon;
+
+	memset(&r, 0, sizeof(r));
+	r.family = n->prefix->family == AF_INET ? 4 : 6;
+	r.len = n->prefix->masklen;
+	sx_radix_node_range(n, &ge, &le);
+	r.ge = ge;
+	r.le = le;
+
+	memcpy(r.addr, n->prefix->addr.addrs, r.family == 4 ? 4 : 16);
+	fwrite(&r, sizeof(r), 1, f);
+
+checkSon:
+	if (n->son)
+		bgpq4_print_binary_prefix(n->son, ff);
+}
+
+static void
+bgpq4_print_binary_prefixlist(FILE *f, struct bgpq_expander *b)
+{
+	uint32_t	count = 0;
+
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_count_binary_prefix, &count);
+
+	bgpq4_print_binary_header(f, b, BGPQ4_BIN_PREFIXES,
+	    b->family == AF_INET ? 4 : 6, sizeof(struct bgpq4_bin_prefix),
+	    count);
+
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_print_binary_prefix, f);
+}
+
+static void
+bgpq4_print_binary_aspath(FILE *f, struct bgpq_expander *b)
+{
+	struct asn_entry	*asne;
+	uint32_t		 count = 0, asn;
+
+	RB_FOREACH(asne, asn_tree, &b->asnlist)
+		count++;
+
+	bgpq4_print_binary_header(f, b, BGPQ4_BIN_ASNS, 0, sizeof(asn),
+	    count);
+
+	RB_FOREACH(asne, asn_tree, &b->asnlist) {
+		asn = htonl(asne->asn);
+		fwrite(&asn, sizeof(asn), 1, f);
+	}
+}
+
 static void
 bgpq4_print_bird_prefix(struct sx_radix_node *n, void *ff)
 {
 	char	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (n->isGlue)
 		goto checkSon;
@@ -743,16 +1117,16 @@ bgpq4_print_bird_prefix(struct sx_radix_node *n, void *ff)
 	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
 
 	if (!n->isAggregate) {
-		fprintf(f, "%s\n    %s", needscomma ? "," : "", prefix);
+		fprintf(f, "%s\n    %s", p->needscomma ? "," : "", prefix);
 	} else if (n->aggregateLow > n->prefix->masklen) {
-		fprintf(f, "%s\n    %s{%u,%u}", needscomma ? "," : "", prefix,
-		    n->aggregateLow, n->aggregateHi);
+		fprintf(f, "%s\n    %s{%u,%u}", p->needscomma ? "," : "",
+		    prefix, n->aggregateLow, n->aggregateHi);
 	} else {
-		fprintf(f, "%s\n    %s{%u,%u}", needscomma ? "," : "", prefix,
-		    n->prefix->masklen, n->aggregateHi);
+		fprintf(f, "%s\n    %s{%u,%u}", p->needscomma ? "," : "",
+		    prefix, n->prefix->masklen, n->aggregateHi);
 	}
 
-	needscomma = 1;
+	p->needscomma = 1;
 
 checkSon:
 	if (n->son)
@@ -762,7 +1136,7 @@ checkSon:
 static void
 bgpq4_print_bird_aspath(FILE* f, struct bgpq_expander* b)
 {
-	int			 nc = 0;
+	int			 nc = 0, needscomma = 0;
 	struct asn_entry	*asne;
 
 	fprintf(f, "%s = [", b->name);
@@ -871,6 +1245,9 @@ bgpq4_print_aspath(FILE *f, struct bgpq_expander *b)
 	case V_JSON:
 		bgpq4_print_json_aspath(f, b);
 		break;
+	case V_BINARY:
+		bgpq4_print_binary_aspath(f, b);
+		break;
 	case V_BIRD:
 		bgpq4_print_bird_aspath(f, b);
 		break;
@@ -947,6 +1324,9 @@ bgpq4_print_asset(FILE *f, struct bgpq_expander *b)
 	case V_JSON:
 		bgpq4_print_json_aspath(f, b);
 		break;
+	case V_BINARY:
+		bgpq4_print_binary_aspath(f, b);
+		break;
 	case V_OPENBGPD:
 		bgpq4_print_openbgpd_asset(f, b);
 		break;
@@ -955,17 +1335,72 @@ bgpq4_print_asset(FILE *f, struct bgpq_expander *b)
 		break;
 	default:
 		sx_report(SX_FATAL, "as-sets (-t) supported for JSON, "
-		    "OpenBGPD, and BIRD only\n");
+		    "binary, OpenBGPD, and BIRD only\n");
 	}
 }
 
-static int jrfilter_prefixed = 1;
+/*
+ * Pick the as-path line width a vendor expects for the generation the
+ * expander is set up for.  Used when -W was not given.
+ */
+void
+bgpq4_aswidth_default(struct bgpq_expander *b)
+{
+	if (b->generation == T_ASPATH) {
+		int vendor = b->vendor;
+		switch (vendor) {
+		case V_ARISTA:
+		case V_CISCO:
+		case V_MIKROTIK6:
+		case V_MIKROTIK7:
+			b->aswidth = 4;
+			break;
+		case V_CISCO_XR:
+			b->aswidth = 6;
+			break;
+		case V_JUNIPER:
+		case V_NOKIA:
+		case V_NOKIA_MD:
+		case V_NOKIA_SRL:
+			b->aswidth = 8;
+			break;
+		case V_BIRD:
+			b->aswidth = 10;
+			break;
+		}
+	} else if (b->generation == T_OASPATH) {
+		int vendor = b->vendor;
+		switch (vendor) {
+		case V_ARISTA:
+		case V_CISCO:
+			b->aswidth = 5;
+			break;
+		case V_CISCO_XR:
+			b->aswidth = 7;
+			break;
+		case V_JUNIPER:
+		case V_NOKIA:
+		case V_NOKIA_MD:
+		case V_NOKIA_SRL:
+			b->aswidth = 8;
+			break;
+		}
+	} else if (b->generation == T_ASLIST) {
+		int vendor = b->vendor;
+		switch (vendor) {
+		case V_JUNIPER:
+			b->aswidth = 8;
+			break;
+		}
+	}
+}
 
 static void
 bgpq4_print_jrfilter(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (n->isGlue)
 		goto checkSon;
@@ -977,15 +1412,15 @@ bgpq4_print_jrfilter(struct sx_radix_node *n, void *ff)
 
 	if (!n->isAggregate) {
 		fprintf(f, "    %s%s exact;\n",
-		    jrfilter_prefixed ? "route-filter " : "", prefix);
+		    p->prefixed ? "route-filter " : "", prefix);
 	} else {
 		if (n->aggregateLow > n->prefix->masklen) {
 			fprintf(f,"    %s%s prefix-length-range /%u-/%u;\n",
-			    jrfilter_prefixed ? "route-filter " : "",
+			    p->prefixed ? "route-filter " : "",
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"    %s%s upto /%u;\n",
-			    jrfilter_prefixed ? "route-filter " : "",
+			    p->prefixed ? "route-filter " : "",
 			    prefix, n->aggregateHi);
 		}
 	}
@@ -995,14 +1430,12 @@ checkSon:
 		bgpq4_print_jrfilter(n->son, ff);
 }
 
-static char* bname = NULL;
-static int   seq = 0;
-
 static void
 bgpq4_print_cprefix(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128], seqno[16] = "";
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1012,25 +1445,25 @@ bgpq4_print_cprefix(struct sx_radix_node *n, void *ff)
 
 	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
 
-	if (seq)
-		snprintf(seqno, sizeof(seqno), " seq %i", seq++);
+	if (p->seq)
+		snprintf(seqno, sizeof(seqno), " seq %i", p->seq++);
 
 	if (n->isAggregate) {
 		if (n->aggregateLow > n->prefix->masklen) {
 			fprintf(f,"%s prefix-list %s%s permit %s ge %u le %u\n",
 			    n->prefix->family == AF_INET ? "ip" : "ipv6",
-			    bname ? bname : "NN", seqno, prefix,
+			    p->name, seqno, prefix,
 			    n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"%s prefix-list %s%s permit %s le %u\n",
 			    n->prefix->family == AF_INET ? "ip" : "ipv6",
-			    bname?bname:"NN", seqno, prefix,
+			    p->name, seqno, prefix,
 			    n->aggregateHi);
 		}
 	} else {
 		fprintf(f,"%s prefix-list %s%s permit %s\n",
 		    (n->prefix->family == AF_INET) ? "ip" : "ipv6",
-		    bname ? bname : "NN", seqno, prefix);
+		    p->name, seqno, prefix);
 	}
 
 checkSon:
@@ -1042,7 +1475,8 @@ static void
 bgpq4_print_cprefixxr(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1055,20 +1489,20 @@ bgpq4_print_cprefixxr(struct sx_radix_node *n, void *ff)
 	if (n->isAggregate) {
 		if (n->aggregateLow > n->prefix->masklen) {
 			fprintf(f,"%s%s ge %u le %u",
-			    needscomma ? ",\n " : " ",
+			    p->needscomma ? ",\n " : " ",
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"%s%s le %u",
-			    needscomma ? ",\n " : " ",
+			    p->needscomma ? ",\n " : " ",
 			    prefix, n->aggregateHi);
 		}
 	} else {
 		fprintf(f, "%s%s",
-		    needscomma ? ",\n " : " ",
+		    p->needscomma ? ",\n " : " ",
 		    prefix);
 	}
 
-	needscomma = 1;
+	p->needscomma = 1;
 
 checkSon:
 	if (n->son)
@@ -1079,7 +1513,8 @@ static void
 bgpq4_print_hprefix(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1094,18 +1529,18 @@ bgpq4_print_hprefix(struct sx_radix_node *n, void *ff)
 			fprintf(f,"ip %s-prefix %s permit %s greater-equal %u "
 			    "less-equal %u\n",
 			    n->prefix->family == AF_INET ? "ip" : "ipv6",
-			    bname ? bname : "NN",
+			    p->name,
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"ip %s-prefix %s permit %s less-equal %u\n",
 			    n->prefix->family == AF_INET ? "ip" : "ipv6",
-			    bname ? bname : "NN",
+			    p->name,
 			    prefix, n->aggregateHi);
 		}
 	} else {
 		fprintf(f,"ip %s-prefix %s permit %s\n",
 		    n->prefix->family == AF_INET ? "ip" : "ipv6",
-		    bname ? bname : "NN",
+		    p->name,
 		    prefix);
 	}
 
@@ -1118,7 +1553,8 @@ static void
 bgpq4_print_hprefixxpl(struct sx_radix_node* n, void* ff)
 {
 	char prefix[128];
-	FILE* f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1131,20 +1567,20 @@ bgpq4_print_hprefixxpl(struct sx_radix_node* n, void* ff)
 	if (n->isAggregate) {
 		if (n->aggregateLow>n->prefix->masklen) {
 			fprintf(f,"%s %s ge %u le %u",
-			    needscomma ? ",\n " : " ",
+			    p->needscomma ? ",\n " : " ",
 			    prefix, n->aggregateLow, n->aggregateHi);
 		} else {
 			fprintf(f,"%s %s le %u",
-			    needscomma ? ",\n " : " ",
+			    p->needscomma ? ",\n " : " ",
 			    prefix, n->aggregateHi);
 		}
 	} else {
 		fprintf(f, "%s %s",
-		    needscomma ? ",\n " : " ",
+		    p->needscomma ? ",\n " : " ",
 		    prefix);
 	}
 
-	needscomma = 1;
+	p->needscomma = 1;
 
 checkSon:
 	if (n->son)
@@ -1155,7 +1591,8 @@ static void
 bgpq4_print_eprefix(struct sx_radix_node *n, void *ff)
 {
 	char 	 prefix[128], seqno[16] = "";
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1165,7 +1602,7 @@ bgpq4_print_eprefix(struct sx_radix_node *n, void *ff)
 
 	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
 
-	snprintf(seqno, sizeof(seqno), "seq %i", seq++);
+	snprintf(seqno, sizeof(seqno), "seq %i", p->seq++);
 
 	if (n->isAggregate) {
 		if (n->aggregateLow > n->prefix->masklen) {
@@ -1187,9 +1624,8 @@ checkSon:
 static void
 bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 {
-	char 	 	 prefix[128];
+	char 	 	 prefix[128], mbuf[INET_ADDRSTRLEN];
 	FILE		*f = (FILE*)ff;
-	char		*c;
 	struct in_addr	 netmask;
 	
 	netmask.s_addr = 0xfffffffful;
@@ -1200,12 +1636,7 @@ bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 	if (n->isGlue)
 		goto checkSon;
 
-	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
-
-	c = strchr(prefix, '/');
-
-	if (c)
-		*c = 0;
+	sx_prefix_ntop(n->prefix, prefix);
 
 	if (n->prefix->masklen == 32)
 		netmask.s_addr = 0;
@@ -1248,23 +1679,23 @@ bgpq4_print_ceacl(struct sx_radix_node *n, void *ff)
 		wildmask.s_addr = htonl(wildmask.s_addr);
 
 		if (wildaddr.s_addr) {
-			fprintf(f, " permit ip %s ",
-			    inet_ntoa(n->prefix->addr.addr));
-			fprintf(f, "%s ", inet_ntoa(wildaddr));
+			sx_inet_ntop4(&wildaddr, mbuf);
+			fprintf(f, " permit ip %s %s ", prefix, mbuf);
 		} else {
-			fprintf(f, " permit ip host %s ",
-			    inet_ntoa(n->prefix->addr.addr));
+			fprintf(f, " permit ip host %s ", prefix);
 		}
 
+		sx_inet_ntop4(&mask, mbuf);
 		if (wildmask.s_addr) {
-			fprintf(f, "%s ", inet_ntoa(mask));
-			fprintf(f, "%s\n", inet_ntoa(wildmask));
+			fprintf(f, "%s ", mbuf);
+			sx_inet_ntop4(&wildmask, mbuf);
+			fprintf(f, "%s\n", mbuf);
 		} else {
-			fprintf(f, "host %s\n", inet_ntoa(mask));
+			fprintf(f, "host %s\n", mbuf);
 		}
 	} else {
-		fprintf(f, " permit ip host %s host %s\n", prefix,
-		    inet_ntoa(netmask));
+		sx_inet_ntop4(&netmask, mbuf);
+		fprintf(f, " permit ip host %s host %s\n", prefix, mbuf);
 	}
 
 checkSon:
@@ -1438,10 +1869,12 @@ checkSon:
 static void
 bgpq4_print_juniper_prefixlist(FILE *f, struct bgpq_expander *b)
 {
+	struct fpcbdata	 p = { .f = f, .b = b };
+
 	fprintf(f, "policy-options {\nreplace:\n prefix-list %s {\n",
 	    b->name ? b->name : "NN");
 
-	sx_radix_tree_foreach(b->tree, bgpq4_print_jprefix, f);
+	bgpq4_print_tree(b, bgpq4_print_jprefix, &p);
 
 	fprintf(f, " }\n}\n");
 }
@@ -1449,7 +1882,8 @@ bgpq4_print_juniper_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_juniper_routefilter(FILE *f, struct bgpq_expander *b)
 {
-	char	*c = NULL;
+	struct fpcbdata	 p = { .f = f, .b = b, .prefixed = 1 };
+	char		*c = NULL;
 
 	if (b->name && (c = strchr(b->name,'/'))) {
 		*c = 0;
@@ -1467,8 +1901,7 @@ bgpq4_print_juniper_routefilter(FILE *f, struct bgpq_expander *b)
 	}
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		jrfilter_prefixed = 1;
-		sx_radix_tree_foreach(b->tree, bgpq4_print_jrfilter, f);
+		bgpq4_print_tree(b, bgpq4_print_jrfilter, &p);
 	} else {
 		fprintf(f, "    route-filter %s/0 orlonger reject;\n",
 			b->tree->family == AF_INET ? "0.0.0.0" : "::");
@@ -1476,6 +1909,7 @@ bgpq4_print_juniper_routefilter(FILE *f, struct bgpq_expander *b)
 
 	if (c) {
 		fprintf(f, "   }\n  }\n }\n}\n");
+		*c = '/';
 	} else {
 		fprintf(f, "  }\n }\n}\n");
 	}
@@ -1499,7 +1933,7 @@ bgpq4_print_openbgpd_prefixlist(FILE *f, struct bgpq_expander *b)
 			}
 		}
 		fprintf(f, "prefix { ");
-		sx_radix_tree_foreach(b->tree, bgpq4_print_openbgpd_prefix, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_openbgpd_prefix, f);
 		fprintf(f, "\n\t}");
 		if (b->name) {
 			if (strcmp(b->name, "NN") != 0) {
@@ -1515,12 +1949,13 @@ bgpq4_print_openbgpd_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_openbgpd_prefixset(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f, "prefix-set %s {", bname);
 
 	if (!sx_radix_tree_empty(b->tree))
-		sx_radix_tree_foreach(b->tree, bgpq4_print_openbgpd_prefix, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_openbgpd_prefix, f);
 
 	fprintf(f, "\n}\n");
 }
@@ -1528,21 +1963,22 @@ bgpq4_print_openbgpd_prefixset(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_cisco_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
-	seq = b->sequence;
+	struct fpcbdata	 p = { .f = f, .b = b, .seq = b->sequence };
+
+	p.name = b->name ? b->name : "NN";
 
 	fprintf(f, "no %s prefix-list %s\n",
 	    b->family == AF_INET ? "ip" : "ipv6",
-	    bname);
+	    p.name);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_cprefix, f);
+		bgpq4_print_tree(b, bgpq4_print_cprefix, &p);
 	} else {
-		fprintf(f, "! generated prefix-list %s is empty\n", bname);
+		fprintf(f, "! generated prefix-list %s is empty\n", p.name);
 		fprintf(f, "%s prefix-list %s%s deny %s\n",
 		    (b->family == AF_INET) ? "ip" : "ipv6",
-		    bname,
-		    seq ? " seq 1" : "",
+		    p.name,
+		    p.seq ? " seq 1" : "",
 		    (b->family == AF_INET) ? "0.0.0.0/0" : "::/0");
 	}
 }
@@ -1550,10 +1986,12 @@ bgpq4_print_cisco_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_ciscoxr_prefixlist(FILE *f, struct bgpq_expander *b)
 {
+	struct fpcbdata	 p = { .f = f, .b = b };
+
 	fprintf(f, "no prefix-set %s\n", b->name);
 	fprintf(f, "prefix-set %s\n", b->name);
 
-	sx_radix_tree_foreach(b->tree, bgpq4_print_cprefixxr, f);
+	bgpq4_print_tree(b, bgpq4_print_cprefixxr, &p);
 
 	fprintf(f, "\nend-set\n");
 }
@@ -1561,9 +1999,11 @@ bgpq4_print_ciscoxr_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_json_prefixlist(FILE *f, struct bgpq_expander *b)
 {
+	struct fpcbdata	 p = { .f = f, .b = b };
+
 	fprintf(f, "{ \"%s\": [", b->name);
 
-	sx_radix_tree_foreach(b->tree, bgpq4_print_json_prefix, f);
+	bgpq4_print_tree(b, bgpq4_print_json_prefix, &p);
 
 	fprintf(f,"\n] }\n");
 }
@@ -1571,10 +2011,12 @@ bgpq4_print_json_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_bird_prefixlist(FILE *f, struct bgpq_expander *b)
 {
+	struct fpcbdata	 p = { .f = f, .b = b };
+
 	if (!sx_radix_tree_empty(b->tree)) {
 		fprintf(f,"%s = [",
 		    b->name ? b->name : "NN");
-		sx_radix_tree_foreach(b->tree, bgpq4_print_bird_prefix, f);
+		bgpq4_print_tree(b, bgpq4_print_bird_prefix, &p);
 		fprintf(f, "\n];\n");
 	} else {
 		SX_DEBUG(debug_expander, "skip empty prefix-list in BIRD format\n");
@@ -1584,19 +2026,20 @@ bgpq4_print_bird_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_huawei_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
-	seq = b->sequence;
+	struct fpcbdata	 p = { .f = f, .b = b, .seq = b->sequence };
+
+	p.name = b->name ? b->name : "NN";
 
 	fprintf(f,"undo ip %s-prefix %s\n",
-		(b->family == AF_INET) ? "ip" : "ipv6", bname);
+		(b->family == AF_INET) ? "ip" : "ipv6", p.name);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_hprefix, f);
+		bgpq4_print_tree(b, bgpq4_print_hprefix, &p);
 	} else {
 		fprintf(f, "ip %s-prefix %s%s deny %s\n",
 		    (b->family == AF_INET) ? "ip" : "ipv6",
-		    bname,
-		    seq ? " seq 1" : "",
+		    p.name,
+		    p.seq ? " seq 1" : "",
 		    (b->family == AF_INET) ? "0.0.0.0/0" : "::/0");
 	}
 }
@@ -1604,11 +2047,12 @@ bgpq4_print_huawei_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_huawei_xpl_prefixlist(FILE* f, struct bgpq_expander* b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+	struct fpcbdata	 p = { .f = f, .b = b };
 
 	fprintf(f, "no xpl %s-prefix-list %s\nxpl %s-prefix-list %s\n", b->family==AF_INET ? "ip" : "ipv6", bname, b->family==AF_INET ? "ip" : "ipv6", bname);
 
-	sx_radix_tree_foreach(b->tree, bgpq4_print_hprefixxpl, f);
+	bgpq4_print_tree(b, bgpq4_print_hprefixxpl, &p);
 
 	fprintf(f, "\nend-list\n");
 }
@@ -1616,34 +2060,30 @@ bgpq4_print_huawei_xpl_prefixlist(FILE* f, struct bgpq_expander* b)
 static void
 bgpq4_print_arista_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
-	seq = b->sequence;
+	struct fpcbdata	 p = { .f = f, .b = b, .seq = b->sequence };
+
+	p.name = b->name ? b->name : "NN";
 
 	fprintf(f, "no %s prefix-list %s\n",
 	    b->family == AF_INET ? "ip" : "ipv6",
-	    bname);
+	    p.name);
 
 	if (!sx_radix_tree_empty(b->tree)) {
 		fprintf(f,"%s prefix-list %s\n",
 		    b->family == AF_INET ? "ip" : "ipv6",
-		    bname);
+		    p.name);
 
-		sx_radix_tree_foreach(b->tree, bgpq4_print_eprefix, f);
+		bgpq4_print_tree(b, bgpq4_print_eprefix, &p);
 	} else {
-		fprintf(f, "! generated prefix-list %s is empty\n", bname);
+		fprintf(f, "! generated prefix-list %s is empty\n", p.name);
 		fprintf(f, "%s prefix-list %s\n   seq %i deny %s\n",
 		    (b->family == AF_INET) ? "ip" : "ipv6",
-		    bname,
-		    seq,
+		    p.name,
+		    p.seq,
 		    (b->family == AF_INET) ? "0.0.0.0/0" : "::/0");
 	}
 }
 
-struct fpcbdata {
-	FILE			*f;
-	struct bgpq_expander	*b;
-};
-
 static void
 bgpq4_print_format_prefix(struct sx_radix_node *n, void *ff)
 {
@@ -1688,7 +2128,7 @@ bgpq4_print_format_prefixlist(FILE *f, struct bgpq_expander *b)
 	struct fpcbdata ff = {.f=f, .b=b};
 	int len = strlen(b->format);
 
-	sx_radix_tree_foreach(b->tree, bgpq4_print_format_prefix, &ff);
+	bgpq4_print_tree(b, bgpq4_print_format_prefix, &ff);
 
 	// Add newline if format doesn't already end with one.
 	if (len < 2 ||
@@ -1696,27 +2136,90 @@ bgpq4_print_format_prefixlist(FILE *f, struct bgpq_expander *b)
 		fprintf(f, "\n");
 }
 
+/*
+ * Streaming output (-i): prefixes are printed by the expander as they
+ * arrive, so the list header goes out with the first one.
+ */
+static void
+bgpq4_print_stream_begin(FILE *f, struct bgpq_expander *b)
+{
+	if (b->streamed)
+		return;
+
+	if (b->vendor == V_JSON)
+		fprintf(f, "{ \"%s\": [", b->name);
+}
+
+void
+bgpq4_print_stream_prefix(FILE *f, struct bgpq_expander *b,
+    struct sx_prefix *p)
+{
+	char	prefix[128];
+
+	bgpq4_print_stream_begin(f, b);
+
+	switch (b->vendor) {
+	case V_JSON:
+		sx_prefix_jsnprintf(p, prefix, sizeof(prefix));
+		fprintf(f, "%s\n    { \"prefix\": \"%s\", \"exact\": true }",
+		    b->streamed ? "," : "", prefix);
+		break;
+	case V_FORMAT:
+		sx_prefix_snprintf_fmt(p, f, b->name ? b->name : "NN",
+		    b->format, p->masklen, p->masklen);
+		break;
+	default:
+		sx_report(SX_FATAL, "unreachable point\n");
+	}
+
+	b->streamed++;
+}
+
+void
+bgpq4_print_stream_end(FILE *f, struct bgpq_expander *b)
+{
+	int	len;
+
+	bgpq4_print_stream_begin(f, b);
+
+	switch (b->vendor) {
+	case V_JSON:
+		fprintf(f, "\n] }\n");
+		break;
+	case V_FORMAT:
+		len = strlen(b->format);
+		if (len < 2 ||
+		    !(b->format[len-2] == '\\' && b->format[len-1] == 'n'))
+			fprintf(f, "\n");
+		break;
+	default:
+		sx_report(SX_FATAL, "unreachable point\n");
+	}
+}
+
 static void
 bgpq4_print_nokia_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 	fprintf(f,"configure router policy-options\nbegin\nno prefix-list \"%s\"\n",
 		bname);
 	fprintf(f,"prefix-list \"%s\"\n", bname);
-	sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_prefix, f);
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_print_nokia_prefix, f);
 	fprintf(f,"exit\ncommit\n");
 }
 
 static void
 bgpq4_print_cisco_eacl(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f,"no ip access-list extended %s\n", bname);
 
 	if (!sx_radix_tree_empty(b->tree)) {
 		fprintf(f, "ip access-list extended %s\n", bname);
-		sx_radix_tree_foreach(b->tree, bgpq4_print_ceacl, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_ceacl, f);
 	} else {
 		fprintf(f, "! generated access-list %s is empty\n", bname);
 		fprintf(f, "ip access-list extended %s deny any any\n", bname);
@@ -1726,7 +2229,8 @@ bgpq4_print_cisco_eacl(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_nokia_ipprefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f, "configure filter match-list\nno %s-prefix-list \"%s\"\n",
 	    (b->tree->family == AF_INET) ? "ip" : "ipv6", bname);
@@ -1735,7 +2239,7 @@ bgpq4_print_nokia_ipprefixlist(FILE *f, struct bgpq_expander *b)
 	    b->tree->family == AF_INET ? "ip":"ipv6", bname);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_ipfilter, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_nokia_ipfilter, f);
 	} else {
 		fprintf(f, "# generated ip-prefix-list %s is empty\n", bname);
 	}
@@ -1746,7 +2250,8 @@ bgpq4_print_nokia_ipprefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_nokia_md_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f,"/configure filter match-list\ndelete %s-prefix-list \"%s\"\n",
 	    b->tree->family == AF_INET ? "ip" : "ipv6", bname);
@@ -1755,7 +2260,7 @@ bgpq4_print_nokia_md_prefixlist(FILE *f, struct bgpq_expander *b)
 	    b->tree->family == AF_INET ? "ip" : "ipv6", bname);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_md_ipfilter, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_nokia_md_ipfilter, f);
 	} else {
 		fprintf(f,"# generated %s-prefix-list %s is empty\n",
 		    b->tree->family == AF_INET ? "ip" : "ipv6", bname);
@@ -1767,7 +2272,8 @@ bgpq4_print_nokia_md_prefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_nokia_md_ipprefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f, "/configure policy-options\ndelete prefix-list \"%s\"\n",
 	    bname);
@@ -1775,7 +2281,7 @@ bgpq4_print_nokia_md_ipprefixlist(FILE *f, struct bgpq_expander *b)
 	fprintf(f, "prefix-list \"%s\" {\n", bname);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_md_prefix, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_nokia_md_prefix, f);
 	}
 
 	fprintf(f,"}\n");
@@ -1784,7 +2290,8 @@ bgpq4_print_nokia_md_ipprefixlist(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_nokia_srl_prefixset(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f, "/routing-policy\ndelete prefix-set \"%s\"\n",
 	    bname);
@@ -1792,7 +2299,7 @@ bgpq4_print_nokia_srl_prefixset(FILE *f, struct bgpq_expander *b)
 	fprintf(f, "prefix-set \"%s\" {\n", bname);
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_srl_prefix, f);
+		sx_radix_tree_foreach_refined(b->tree, bgpq4_print_nokia_srl_prefix, f);
 	}
 
 	fprintf(f,"}\n");
@@ -1801,7 +2308,8 @@ bgpq4_print_nokia_srl_prefixset(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_nokia_srl_aclipfilter(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
+	const char	*bname = b->name ? b->name : "NN";
+
 
 	fprintf(f,"/acl \ndelete ipv%c-filter \"%s\"\n",
 	    b->tree->family == AF_INET ? '4' : '6', bname);
@@ -1811,7 +2319,8 @@ bgpq4_print_nokia_srl_aclipfilter(FILE *f, struct bgpq_expander *b)
 
 	if (!sx_radix_tree_empty(b->tree)) {
 		NOKIA_SRL_IPFILTER_PARAMS params = { f, 10 };
-		sx_radix_tree_foreach(b->tree, bgpq4_print_nokia_srl_ipfilter, &params);
+		sx_radix_tree_foreach_refined(b->tree,
+		    bgpq4_print_nokia_srl_ipfilter, &params);
 	} else {
 		fprintf(f,"# generated ipv%c-filter '%s' is empty\n",
 		    b->tree->family == AF_INET ? '4' : '6', bname);
@@ -1824,7 +2333,8 @@ static void
 bgpq4_print_k6prefix(struct sx_radix_node *n, void *ff)
 {
 	char	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1837,13 +2347,13 @@ bgpq4_print_k6prefix(struct sx_radix_node *n, void *ff)
 	if (n->isAggregate)
 		fprintf(f,"/routing filter add action=accept chain=\""
 		    "%s-%s\" prefix=%s prefix-length=%d-%d\n",
-		    bname ? bname : "NN",
+		    p->name,
 		    n->prefix->family == AF_INET ? "V4" : "V6",
 		    prefix, n->aggregateLow, n->aggregateHi);
 	else
 		fprintf(f,"/routing filter add action=accept chain=\""
 		    "%s-%s\" prefix=%s\n",
-		    bname ? bname : "NN",
+		    p->name,
 		    n->prefix->family == AF_INET ? "V4" : "V6",
 		    prefix);
 
@@ -1856,7 +2366,8 @@ static void
 bgpq4_print_k7prefix(struct sx_radix_node *n, void *ff)
 {
 	char	 prefix[128];
-	FILE	*f = (FILE*)ff;
+	struct fpcbdata	*p = (struct fpcbdata*)ff;
+	FILE		*f = p->f;
 
 	if (!f)
 		f = stdout;
@@ -1869,13 +2380,13 @@ bgpq4_print_k7prefix(struct sx_radix_node *n, void *ff)
 	if (n->isAggregate)
 		fprintf(f,"/routing filter rule add chain=\""
 		    "%s-%s\" rule=\"if (dst in %s && dst-len in %d-%d) {accept}\"\n",
-		    bname ? bname : "NN",
+		    p->name,
 		    n->prefix->family == AF_INET ? "V4" : "V6",
 		    prefix, n->aggregateLow, n->aggregateHi);
 	else
 		fprintf(f,"/routing filter rule add chain=\""
 		    "%s-%s\" rule=\"if (dst==%s) {accept}\"\n",
-		    bname ? bname : "NN",
+		    p->name,
 		    n->prefix->family == AF_INET ? "V4" : "V6",
 		    prefix);
 
@@ -1887,16 +2398,18 @@ checkSon:
 static void
 bgpq4_print_mikrotik_prefixlist(FILE *f, struct bgpq_expander *b)
 {
-	bname = b->name ? b->name : "NN";
-	void *cbfunc = bgpq4_print_k6prefix;
+	struct fpcbdata	 p = { .f = f, .b = b };
+	void		*cbfunc = bgpq4_print_k6prefix;
+
+	p.name = b->name ? b->name : "NN";
 
 	if (b->vendor == V_MIKROTIK7)
 		cbfunc = bgpq4_print_k7prefix;
 
 	if (!sx_radix_tree_empty(b->tree)) {
-		sx_radix_tree_foreach(b->tree, cbfunc, f);
+		bgpq4_print_tree(b, cbfunc, &p);
 	} else {
-		fprintf(f, "# generated prefix-list %s is empty\n", bname);
+		fprintf(f, "# generated prefix-list %s is empty\n", p.name);
 	}
 }
 
@@ -1916,6 +2429,9 @@ bgpq4_print_prefixlist(FILE *f, struct bgpq_expander *b)
 	case V_JSON:
 		bgpq4_print_json_prefixlist(f, b);
 		break;
+	case V_BINARY:
+		bgpq4_print_binary_prefixlist(f, b);
+		break;
 	case V_BIRD:
 		bgpq4_print_bird_prefixlist(f, b);
 		break;
@@ -1981,6 +2497,8 @@ bgpq4_print_eacl(FILE *f, struct bgpq_expander *b)
 static void
 bgpq4_print_juniper_route_filter_list(FILE *f, struct bgpq_expander *b)
 {
+	struct fpcbdata	 p = { .f = f, .b = b, .prefixed = 0 };
+
 	fprintf(f, "policy-options {\nreplace:\n  route-filter-list %s {\n",
 	    b->name ? b->name : "NN");
 
@@ -1988,8 +2506,7 @@ bgpq4_print_juniper_route_filter_list(FILE *f, struct bgpq_expander *b)
 		fprintf(f, "    %s/0 orlonger reject;\n",
 		    b->tree->family == AF_INET ? "0.0.0.0" : "::");
 	} else {
-		jrfilter_prefixed = 0;
-		sx_radix_tree_foreach(b->tree, bgpq4_print_jrfilter, f);
+		bgpq4_print_tree(b, bgpq4_print_jrfilter, &p);
 	}
 
 	fprintf(f, "  }\n}\n");
@@ -2006,3 +2523,324 @@ bgpq4_print_route_filter_list(FILE *f, struct bgpq_expander *b)
 		sx_report(SX_FATAL, "unreachable point\n");
 	}
 }
+
+static void
+bgpq4_print_list(FILE *f, struct bgpq_expander *b)
+{
+	switch (b->generation) {
+		case T_NONE:
+			sx_report(SX_FATAL,"Unreachable point");
+			exit(1);
+		case T_ASPATH:
+			bgpq4_print_aspath(f, b);
+			break;
+		case T_OASPATH:
+			bgpq4_print_oaspath(f, b);
+			break;
+		case T_ASLIST:
+			bgpq4_print_aslist(f, b);
+			break;
+		case T_ASSET:
+			bgpq4_print_asset(f, b);
+			break;
+		case T_PREFIXLIST:
+			bgpq4_print_prefixlist(f, b);
+			break;
+		case T_EACL:
+			bgpq4_print_eacl(f, b);
+			break;
+		case T_ROUTE_FILTER_LIST:
+			bgpq4_print_route_filter_list(f, b);
+			break;
+	}
+}
+
+/*
+ * A dual-stack run prints the IPv4 list and then the IPv6 one, named
+ * after -l with a "-v4" and "-v6" suffix so that both fit in the same
+ * configuration.
+ */
+void
+bgpq4_print_target(FILE *f, struct bgpq_expander *b)
+{
+	struct bgpq_expander	 half;
+	size_t			 len;
+
+	if (b->tree6 == NULL) {
+		bgpq4_print_list(f, b);
+		return;
+	}
+
+	half = *b;
+	len = strlen(b->name) + 4;
+	if ((half.name = malloc(len)) == NULL)
+		err(1, NULL);
+
+	snprintf(half.name, len, "%s-v4", b->name);
+	bgpq4_print_list(f, &half);
+
+	snprintf(half.name, len, "%s-v6", b->name);
+	half.family = AF_INET6;
+	half.tree = b->tree6;
+	bgpq4_print_list(f, &half);
+
+	free(half.name);
+}
+
+/*
+ * Whether the printers can render the list the expander is set up for,
+ * without reporting anything: the command line has its own checks with
+ * messages naming the options, this is for the library.
+ */
+int
+bgpq4_print_supported(const struct bgpq_expander *b)
+{
+	int	v = b->vendor;
+
+	switch (b->generation) {
+	case T_PREFIXLIST:
+		return v != V_FORMAT || b->format != NULL;
+	case T_EACL:
+		if ((v == V_CISCO || v == V_ARISTA)
+		    && (b->family == AF_INET6 || b->tree6 != NULL))
+			return 0;
+		return v == V_JUNIPER || v == V_CISCO || v == V_ARISTA
+		    || v == V_OPENBGPD || v == V_NOKIA || v == V_NOKIA_MD
+		    || v == V_NOKIA_SRL;
+	case T_ROUTE_FILTER_LIST:
+	case T_ASLIST:
+		return v == V_JUNIPER;
+	case T_ASSET:
+		return v == V_JSON || v == V_BINARY || v == V_OPENBGPD
+		    || v == V_BIRD;
+	case T_ASPATH:
+		if (v == V_JSON || v == V_BINARY || v == V_BIRD)
+			return 1;
+		/* FALLTHROUGH */
+	case T_OASPATH:
+		return v == V_JUNIPER || v == V_CISCO || v == V_ARISTA
+		    || v == V_CISCO_XR || v == V_OPENBGPD || v == V_NOKIA
+		    || v == V_NOKIA_MD || v == V_HUAWEI || v == V_HUAWEI_XPL;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Incremental output (-I): the commands that turn the list a previous run
+ * generated into the current one. Entries are compared by prefix and
+ * accepted mask lengths, and new entries are added before stale ones are
+ * removed, so the filter never gets narrower than both lists in between.
+ */
+struct bgpq4_diff {
+	FILE			*f;
+	struct bgpq_expander	*b;
+	struct sx_radix_tree	*other;
+	int			 add;
+};
+
+static int
+bgpq4_diff_present(struct sx_radix_tree *t, struct sx_radix_node *n)
+{
+	struct sx_radix_node	*m;
+	unsigned int		 ge, le, mge, mle;
+
+	sx_radix_node_range(n, &ge, &le);
+
+	for (m = sx_radix_tree_lookup_exact(t, n->prefix); m; m = m->son) {
+		if (m->isGlue)
+			continue;
+		sx_radix_node_range(m, &mge, &mle);
+		if (mge == ge && mle == le)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* 0 for exact, 1 for through, 2 for range, as Nokia types them */
+static int
+bgpq4_node_type(struct sx_radix_node *n)
+{
+	unsigned int	ge, le;
+
+	sx_radix_node_range(n, &ge, &le);
+	if (ge > n->prefix->masklen)
+		return 2;
+
+	return le > n->prefix->masklen;
+}
+
+/*
+ * Nokia keys prefix-list entries by prefix and type only, so an entry
+ * whose lengths changed has already been overwritten by the add.
+ */
+static int
+bgpq4_diff_replaced(struct bgpq4_diff *d, struct sx_radix_node *n)
+{
+	struct sx_radix_node	*m;
+
+	if (d->b->vendor != V_NOKIA_MD || d->b->generation != T_PREFIXLIST)
+		return 0;
+
+	for (m = sx_radix_tree_lookup_exact(d->other, n->prefix); m;
+	    m = m->son) {
+		if (!m->isGlue && bgpq4_node_type(m) == bgpq4_node_type(n))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+bgpq4_print_diff_juniper(FILE *f, struct bgpq_expander *b, char *prefix,
+    char *range, int add)
+{
+	const char	*bname = b->name ? b->name : "NN";
+	const char	*c;
+
+	switch (b->generation) {
+	case T_PREFIXLIST:
+		fprintf(f, "%s policy-options prefix-list %s %s\n",
+		    add ? "set" : "delete", bname, prefix);
+		break;
+	case T_EACL:
+		if ((c = strchr(bname, '/')) != NULL)
+			fprintf(f, "%s policy-options policy-statement %.*s "
+			    "term %s from route-filter %s %s\n",
+			    add ? "set" : "delete", (int)(c - bname), bname,
+			    c + 1, prefix, range);
+		else
+			fprintf(f, "%s policy-options policy-statement %s "
+			    "from route-filter %s %s\n",
+			    add ? "set" : "delete", bname, prefix, range);
+		break;
+	case T_ROUTE_FILTER_LIST:
+		fprintf(f, "%s policy-options route-filter-list %s %s %s\n",
+		    add ? "set" : "delete", bname, prefix, range);
+		break;
+	default:
+		sx_report(SX_FATAL, "unreachable point\n");
+	}
+}
+
+static void
+bgpq4_print_diff_entry(FILE *f, struct bgpq_expander *b,
+    struct sx_radix_node *n, int add)
+{
+	char		 prefix[128], range[64];
+	unsigned int	 ge, le;
+	const char	*ip = b->family == AF_INET ? "ip" : "ipv6";
+	const char	*bname = b->name ? b->name : "NN";
+
+	sx_radix_node_range(n, &ge, &le);
+	sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+
+	switch (b->vendor) {
+	case V_CISCO:
+		if (ge > n->prefix->masklen)
+			snprintf(range, sizeof(range), " ge %u le %u", ge, le);
+		else if (le > n->prefix->masklen)
+			snprintf(range, sizeof(range), " le %u", le);
+		else
+			range[0] = 0;
+		fprintf(f, "%s%s prefix-list %s permit %s%s\n",
+		    add ? "" : "no ", ip, bname, prefix, range);
+		break;
+	case V_JUNIPER:
+		if (ge > n->prefix->masklen)
+			snprintf(range, sizeof(range),
+			    "prefix-length-range /%u-/%u", ge, le);
+		else if (le > n->prefix->masklen)
+			snprintf(range, sizeof(range), "upto /%u", le);
+		else
+			strlcpy(range, "exact", sizeof(range));
+		bgpq4_print_diff_juniper(f, b, prefix, range, add);
+		break;
+	case V_NOKIA_MD:
+		if (b->generation == T_EACL) {
+			fprintf(f, "%s%s-prefix-list \"%s\" prefix %s\n",
+			    add ? "" : "delete ", ip, bname, prefix);
+			break;
+		}
+		/* the prefix and its type are enough to delete an entry */
+		if (ge > n->prefix->masklen && add)
+			snprintf(range, sizeof(range), "range start-length %u "
+			    "end-length %u", ge, le);
+		else if (ge > n->prefix->masklen)
+			strlcpy(range, "range", sizeof(range));
+		else if (le > n->prefix->masklen && add)
+			snprintf(range, sizeof(range), "through through-length "
+			    "%u", le);
+		else if (le > n->prefix->masklen)
+			strlcpy(range, "through", sizeof(range));
+		else
+			strlcpy(range, "exact", sizeof(range));
+		fprintf(f, "%sprefix-list \"%s\" prefix %s type %s\n",
+		    add ? "" : "delete ", bname, prefix, range);
+		break;
+	default:
+		sx_report(SX_FATAL, "unreachable point\n");
+	}
+}
+
+static void
+bgpq4_print_diff_node(struct sx_radix_node *n, void *ff)
+{
+	struct bgpq4_diff	*d = (struct bgpq4_diff *)ff;
+
+	if (!n->isGlue && !bgpq4_diff_present(d->other, n)
+	    && (d->add || !bgpq4_diff_replaced(d, n)))
+		bgpq4_print_diff_entry(d->f, d->b, n, d->add);
+
+	if (n->son)
+		bgpq4_print_diff_node(n->son, ff);
+}
+
+/* the entry full output uses to keep an empty list from matching all */
+static void
+bgpq4_print_diff_empty(FILE *f, struct bgpq_expander *b, int add)
+{
+	const char	*dflt = b->family == AF_INET ? "0.0.0.0/0" : "::/0";
+	const char	*bname = b->name ? b->name : "NN";
+
+	switch (b->vendor) {
+	case V_CISCO:
+		fprintf(f, "%s%s prefix-list %s deny %s\n", add ? "" : "no ",
+		    b->family == AF_INET ? "ip" : "ipv6", bname, dflt);
+		break;
+	case V_JUNIPER:
+		if (b->generation != T_PREFIXLIST)
+			bgpq4_print_diff_juniper(f, b, (char *)dflt,
+			    "orlonger reject", add);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+bgpq4_print_diff(FILE *f, struct bgpq_expander *b, struct bgpq_expander *prev)
+{
+	struct bgpq4_diff	 d = { .f = f, .b = b };
+	int			 wasempty = sx_radix_tree_empty(prev->tree);
+	int			 isempty = sx_radix_tree_empty(b->tree);
+
+	if (b->vendor == V_NOKIA_MD)
+		fprintf(f, "%s\n", b->generation == T_EACL ?
+		    "/configure filter match-list" : "/configure policy-options");
+
+	if (isempty && !wasempty)
+		bgpq4_print_diff_empty(f, b, 1);
+
+	d.other = prev->tree;
+	d.add = 1;
+	sx_radix_tree_foreach_refined(b->tree, bgpq4_print_diff_node, &d);
+
+	d.other = b->tree;
+	d.add = 0;
+	sx_radix_tree_foreach(prev->tree, bgpq4_print_diff_node, &d);
+
+	if (wasempty && !isempty)
+		bgpq4_print_diff_empty(f, b, 0);
+}
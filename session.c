@@ -0,0 +1,555 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Recording (-O) and replay (-y) of IRRd sessions.
+ *
+ * Recording logs the raw bytes exchanged with every IRRd connection.
+ * Replaying, each connection goes to a stand-in server forked on a
+ * socketpair instead, which answers every query with the answer it got
+ * in the recording under the same sources, so that an expansion can be
+ * repeated offline, in whatever order the queries are sent.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+extern int debug_expander;
+
+struct conn {
+	char		*sent, *recv;
+	size_t		 nsent, ssent, nrecv, srecv;
+};
+
+struct answer {
+	RB_ENTRY(answer)	 entry;
+	char			*sources;	/* "": the server's default */
+	char			*query;
+	const char		*data;
+	size_t			 len;
+};
+
+static int
+answer_cmp(struct answer *a, struct answer *b)
+{
+	int	r;
+
+	if ((r = strcmp(a->sources, b->sources)) != 0)
+		return r;
+
+	return strcmp(a->query, b->query);
+}
+
+static RB_HEAD(answers, answer) answers = RB_INITIALIZER(&answers);
+RB_GENERATE_STATIC(answers, answer, entry, answer_cmp);
+
+static FILE		*record;
+static const char	*recordfile;
+static int		*connids;	/* by fd, 0: not a connection */
+static int		 nconnids, lastconn;
+
+static struct conn	*conns;
+static int		 nconns;
+static int		 replaying;
+static int		 standinmax;	/* highest fd given out by a stand-in */
+static char		*defaults;	/* the server's sources, from !s-lc */
+
+/* Start recording the IRRd sessions to file. */
+int
+bgpq_session_record(const char *file)
+{
+	if ((record = fopen(file, "w")) == NULL) {
+		sx_report(SX_ERROR, "Unable to open %s: %s\n", file,
+		    strerror(errno));
+		return 0;
+	}
+
+	recordfile = file;
+	fputs(BGPQ4_SESSION_MAGIC, record);
+
+	return 1;
+}
+
+/* Finish the recording, if any. */
+int
+bgpq_session_end(void)
+{
+	if (record == NULL)
+		return 1;
+
+	if (fclose(record) != 0) {
+		sx_report(SX_ERROR, "Unable to write %s: %s\n", recordfile,
+		    strerror(errno));
+		record = NULL;
+		return 0;
+	}
+
+	record = NULL;
+	return 1;
+}
+
+static void
+session_frame(char type, int fd, const void *data, size_t len)
+{
+	if (fd >= nconnids || connids[fd] == 0)
+		bgpq_session_open(fd, "unknown", "0");
+
+	fprintf(record, "%c %d %zu\n", type, connids[fd], len);
+	fwrite(data, 1, len, record);
+	fputc('\n', record);
+}
+
+/* A new connection to server:port was opened on fd. */
+void
+bgpq_session_open(int fd, const char *server, const char *port)
+{
+	char	name[256];
+	int	n;
+
+	if (record == NULL)
+		return;
+
+	if (fd >= nconnids) {
+		n = fd + 16;
+		if ((connids = realloc(connids, n * sizeof(int))) == NULL)
+			err(1, NULL);
+		memset(connids + nconnids, 0, (n - nconnids) * sizeof(int));
+		nconnids = n;
+	}
+
+	connids[fd] = ++lastconn;
+
+	n = snprintf(name, sizeof(name), "%s:%s", server, port);
+	session_frame(BGPQ4_SESSION_OPEN, fd, name,
+	    n < (int)sizeof(name) ? (size_t)n : sizeof(name) - 1);
+}
+
+/* read(2) from an IRRd, recording what was read. */
+ssize_t
+bgpq_irrd_read(int fd, void *buf, size_t len)
+{
+	ssize_t	ret;
+
+	ret = read(fd, buf, len);
+	if (record != NULL && ret > 0)
+		session_frame(BGPQ4_SESSION_RECV, fd, buf, ret);
+
+	return ret;
+}
+
+/*
+ * write(2) to an IRRd, recording what was written. A server closing the
+ * connection must not raise SIGPIPE, which would end the program the
+ * library runs in: the write fails with EPIPE instead. Where there is no
+ * MSG_NOSIGNAL, bgpq_connect() sets SO_NOSIGPIPE on the socket.
+ */
+ssize_t
+bgpq_irrd_write(int fd, const void *buf, size_t len)
+{
+	ssize_t	ret;
+
+#ifdef MSG_NOSIGNAL
+	ret = send(fd, buf, len, MSG_NOSIGNAL);
+	if (ret == -1 && errno == ENOTSOCK)
+		ret = write(fd, buf, len);
+#else
+	ret = write(fd, buf, len);
+#endif
+	if (record != NULL && ret > 0)
+		session_frame(BGPQ4_SESSION_SENT, fd, buf, ret);
+
+	return ret;
+}
+
+static void
+conn_append(char **buf, size_t *n, size_t *size, const char *data,
+    size_t len)
+{
+	if (*n + len > *size) {
+		while (*n + len > *size)
+			*size = *size ? *size * 2 : 65536;
+		if ((*buf = realloc(*buf, *size)) == NULL)
+			err(1, NULL);
+	}
+
+	memcpy(*buf + *n, data, len);
+	*n += len;
+}
+
+/* The length of the complete answer at p, or 0 if it is cut short. */
+static size_t
+answer_length(const char *p, size_t len)
+{
+	const char	*nl, *end;
+	unsigned long	 alen;
+	char		*eon;
+
+	if ((nl = memchr(p, '\n', len)) == NULL)
+		return 0;
+
+	if (p[0] != 'A')
+		return nl + 1 - p;
+
+	alen = strtoul(p + 1, &eon, 10);
+	if (eon != nl || (size_t)(p + len - (nl + 1)) <= alen)
+		return 0;
+
+	end = nl + 1 + alen;
+	if ((nl = memchr(end, '\n', p + len - end)) == NULL)
+		return 0;
+
+	return nl + 1 - p;
+}
+
+/*
+ * The sources a !s switched to, "" for the server's default ones: -T
+ * selects them explicitly where pipelining does not.
+ */
+static const char *
+sources_key(const char *list)
+{
+	if (defaults != NULL && strcmp(list, defaults) == 0)
+		return "";
+
+	return list;
+}
+
+/* Pair the queries sent on a connection with the answers received. */
+static void
+conn_answers(struct conn *c)
+{
+	struct answer	*a;
+	char		*sources, *p, *end, *nl, *list;
+	size_t		 r = 0, n;
+
+	if ((sources = strdup("")) == NULL)
+		err(1, NULL);
+
+	for (p = c->sent, end = c->sent + c->nsent;
+	    (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1) {
+		*nl = '\0';
+		if (strcmp(p, "!!") == 0)
+			continue;
+		if (strcmp(p, "!q") == 0)
+			break;
+		if ((n = answer_length(c->recv + r, c->nrecv - r)) == 0)
+			break;
+
+		if ((a = calloc(1, sizeof(struct answer))) == NULL)
+			err(1, NULL);
+		if ((a->sources = strdup(sources)) == NULL
+		    || (a->query = strdup(p)) == NULL)
+			err(1, NULL);
+		a->data = c->recv + r;
+		a->len = n;
+		if (RB_INSERT(answers, &answers, a) != NULL) {
+			free(a->sources);
+			free(a->query);
+			free(a);
+		}
+
+		if (strcmp(p, "!s-lc") == 0 && defaults == NULL
+		    && c->recv[r] == 'A') {
+			list = (char *)memchr(c->recv + r, '\n', n) + 1;
+			if ((defaults = strndup(list, strcspn(list, "\n"))) == NULL)
+				err(1, NULL);
+		}
+
+		/* !s switches the sources of the queries that follow */
+		if (strncmp(p, "!s", 2) == 0 && strncmp(p, "!s-", 3) != 0
+		    && c->recv[r] == 'C') {
+			free(sources);
+			if ((sources = strdup(sources_key(p + 2))) == NULL)
+				err(1, NULL);
+		}
+
+		r += n;
+	}
+
+	free(sources);
+}
+
+/* Load a recording, all IRRd connections will then replay it. */
+int
+bgpq_session_replay(const char *file)
+{
+	struct stat	 st;
+	struct conn	*c;
+	char		*map, *p, *end, *nl, *eon;
+	unsigned long	 id, len;
+	int		 fd, ret = 0;
+	size_t		 mlen = strlen(BGPQ4_SESSION_MAGIC);
+
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		sx_report(SX_ERROR, "Unable to open %s: %s\n", file,
+		    strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		sx_report(SX_ERROR, "Unable to stat %s: %s\n", file,
+		    strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if ((size_t)st.st_size < mlen) {
+		sx_report(SX_ERROR, "%s is not a bgpq4 session recording\n",
+		    file);
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		sx_report(SX_ERROR, "Unable to mmap %s: %s\n", file,
+		    strerror(errno));
+		close(fd);
+		return 0;
+	}
+
+	if (memcmp(map, BGPQ4_SESSION_MAGIC, mlen) != 0) {
+		sx_report(SX_ERROR, "%s is not a bgpq4 session recording\n",
+		    file);
+		goto done;
+	}
+
+	for (p = map + mlen, end = map + st.st_size; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL || nl - p < 5
+		    || p[1] != ' ')
+			goto corrupt;
+		id = strtoul(p + 2, &eon, 10);
+		if (*eon != ' ' || id == 0 || id > INT_MAX)
+			goto corrupt;
+		len = strtoul(eon + 1, &eon, 10);
+		if (eon != nl || (unsigned long)(end - nl - 1) <= len
+		    || nl[len + 1] != '\n')
+			goto corrupt;
+
+		if ((int)id > nconns) {
+			conns = realloc(conns, id * sizeof(struct conn));
+			if (conns == NULL)
+				err(1, NULL);
+			memset(conns + nconns, 0,
+			    (id - nconns) * sizeof(struct conn));
+			nconns = id;
+		}
+		c = &conns[id - 1];
+
+		switch (p[0]) {
+		case BGPQ4_SESSION_OPEN:
+			SX_DEBUG(debug_expander, "session %lu: %.*s\n", id,
+			    (int)len, nl + 1);
+			break;
+		case BGPQ4_SESSION_SENT:
+			conn_append(&c->sent, &c->nsent, &c->ssent, nl + 1,
+			    len);
+			break;
+		case BGPQ4_SESSION_RECV:
+			conn_append(&c->recv, &c->nrecv, &c->srecv, nl + 1,
+			    len);
+			break;
+		default:
+			goto corrupt;
+		}
+
+		nl += len + 1;
+	}
+
+	for (id = 0; id < (unsigned long)nconns; id++)
+		conn_answers(&conns[id]);
+
+	replaying = 1;
+	ret = 1;
+	goto done;
+
+corrupt:
+	sx_report(SX_ERROR, "Corrupt session recording %s at offset %lu\n",
+	    file, (unsigned long)(p - map));
+done:
+	munmap(map, st.st_size);
+	close(fd);
+
+	return ret;
+}
+
+int
+bgpq_session_replaying(void)
+{
+	return replaying;
+}
+
+static int
+serve_write(int fd, const char *data, size_t len)
+{
+	ssize_t	ret;
+
+	while (len > 0) {
+		if ((ret = write(fd, data, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 1;
+}
+
+/* The stand-in IRRd: answer the queries read from fd until EOF or !q. */
+static void
+session_serve(int fd)
+{
+	static const char	 missing[] = "F Query not in the recording\n";
+	struct answer		 find, *a;
+	char			*buf = NULL, *p, *nl, *sources;
+	size_t			 len = 0, size = 0;
+	ssize_t			 ret;
+
+	if ((sources = strdup("")) == NULL)
+		err(1, NULL);
+
+	for (;;) {
+		if (size - len < 4096) {
+			size = size ? size * 2 : 16384;
+			if ((buf = realloc(buf, size)) == NULL)
+				err(1, NULL);
+		}
+
+		if ((ret = read(fd, buf + len, size - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		} else if (ret == 0)
+			return;
+		len += ret;
+
+		for (p = buf; (nl = memchr(p, '\n', buf + len - p)) != NULL;
+		    p = nl + 1) {
+			*nl = '\0';
+			if (strcmp(p, "!!") == 0)
+				continue;
+			if (strcmp(p, "!q") == 0)
+				return;
+			/* the identification differs between versions */
+			if (strncmp(p, "!n", 2) == 0) {
+				if (!serve_write(fd, "C\n", 2))
+					return;
+				continue;
+			}
+
+			find.sources = sources;
+			find.query = p;
+			a = RB_FIND(answers, &answers, &find);
+
+			if (strncmp(p, "!s", 2) == 0 && strncmp(p, "!s-", 3) != 0
+			    && (a != NULL ? a->data[0] == 'C' :
+			    *sources_key(p + 2) == '\0')) {
+				free(sources);
+				if ((sources = strdup(sources_key(p + 2))) == NULL)
+					err(1, NULL);
+				if (a == NULL) {
+					if (!serve_write(fd, "C\n", 2))
+						return;
+					continue;
+				}
+			}
+
+			if (a == NULL) {
+				if (!serve_write(fd, missing,
+				    sizeof(missing) - 1))
+					return;
+				continue;
+			}
+			if (!serve_write(fd, a->data, a->len))
+				return;
+		}
+
+		memmove(buf, p, buf + len - p);
+		len = buf + len - p;
+	}
+}
+
+/*
+ * Replaying, connect to a stand-in IRRd serving the recording in a child
+ * process. Returns the socket, or -1 after reporting what failed.
+ */
+int
+bgpq_session_connect(void)
+{
+	int	sv[2];
+	pid_t	pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		sx_report(SX_ERROR, "Unable to create socketpair: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	if ((pid = fork()) == -1) {
+		sx_report(SX_ERROR, "Unable to fork: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (sv[0] > standinmax)
+		standinmax = sv[0];
+
+	if (pid == 0) {
+		int	fd;
+
+		/* another stand-in sees EOF only once all its copies close */
+		for (fd = 3; fd <= standinmax; fd++)
+			if (fd != sv[1])
+				close(fd);
+		session_serve(sv[1]);
+		_exit(0);
+	}
+
+	close(sv[1]);
+
+	return sv[0];
+}
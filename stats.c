@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Statistics (-Z): how long IRRd takes to start and to finish answering
+ * each kind of query, how much it sent, how many queries were in flight
+ * and how the run was split between waiting for IRRd and processing its
+ * answers, and the time and memory used by each phase of the run.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "extern.h"
+#include "sx_report.h"
+
+#define BGPQ_STATS_TICK	0.01	/* seconds per in flight sample */
+
+static const struct {
+	const char	*prefix;
+	const char	*name;
+} qtypes[BGPQ_QTYPES] = {
+	{ "!i", "!i" },
+	{ "!gas", "!gas" },
+	{ "!6as", "!6as" },
+	{ "!a", "!a" },
+	{ "!s", "!s" },
+	{ "", "other" },
+};
+
+static const char *phases[BGPQ_PHASES] = {
+	"none", "connect", "sources", "recursion", "prefixes", "aggregate",
+	"print", "teardown",
+};
+
+static double
+ts_diff(const struct timespec *to, const struct timespec *from)
+{
+	return (to->tv_sec - from->tv_sec)
+	    + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void
+histogram_add(struct bgpq_histogram *h, double t)
+{
+	double	ms = t * 1000;
+	int	i;
+
+	for (i = 0; i < BGPQ_STATS_BUCKETS - 1; i++)
+		if (ms <= (double)(1 << i))
+			break;
+
+	h->count[i]++;
+	h->sum += ms;
+	if (ms > h->max)
+		h->max = ms;
+}
+
+/* Account the answer to req, bytes long including its status lines. */
+void
+bgpq_stats_query(struct bgpq_stats *st, const struct request *req,
+    size_t bytes)
+{
+	struct bgpq_qstats	*q;
+	struct timespec		 now;
+	int			 i;
+
+	for (i = 0; i < BGPQ_QTYPES - 1; i++)
+		if (strncmp(req->request, qtypes[i].prefix,
+		    strlen(qtypes[i].prefix)) == 0)
+			break;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	q = &st->type[i];
+	q->queries++;
+	q->bytes += bytes;
+	histogram_add(&q->first, ts_diff(&req->first, &req->sent));
+	histogram_add(&q->done, ts_diff(&now, &req->sent));
+}
+
+/*
+ * Record the number of queries in flight. A sample is kept when it
+ * changes, with the most in flight during each BGPQ_STATS_TICK.
+ */
+void
+bgpq_stats_inflight(struct bgpq_stats *st, unsigned int n)
+{
+	struct bgpq_inflight	*last = NULL;
+	struct timespec		 now;
+	unsigned long		 tick;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tick = ts_diff(&now, &st->start) / BGPQ_STATS_TICK;
+
+	if (n > st->maxinflight)
+		st->maxinflight = n;
+
+	if (st->ninflight > 0)
+		last = &st->inflight[st->ninflight - 1];
+
+	if (last != NULL && last->tick == tick) {
+		if (n > last->n)
+			last->n = n;
+		return;
+	}
+	if (last != NULL && last->n == n)
+		return;
+
+	if (st->ninflight == st->sinflight) {
+		st->sinflight = st->sinflight ? st->sinflight * 2 : 256;
+		st->inflight = realloc(st->inflight,
+		    st->sinflight * sizeof(struct bgpq_inflight));
+		if (st->inflight == NULL)
+			err(1, NULL);
+	}
+
+	st->inflight[st->ninflight].tick = tick;
+	st->inflight[st->ninflight].n = n;
+	st->ninflight++;
+}
+
+/* CPU seconds used so far, and the peak resident size in KB. */
+static double
+cputime(long *maxrss)
+{
+	struct rusage	ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+
+#ifdef __APPLE__
+	*maxrss = ru.ru_maxrss / 1024;
+#else
+	*maxrss = ru.ru_maxrss;
+#endif
+
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+	    + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* End the phase running, if any, and start the next one. */
+void
+bgpq_stats_phase(struct bgpq_stats *st, bgpq_phase_t phase)
+{
+	struct bgpq_phase	*p;
+	struct timespec		 now;
+	double			 cpu;
+	long			 maxrss;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cpu = cputime(&maxrss);
+
+	if (st->phase != PHASE_NONE) {
+		p = &st->phases[st->phase];
+		p->used = 1;
+		p->wall += ts_diff(&now, &st->phasestart);
+		p->cpu += cpu - st->phasecpu;
+		p->maxrss = maxrss;
+	}
+
+	st->phase = phase;
+	st->phasestart = now;
+	st->phasecpu = cpu;
+}
+
+static void
+count_node(struct sx_radix_node *n, void *udata)
+{
+	struct bgpq_stats	*st = udata;
+
+	for (; n != NULL; n = n->son) {
+		if (n->isGlue)
+			st->glue++;
+		else
+			st->nodes++;
+	}
+}
+
+/* Count the AS numbers and the tree nodes of an expansion. */
+void
+bgpq_stats_count(struct bgpq_stats *st, struct bgpq_expander *b)
+{
+	struct asn_entry	*asne;
+
+	st->asns = st->nodes = st->glue = 0;
+
+	RB_FOREACH(asne, asn_tree, &b->asnlist)
+		st->asns++;
+
+	sx_radix_tree_foreach_refined(b->tree, count_node, st);
+	if (b->tree6 != NULL)
+		sx_radix_tree_foreach(b->tree6, count_node, st);
+}
+
+static void
+histogram_print(FILE *f, const char *name, const struct bgpq_histogram *h,
+    unsigned long queries)
+{
+	int	i;
+
+	fprintf(f, "      \"%s\": { \"mean\": %.3f, \"max\": %.3f,\n"
+	    "        \"counts\": [", name, queries ? h->sum / queries : 0,
+	    h->max);
+	for (i = 0; i < BGPQ_STATS_BUCKETS; i++)
+		fprintf(f, "%s%lu", i ? ", " : "", h->count[i]);
+	fprintf(f, "] }");
+}
+
+static void
+stats_print(FILE *f, const struct bgpq_stats *st)
+{
+	const struct bgpq_qstats	*q;
+	unsigned long			 queries = 0;
+	size_t				 i;
+	int				 nc = 0;
+
+	for (i = 0; i < BGPQ_QTYPES; i++)
+		queries += st->type[i].queries;
+
+	fprintf(f, "{\n  \"elapsed\": %.6f,\n  \"wait\": %.6f,\n"
+	    "  \"busy\": %.6f,\n  \"queries\": %lu,\n  \"bytes\": %lu,\n"
+	    "  \"max_in_flight\": %u,\n", st->elapsed, st->wait,
+	    st->elapsed > st->wait ? st->elapsed - st->wait : 0, queries,
+	    st->bytes, st->maxinflight);
+
+	fprintf(f, "  \"asns\": %lu,\n  \"nodes\": %lu,\n  \"glue_nodes\": %lu,\n"
+	    "  \"output_bytes\": %lu,\n  \"phases\": {", st->asns, st->nodes,
+	    st->glue, st->outbytes);
+	for (i = 1; i < BGPQ_PHASES; i++) {
+		if (!st->phases[i].used)
+			continue;
+		fprintf(f, "%s\n    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f, "
+		    "\"maxrss_kb\": %ld }", nc++ ? "," : "", phases[i],
+		    st->phases[i].wall, st->phases[i].cpu,
+		    st->phases[i].maxrss);
+	}
+	fprintf(f, "\n  },\n");
+	nc = 0;
+
+	fprintf(f, "  \"buckets_ms\": [");
+	for (i = 0; i < BGPQ_STATS_BUCKETS - 1; i++)
+		fprintf(f, "%s%u", i ? ", " : "", 1U << i);
+	fprintf(f, "],\n  \"types\": {");
+
+	for (i = 0; i < BGPQ_QTYPES; i++) {
+		q = &st->type[i];
+		if (q->queries == 0)
+			continue;
+		fprintf(f, "%s\n    \"%s\": {\n      \"queries\": %lu,\n"
+		    "      \"bytes\": %lu,\n", nc++ ? "," : "",
+		    qtypes[i].name, q->queries, q->bytes);
+		histogram_print(f, "first_byte_ms", &q->first, q->queries);
+		fprintf(f, ",\n");
+		histogram_print(f, "complete_ms", &q->done, q->queries);
+		fprintf(f, "\n    }");
+	}
+
+	fprintf(f, "\n  },\n  \"in_flight\": [");
+	for (i = 0; i < st->ninflight; i++)
+		fprintf(f, "%s[%.0f, %u]", i ? (i % 8 ? ", " : ",\n    ") :
+		    "\n    ", st->inflight[i].tick * BGPQ_STATS_TICK * 1000,
+		    st->inflight[i].n);
+	fprintf(f, "\n  ]\n}\n");
+}
+
+/* Write the statistics as JSON to file, or to stderr for "-". */
+int
+bgpq_stats_write(const struct bgpq_stats *st, const char *file)
+{
+	FILE	*f;
+
+	if (strcmp(file, "-") == 0) {
+		stats_print(stderr, st);
+		return 1;
+	}
+
+	if ((f = fopen(file, "w")) == NULL) {
+		sx_report(SX_ERROR, "Unable to open %s: %s\n", file,
+		    strerror(errno));
+		return 0;
+	}
+
+	stats_print(f, st);
+
+	if (fclose(f) != 0) {
+		sx_report(SX_ERROR, "Unable to write %s: %s\n", file,
+		    strerror(errno));
+		return 0;
+	}
+
+	return 1;
+}
+
+void
+bgpq_stats_free(struct bgpq_stats *st)
+{
+	free(st->inflight);
+	free(st);
+}
@@ -81,18 +81,13 @@ void
 sx_prefix_adjust_masklen(struct sx_prefix *p)
 {
 	unsigned int	nbytes = (p->family == AF_INET ? 4 : 16);
-	unsigned int	i;
+	unsigned int	i = p->masklen / 8;
 
-	if (p->masklen == nbytes * 8)
+	if (p->masklen >= nbytes * 8)
 		return; /* mask is all ones */
 
-	for (i = nbytes -1; i > p->masklen / 8; i--) {
-		p->addr.addrs[i] = 0;
-	}
-
-	for (i = 1; i <= 8 - p->masklen % 8; i++) {
-		p->addr.addrs[p->masklen / 8] &= (0xff << i);
-	}
+	p->addr.addrs[i] &= 0xff00 >> (p->masklen % 8);
+	memset(p->addr.addrs + i + 1, 0, nbytes - i - 1);
 }
 
 static void
@@ -129,6 +124,151 @@ sx_prefix_imask(struct sx_prefix *p, struct sx_prefix *q)
 		q->addr.addrs[p->masklen / 8] &= ~(1 <<(8 - i));
 }
 
+/* hex digit value plus one, zero for anything that is not a hex digit */
+static const unsigned char sx_pton_hex[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15,
+	['f'] = 16, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14,
+	['E'] = 15, ['F'] = 16,
+};
+
+#define SX_ISDIGIT(c)	((unsigned char)((c) - '0') < 10)
+
+static const unsigned char *
+sx_pton_octet(const unsigned char *c, unsigned char *o)
+{
+	unsigned int	v;
+
+	if (!SX_ISDIGIT(*c))
+		return NULL;
+
+	v = *c++ - '0';
+
+	/* leading zeros are left to the sscanf() workaround below */
+	if (v && SX_ISDIGIT(*c)) {
+		v = v * 10 + *c++ - '0';
+		if (SX_ISDIGIT(*c))
+			v = v * 10 + *c++ - '0';
+	}
+
+	if (SX_ISDIGIT(*c) || v > 255)
+		return NULL;
+
+	*o = v;
+
+	return c;
+}
+
+static const unsigned char *
+sx_pton_inet6(const unsigned char *c, unsigned char *addr)
+{
+	unsigned int	w, nd, ng = 0, words[8];
+	int		gap = -1;
+
+	if (c[0] == ':') {
+		if (c[1] != ':')
+			return NULL;
+		gap = 0;
+		c += 2;
+		if (!sx_pton_hex[*c])
+			goto done;
+	}
+
+	for (;;) {
+		for (w = 0, nd = 0; sx_pton_hex[*c] && nd < 5; c++, nd++)
+			w = (w << 4) | (sx_pton_hex[*c] - 1);
+
+		/* dotted quad tail is left to inet_pton() */
+		if (nd == 0 || nd > 4 || ng == 8 || *c == '.')
+			return NULL;
+
+		words[ng++] = w;
+
+		if (*c != ':')
+			break;
+		if (*++c == ':') {
+			if (gap != -1)
+				return NULL;
+			gap = ng;
+			if (!sx_pton_hex[*++c])
+				break;
+		}
+	}
+
+done:
+	if (gap == -1 ? ng != 8 : ng > 7)
+		return NULL;
+
+	memset(addr, 0, 16);
+
+	for (w = 0; w < ng; w++) {
+		nd = (gap != -1 && (int)w >= gap) ? w + 8 - ng : w;
+		addr[2 * nd] = words[w] >> 8;
+		addr[2 * nd + 1] = words[w] & 0xff;
+	}
+
+	return c;
+}
+
+/*
+ * Single pass parser for the canonical prefixes IRRd sends: plain
+ * dotted quads, IPv6 with or without zero compression and an optional
+ * decimal /len. Returns 0 on anything else (leading zeros, embedded
+ * IPv4, whitespace, out of range masklen, family mismatch), leaving the
+ * decision and the error reporting to sx_prefix_parse().
+ */
+static int
+sx_prefix_parse_fast(struct sx_prefix *p, int af, const char *text)
+{
+	const unsigned char	*c = (const unsigned char *)text;
+	unsigned char		 addr[16];
+	unsigned int		 i, masklen, maxlen;
+	int			 family;
+
+	for (i = 0; i < 4 && sx_pton_hex[c[i]]; i++)
+		;
+
+	if (c[i] == '.') {
+		family = AF_INET;
+		maxlen = 32;
+		for (i = 0; i < 4; i++) {
+			if (i && *c++ != '.')
+				return 0;
+			if ((c = sx_pton_octet(c, addr + i)) == NULL)
+				return 0;
+		}
+	} else {
+		family = AF_INET6;
+		maxlen = 128;
+		if ((c = sx_pton_inet6(c, addr)) == NULL)
+			return 0;
+	}
+
+	if (af && af != family)
+		return 0;
+
+	masklen = maxlen;
+
+	if (*c == '/') {
+		c++;
+		for (i = 0, masklen = 0; i < 4 && SX_ISDIGIT(*c); i++, c++)
+			masklen = masklen * 10 + *c - '0';
+		if (i == 0 || i > 3 || masklen > maxlen)
+			return 0;
+	}
+
+	if (*c != 0)
+		return 0;
+
+	memset(&p->addr, 0, sizeof(p->addr));
+	memcpy(p->addr.addrs, addr, maxlen / 8);
+	p->family = family;
+	p->masklen = masklen;
+	sx_prefix_adjust_masklen(p);
+
+	return 1;
+}
 
 int
 sx_prefix_parse(struct sx_prefix *p, int af, char *text)
@@ -137,6 +277,9 @@ sx_prefix_parse(struct sx_prefix *p, int af, char *text)
 	int	 masklen, ret;
 	char	 mtext[INET6_ADDRSTRLEN + 5];
 
+	if (sx_prefix_parse_fast(p, af, text))
+		return 1;
+
 	strlcpy(mtext, text, sizeof(mtext));
 
 	c = strchr(mtext,'/');
@@ -259,26 +402,44 @@ sx_prefix_setbit(struct sx_prefix *p, int n)
 
 
 static int
-sx_radix_tree_insert_specifics(struct sx_radix_tree *t, struct sx_prefix p,
-    unsigned min, unsigned max)
+sx_prefix_specifics_foreach(struct sx_prefix p, unsigned min, unsigned max,
+    void (*func)(struct sx_prefix *, void *), void *udata)
 {
 	if (p.masklen >= min)
-		sx_radix_tree_insert(t, &p);
+		func(&p, udata);
 
 	if (p.masklen + 1 > max)
 		return 1;
 
 	p.masklen += 1;
-	sx_radix_tree_insert_specifics(t, p, min, max);
+	sx_prefix_specifics_foreach(p, min, max, func, udata);
 	sx_prefix_setbit(&p, p.masklen);
-	sx_radix_tree_insert_specifics(t, p, min, max);
+	sx_prefix_specifics_foreach(p, min, max, func, udata);
 
 	return 1;
 }
 
+static void
+sx_radix_tree_insert_cb(struct sx_prefix *p, void *udata)
+{
+	sx_radix_tree_insert((struct sx_radix_tree *)udata, p);
+}
+
 int
 sx_prefix_range_parse(struct sx_radix_tree *tree, int af, unsigned int maxlen,
     char *text)
+{
+	return sx_prefix_range_foreach(af, maxlen, text,
+	    sx_radix_tree_insert_cb, tree);
+}
+
+/*
+ * Parse a prefix-range like 192.0.2.0/24^+ and call func for every
+ * prefix it covers, in the same order the radix tree would get them.
+ */
+int
+sx_prefix_range_foreach(int af, unsigned int maxlen, char *text,
+    void (*func)(struct sx_prefix *, void *), void *udata)
 {
 	struct sx_prefix	 p;
 	unsigned long		 min, max = 0;
@@ -352,7 +513,7 @@ sx_prefix_range_parse(struct sx_radix_tree *tree, int af, unsigned int maxlen,
 	SX_DEBUG(debug_expander, "parsed prefix-range %s as %lu-%lu (maxlen: "
 	    "%u)\n", text, min, max, maxlen);
 
-	sx_radix_tree_insert_specifics(tree, p, min, max);
+	sx_prefix_specifics_foreach(p, min, max, func, udata);
 
 	return 1;
 }
@@ -378,6 +539,262 @@ sx_prefix_new(int af, char *text)
 	return p;
 }
 
+/*
+ * A compact set of prefixes, used to weed out duplicates when prefixes
+ * are printed as they arrive instead of being collected in a radix tree.
+ * Open addressing with linear probing; every slot holds the address bytes
+ * followed by masklen + 1, so an all-zero slot is an empty one.
+ */
+struct sx_prefix_set {
+	unsigned int	 keylen;
+	unsigned long	 size;
+	unsigned long	 count;
+	unsigned char	*slots;
+};
+
+static unsigned long
+sx_prefix_set_hash(const unsigned char *key, unsigned int keylen)
+{
+	uint32_t	h = 2166136261U;
+	unsigned int	i;
+
+	for (i = 0; i < keylen; i++)
+		h = (h ^ key[i]) * 16777619U;
+
+	return h ^ (h >> 15);
+}
+
+static void
+sx_prefix_set_put(struct sx_prefix_set *s, const unsigned char *key)
+{
+	unsigned long	i;
+
+	i = sx_prefix_set_hash(key, s->keylen) & (s->size - 1);
+	while (s->slots[i * s->keylen + s->keylen - 1])
+		i = (i + 1) & (s->size - 1);
+
+	memcpy(s->slots + i * s->keylen, key, s->keylen);
+}
+
+struct sx_prefix_set *
+sx_prefix_set_new(int af)
+{
+	struct sx_prefix_set *s;
+
+	if ((s = calloc(1, sizeof(struct sx_prefix_set))) == NULL)
+		err(1, NULL);
+
+	s->keylen = (af == AF_INET ? 4 : 16) + 1;
+	s->size = 1024;
+
+	if ((s->slots = calloc(s->size, s->keylen)) == NULL)
+		err(1, NULL);
+
+	return s;
+}
+
+/* returns 1 if p was not in the set yet, 0 otherwise */
+int
+sx_prefix_set_add(struct sx_prefix_set *s, struct sx_prefix *p)
+{
+	unsigned char	 key[sizeof(struct in6_addr) + 1], *old;
+	unsigned long	 i, osize;
+
+	memcpy(key, p->addr.addrs, s->keylen - 1);
+	key[s->keylen - 1] = p->masklen + 1;
+
+	i = sx_prefix_set_hash(key, s->keylen) & (s->size - 1);
+	while (s->slots[i * s->keylen + s->keylen - 1]) {
+		if (!memcmp(s->slots + i * s->keylen, key, s->keylen))
+			return 0;
+		i = (i + 1) & (s->size - 1);
+	}
+
+	if (++s->count * 2 > s->size) {
+		old = s->slots;
+		osize = s->size;
+
+		s->size *= 2;
+		if ((s->slots = calloc(s->size, s->keylen)) == NULL)
+			err(1, NULL);
+
+		for (i = 0; i < osize; i++)
+			if (old[i * s->keylen + s->keylen - 1])
+				sx_prefix_set_put(s, old + i * s->keylen);
+		free(old);
+	}
+
+	sx_prefix_set_put(s, key);
+
+	return 1;
+}
+
+void
+sx_prefix_set_free(struct sx_prefix_set *s)
+{
+	if (!s)
+		return;
+
+	free(s->slots);
+	free(s);
+}
+
+/*
+ * Lookup tables for the address formatters below: the decimal text of
+ * every octet value and the two-digit lowercase hex text of every byte.
+ */
+static const char sx_ntop_dec[256][4] = {
+	"0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11",
+	"12", "13", "14", "15", "16", "17", "18", "19", "20", "21",
+	"22", "23", "24", "25", "26", "27", "28", "29", "30", "31",
+	"32", "33", "34", "35", "36", "37", "38", "39", "40", "41",
+	"42", "43", "44", "45", "46", "47", "48", "49", "50", "51",
+	"52", "53", "54", "55", "56", "57", "58", "59", "60", "61",
+	"62", "63", "64", "65", "66", "67", "68", "69", "70", "71",
+	"72", "73", "74", "75", "76", "77", "78", "79", "80", "81",
+	"82", "83", "84", "85", "86", "87", "88", "89", "90", "91",
+	"92", "93", "94", "95", "96", "97", "98", "99", "100", "101",
+	"102", "103", "104", "105", "106", "107", "108", "109", "110",
+	"111", "112", "113", "114", "115", "116", "117", "118", "119",
+	"120", "121", "122", "123", "124", "125", "126", "127", "128",
+	"129", "130", "131", "132", "133", "134", "135", "136", "137",
+	"138", "139", "140", "141", "142", "143", "144", "145", "146",
+	"147", "148", "149", "150", "151", "152", "153", "154", "155",
+	"156", "157", "158", "159", "160", "161", "162", "163", "164",
+	"165", "166", "167", "168", "169", "170", "171", "172", "173",
+	"174", "175", "176", "177", "178", "179", "180", "181", "182",
+	"183", "184", "185", "186", "187", "188", "189", "190", "191",
+	"192", "193", "194", "195", "196", "197", "198", "199", "200",
+	"201", "202", "203", "204", "205", "206", "207", "208", "209",
+	"210", "211", "212", "213", "214", "215", "216", "217", "218",
+	"219", "220", "221", "222", "223", "224", "225", "226", "227",
+	"228", "229", "230", "231", "232", "233", "234", "235", "236",
+	"237", "238", "239", "240", "241", "242", "243", "244", "245",
+	"246", "247", "248", "249", "250", "251", "252", "253", "254",
+	"255"
+};
+
+static const char sx_ntop_hex[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static inline char *
+sx_ntop_octet(char *c, unsigned int v)
+{
+	memcpy(c, sx_ntop_dec[v], 4);
+
+	return c + (v >= 100 ? 3 : (v >= 10 ? 2 : 1));
+}
+
+static inline char *
+sx_ntop_hextet(char *c, const unsigned char *w)
+{
+	const char	*hi = sx_ntop_hex + 2 * w[0];
+	const char	*lo = sx_ntop_hex + 2 * w[1];
+
+	if (w[0]) {
+		if (w[0] >= 0x10)
+			*c++ = hi[0];
+		*c++ = hi[1];
+		*c++ = lo[0];
+	} else if (w[1] >= 0x10)
+		*c++ = lo[0];
+	*c++ = lo[1];
+
+	return c;
+}
+
+/*
+ * Dotted-quad text of an IPv4 address. buf must hold INET_ADDRSTRLEN
+ * bytes, the length of the string is returned.
+ */
+int
+sx_inet_ntop4(const struct in_addr *a, char *buf)
+{
+	const unsigned char	*o = (const unsigned char *)a;
+	char			*c = buf;
+
+	c = sx_ntop_octet(c, o[0]);
+	*c++ = '.';
+	c = sx_ntop_octet(c, o[1]);
+	*c++ = '.';
+	c = sx_ntop_octet(c, o[2]);
+	*c++ = '.';
+	c = sx_ntop_octet(c, o[3]);
+	*c = 0;
+
+	return c - buf;
+}
+
+/*
+ * RFC 5952 text of an IPv6 address, identical to what the BSD and glibc
+ * inet_ntop(3) produce: the first longest run of two or more zero groups
+ * is compressed to "::", and IPv4-compatible and IPv4-mapped addresses
+ * end in a dotted quad. buf must hold INET6_ADDRSTRLEN bytes.
+ */
+int
+sx_inet_ntop6(const struct in6_addr *a, char *buf)
+{
+	const unsigned char	*o = (const unsigned char *)a;
+	char			*c = buf;
+	int			 i, base = -1, len = 0, cbase = -1, clen = 0;
+
+	for (i = 0; i < 8; i++) {
+		if (o[2 * i] == 0 && o[2 * i + 1] == 0) {
+			if (cbase == -1)
+				cbase = i;
+			clen++;
+			if (clen > len) {
+				base = cbase;
+				len = clen;
+			}
+		} else {
+			cbase = -1;
+			clen = 0;
+		}
+	}
+
+	if (len < 2)
+		base = -1;
+
+	for (i = 0; i < 8; i++) {
+		if (base != -1 && i >= base && i < base + len) {
+			if (i == base)
+				*c++ = ':';
+			continue;
+		}
+		if (i != 0)
+			*c++ = ':';
+		if (i == 6 && base == 0 && (len == 6 ||
+		    (len == 5 && o[10] == 0xff && o[11] == 0xff))) {
+			c += sx_inet_ntop4((const struct in_addr *)(o + 12), c);
+			return c - buf;
+		}
+		c = sx_ntop_hextet(c, o + 2 * i);
+	}
+
+	if (base != -1 && base + len == 8)
+		*c++ = ':';
+	*c = 0;
+
+	return c - buf;
+}
+
+int
+sx_prefix_ntop(struct sx_prefix *p, char *buf)
+{
+	if (p->family == AF_INET)
+		return sx_inet_ntop4(&p->addr.addr, buf);
+
+	return sx_inet_ntop6(&p->addr.addr6, buf);
+}
+
 int
 sx_prefix_fprint(FILE *f, struct sx_prefix *p)
 {
@@ -388,14 +805,16 @@ sx_prefix_fprint(FILE *f, struct sx_prefix *p)
 		return 0;
 	}
 
-	inet_ntop(p->family, &p->addr, buffer, sizeof(buffer));
+	sx_prefix_ntop(p, buffer);
 	return fprintf( f ? f : stdout, "%s/%i", buffer, p->masklen);
 }
 
 int
 sx_prefix_snprintf_sep(struct sx_prefix *p, char *rbuffer, int srb, char *sep)
 {
-	char buffer[128];
+	char	 buffer[128];
+	char	*c;
+	size_t	 seplen;
 
 	if (!sep)
 		sep="/";
@@ -405,9 +824,21 @@ sx_prefix_snprintf_sep(struct sx_prefix *p, char *rbuffer, int srb, char *sep)
 		return 0;
 	}
 
-	inet_ntop(p->family, &p->addr, buffer, sizeof(buffer));
+	seplen = strlen(sep);
+
+	if (srb < 0 || (size_t)srb < INET6_ADDRSTRLEN + seplen + 4 ||
+	    p->masklen > 255) {
+		sx_prefix_ntop(p, buffer);
+		return snprintf(rbuffer, srb, "%s%s%i", buffer, sep,
+		    p->masklen);
+	}
+
+	c = rbuffer + sx_prefix_ntop(p, rbuffer);
+	memcpy(c, sep, seplen);
+	c = sx_ntop_octet(c + seplen, p->masklen);
+	*c = 0;
 
-	return snprintf(rbuffer, srb, "%s%s%i", buffer, sep, p->masklen);
+	return c - rbuffer;
 }
 
 int
@@ -430,12 +861,8 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
 			switch (*(c + 1)) {
 			case 'r':
 			case 'n':
-				if (NULL != inet_ntop(p->family, &p->addr, prefix, sizeof(prefix))) {
-					fprintf(f, "%s", prefix);
-				} else {
-					sx_report(SX_ERROR, "inet_ntop failed\n");
-					return;
-				}
+				sx_prefix_ntop(p, prefix);
+				fputs(prefix, f);
 				break;
 			case 'l':
 				fprintf(f, "%i", p->masklen);
@@ -454,21 +881,13 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
 				break;
 			case 'm':
 				sx_prefix_mask(p, q);
-				if (NULL != inet_ntop(p->family, &q->addr, prefix, sizeof(prefix))) {
-					fprintf(f, "%s", prefix);
-				} else {
-					sx_report(SX_ERROR, "inet_ntop failed\n");
-					return;
-				}
+				sx_prefix_ntop(q, prefix);
+				fputs(prefix, f);
 				break;
 			case 'i':
 				sx_prefix_imask(p, q);
-				if (NULL != inet_ntop(p->family, &q->addr, prefix, sizeof(prefix))) {
-					fprintf(f, "%s", prefix);
-				} else {
-					sx_report(SX_ERROR, "inet_ntop failed\n");
-					return;
-				}
+				sx_prefix_ntop(q, prefix);
+				fputs(prefix, f);
 				break;
 			default :
 				sx_report(SX_ERROR, "Unknown format char "
@@ -502,15 +921,7 @@ sx_prefix_snprintf_fmt(struct sx_prefix *p, FILE *f,
 int
 sx_prefix_jsnprintf(struct sx_prefix *p, char *rbuffer, int srb)
 {
-	char buffer[128];
-
-	if (!p) {
-		snprintf(rbuffer, srb, "(null)");
-		return 0;
-	}
-	inet_ntop(p->family, &p->addr, buffer, sizeof(buffer));
-
-	return snprintf(rbuffer, srb, "%s\\/%i", buffer, p->masklen);
+	return sx_prefix_snprintf_sep(p, rbuffer, srb, "\\/");
 }
 
 struct sx_radix_tree *
@@ -725,6 +1136,34 @@ next:
 	}
 }
 
+/* unlike sx_radix_tree_lookup(), returns glue nodes and no covering ones */
+struct sx_radix_node *
+sx_radix_tree_lookup_exact(struct sx_radix_tree *tree,
+    struct sx_prefix *prefix)
+{
+	unsigned int		 eb;
+	struct sx_radix_node	*chead;
+
+	if (!tree || !prefix)
+		return NULL;
+
+	if (tree->family != prefix->family)
+		return NULL;
+
+	for (chead = tree->head; chead != NULL; ) {
+		eb = sx_prefix_eqbits(chead->prefix, prefix);
+		if (eb < chead->prefix->masklen)
+			return NULL;
+		if (chead->prefix->masklen == prefix->masklen)
+			return chead;
+		if (sx_prefix_isbitset(prefix, eb + 1))
+			chead = chead->r;
+		else
+			chead = chead->l;
+	}
+
+	return NULL;
+}
 
 struct sx_radix_node *
 sx_radix_tree_insert(struct sx_radix_tree *tree, struct sx_prefix *prefix)
@@ -854,6 +1293,9 @@ sx_radix_node_foreach(struct sx_radix_node *node,
 	return 0;
 }
 
+static void sx_radix_tree_refine_foreach(struct sx_radix_tree *,
+    void (*)(struct sx_radix_node *, void *), void *);
+
 int
 sx_radix_tree_foreach(struct sx_radix_tree *tree,
     void (*func)(struct sx_radix_node *, void *), void *udata)
@@ -865,14 +1307,46 @@ sx_radix_tree_foreach(struct sx_radix_tree *tree,
 	return 0;
 }
 
-static int
-sx_radix_node_aggregate(struct sx_radix_node *node)
+/*
+ * Walk the tree as sx_radix_tree_foreach() does, after the refine
+ * sx_radix_tree_refine() left pending, if any: the walks that need the
+ * final entries, like printing or saving them, do it as they go.
+ */
+int
+sx_radix_tree_foreach_refined(struct sx_radix_tree *tree,
+    void (*func)(struct sx_radix_node *, void *), void *udata)
 {
-	if (node->l)
-		sx_radix_node_aggregate(node->l);
-	if (node->r)
-		sx_radix_node_aggregate(node->r);
+	if (!func || !tree || !tree->head)
+		return 0;
 
+	if (tree->refine || tree->refineLow)
+		sx_radix_tree_refine_foreach(tree, func, udata);
+	else
+		sx_radix_node_foreach(tree->head, func, udata);
+	return 0;
+}
+
+/*
+ * The mask lengths a node accepts, ge to le: its own, or the range of the
+ * aggregate it is.
+ */
+void
+sx_radix_node_range(const struct sx_radix_node *node, unsigned int *ge,
+    unsigned int *le)
+{
+	*ge = *le = node->prefix->masklen;
+
+	if (node->isAggregate) {
+		if (node->aggregateLow > node->prefix->masklen)
+			*ge = node->aggregateLow;
+		*le = node->aggregateHi;
+	}
+}
+
+/* Aggregate node with its children, which must be aggregated already. */
+static void
+sx_radix_node_aggregate_one(struct sx_radix_node *node)
+{
 	if (debug_aggregation) {
 		printf("Aggregating on node: ");
 		sx_prefix_fprint(stdout, node->prefix);
@@ -1032,6 +1506,17 @@ sx_radix_node_aggregate(struct sx_radix_node *node)
 			}
 		}
 	}
+}
+
+static int
+sx_radix_node_aggregate(struct sx_radix_node *node)
+{
+	if (node->l)
+		sx_radix_node_aggregate(node->l);
+	if (node->r)
+		sx_radix_node_aggregate(node->r);
+
+	sx_radix_node_aggregate_one(node);
 
 	return 0;
 }
@@ -1045,131 +1530,196 @@ sx_radix_tree_aggregate(struct sx_radix_tree *tree)
 	return 0;
 }
 
+/*
+ * Refine with -R and -r, and aggregate with -A, in one walk of the tree.
+ *
+ * A prefix shorter than refine, not covered by another one, becomes an
+ * aggregate up to refine, and everything it covers up to refine turns
+ * into glue. A prefix up to refineLow, not covered by another one, then
+ * gets refineLow as the low end of its aggregate, or becomes an aggregate
+ * from refineLow to the longest prefix, and everything it covers up to
+ * refineLow turns into glue. Whether a node is covered is passed down the
+ * walk, so each node is visited once.
+ *
+ * A node is final once refined, unless aggregation follows: that needs
+ * the children of a node to be done, runs on the way back up and can
+ * still change the children. Without aggregation the refining is left
+ * to the next sx_radix_tree_foreach_refined(), which then hands each node
+ * to its callback as soon as it is refined, so the printers get the final
+ * entries from the same walk.
+ */
+struct sx_refine {
+	unsigned	refine;
+	unsigned	refineLow;
+	unsigned	until;		/* nothing to refine beyond this */
+	int		aggregate;
+	void		(*func)(struct sx_radix_node *, void *);
+	void		*udata;
+};
+
 static void
-setGlueUpTo(struct sx_radix_node *node, void *udata)
+sx_radix_node_refine(struct sx_radix_node *node, const struct sx_refine *rf,
+    int covered, int coveredLow)
 {
-	unsigned refine = *(unsigned *)udata;
+	unsigned	masklen = node->prefix->masklen;
 
-	if (node && node->prefix->masklen <= refine)
-		node->isGlue = 1;
-}
-
-static int
-sx_radix_node_refine(struct sx_radix_node *node, unsigned refine)
-{
-	if (!node->isGlue && node->prefix->masklen<refine) {
-		node->isAggregate = 1;
-		node->aggregateLow = node->prefix->masklen;
-		node->aggregateHi = refine;
-		if (node->l) {
-			sx_radix_node_foreach(node->l, setGlueUpTo, &refine);
-			sx_radix_node_refine(node->l, refine);
+	if (rf->refine) {
+		if (covered && masklen <= rf->refine) {
+			node->isGlue = 1;
+		} else if (!node->isGlue && masklen < rf->refine) {
+			node->isAggregate = 1;
+			node->aggregateLow = masklen;
+			node->aggregateHi = rf->refine;
+			covered = 1;
 		}
-		if (node->r) {
-			sx_radix_node_foreach(node->r, setGlueUpTo, &refine);
-			sx_radix_node_refine(node->r, refine);
+	}
+
+	if (rf->refineLow) {
+		if (coveredLow && masklen <= rf->refineLow) {
+			node->isGlue = 1;
+		} else if (!node->isGlue && masklen <= rf->refineLow) {
+			if (!node->isAggregate) {
+				node->isAggregate = 1;
+				if (node->prefix->family == AF_INET)
+					node->aggregateHi = 32;
+				else
+					node->aggregateHi = 128;
+			}
+			node->aggregateLow = rf->refineLow;
+			coveredLow = 1;
 		}
-	} else if (!node->isGlue && node->prefix->masklen == refine) {
-		/* not setting aggregate in this case */
-		if (node->l)
-			sx_radix_node_refine(node->l, refine);
-		if (node->r)
-			sx_radix_node_refine(node->r, refine);
-	} else if (node->isGlue) {
-		if (node->r)
-			sx_radix_node_refine(node->r, refine);
-		if (node->l)
-			sx_radix_node_refine(node->l, refine);
-	} else {
-		/* node->prefix.masklen > refine */
-		/*
-		 * do nothing, should pass specifics 'as is'. Also, do not
-		 * process any embedded routes, their masklen is bigger, too...
-		node->isGlue = 1;
-		if (node->l)
-			sx_radix_node_foreach(node->l, setGlue, NULL);
+	}
 
-		if (node->r)
-			sx_radix_node_foreach(node->r, setGlue, NULL);
-		*/
+	if (rf->func)
+		rf->func(node, rf->udata);
+
+	/* Everything below is longer, there is nothing left to refine. */
+	if (masklen >= rf->until) {
+		if (rf->aggregate)
+			sx_radix_node_aggregate(node);
+		if (rf->func && node->l)
+			sx_radix_node_foreach(node->l, rf->func, rf->udata);
+		if (rf->func && node->r)
+			sx_radix_node_foreach(node->r, rf->func, rf->udata);
+		return;
 	}
-	return 0;
+
+	if (node->l)
+		sx_radix_node_refine(node->l, rf, covered, coveredLow);
+	if (node->r)
+		sx_radix_node_refine(node->r, rf, covered, coveredLow);
+
+	if (rf->aggregate)
+		sx_radix_node_aggregate_one(node);
 }
-	
-int
-sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine)
+
+static void
+sx_radix_tree_refine_foreach(struct sx_radix_tree *tree,
+    void (*func)(struct sx_radix_node *, void *), void *udata)
 {
-	if (tree && tree->head)
-		return sx_radix_node_refine(tree->head, refine);
+	struct sx_refine	rf;
 
-	return 0;
+	memset(&rf, 0, sizeof(rf));
+	rf.refine = tree->refine;
+	rf.refineLow = tree->refineLow;
+	rf.until = rf.refine > rf.refineLow ? rf.refine : rf.refineLow;
+	rf.func = func;
+	rf.udata = udata;
+
+	tree->refine = tree->refineLow = 0;
+
+	sx_radix_node_refine(tree->head, &rf, 0, 0);
 }
 
 static void
-setGlueFrom(struct sx_radix_node *node, void *udata)
+sx_radix_node_split(struct sx_radix_node *node, unsigned depth,
+    struct sx_radix_piece *pieces, size_t *n)
 {
-	unsigned refine = *(unsigned *)udata;
+	if (pieces) {
+		pieces[*n].node = node;
+		pieces[*n].subtree = depth == 0;
+	}
+	(*n)++;
 
-	if (node && node->prefix->masklen <= refine)
-		node->isGlue = 1;
+	if (depth == 0)
+		return;
+
+	if (node->l)
+		sx_radix_node_split(node->l, depth - 1, pieces, n);
+	if (node->r)
+		sx_radix_node_split(node->r, depth - 1, pieces, n);
 }
 
-static int
-sx_radix_node_refineLow(struct sx_radix_node *node, unsigned refineLow)
+/*
+ * Cut the tree into pieces that can be walked independently, e.g. by
+ * different threads: each node less than depth levels below the head on
+ * its own, and the subtrees depth levels below it. The pieces come in the
+ * order sx_radix_tree_foreach() visits their nodes, so walking them one
+ * after the other with sx_radix_piece_foreach() is walking the tree.
+ * A pending refine is done first, the walks don't change the tree.
+ */
+size_t
+sx_radix_tree_split(struct sx_radix_tree *tree, unsigned depth,
+    struct sx_radix_piece **pieces)
 {
-	if (!node->isGlue && node->prefix->masklen<=refineLow) {
+	size_t	n = 0;
 
-		if (!node->isAggregate) {
-			node->isAggregate = 1;
-			node->aggregateLow = refineLow;
-			if (node->prefix->family == AF_INET)
-				node->aggregateHi = 32;
-			else
-				node->aggregateHi = 128;
-		} else
-			node->aggregateLow=refineLow;
+	*pieces = NULL;
 
-		if (node->l) {
-			sx_radix_node_foreach(node->l, setGlueFrom, &refineLow);
-			sx_radix_node_refineLow(node->l, refineLow);
-		}
+	if (!tree || !tree->head)
+		return 0;
 
-		if (node->r) {
-			sx_radix_node_foreach(node->r, setGlueFrom, &refineLow);
-			sx_radix_node_refineLow(node->r, refineLow);
-		}
+	if (tree->refine || tree->refineLow)
+		sx_radix_tree_refine_foreach(tree, NULL, NULL);
 
-	} else if (!node->isGlue && node->prefix->masklen == refineLow) {
-		/* not setting aggregate in this case */
-		if (node->l)
-			sx_radix_node_refineLow(node->l, refineLow);
-		if (node->r)
-			sx_radix_node_refineLow(node->r, refineLow);
-	} else if (node->isGlue) {
-		if (node->r)
-			sx_radix_node_refineLow(node->r, refineLow);
-		if (node->l)
-			sx_radix_node_refineLow(node->l, refineLow);
-	} else {
-		/* node->prefix.masklen > refine */
-		/* do nothing, should pass specifics 'as is'. Also, do not
-		process any embedded routes, their masklen is bigger, too...
-		node->isGlue = 1;
-		if (node->l)
-			sx_radix_node_foreach(node->l, setGlue, NULL);
-		if (node->r)
-			sx_radix_node_foreach(node->r, setGlue, NULL);
-		*/
-	}
+	sx_radix_node_split(tree->head, depth, NULL, &n);
 
-	return 0;
+	if ((*pieces = calloc(n, sizeof(struct sx_radix_piece))) == NULL)
+		err(1, NULL);
+
+	n = 0;
+	sx_radix_node_split(tree->head, depth, *pieces, &n);
+
+	return n;
 }
 
+void
+sx_radix_piece_foreach(struct sx_radix_piece *piece,
+    void (*func)(struct sx_radix_node *, void *), void *udata)
+{
+	if (piece->subtree)
+		sx_radix_node_foreach(piece->node, func, udata);
+	else
+		func(piece->node, udata);
+}
+
+/*
+ * Refine the tree, and aggregate it too if asked to, which happens right
+ * away. Otherwise the refining is done by the next
+ * sx_radix_tree_foreach_refined().
+ */
 int
-sx_radix_tree_refineLow(struct sx_radix_tree *tree, unsigned refineLow)
+sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine,
+    unsigned refineLow, int aggregate)
 {
-	if (tree && tree->head)
-		return sx_radix_node_refineLow(tree->head, refineLow);
+	struct sx_refine	rf;
+
+	if (!tree || !tree->head)
+		return 0;
+
+	if (!aggregate) {
+		tree->refine = refine;
+		tree->refineLow = refineLow;
+		return 0;
+	}
+
+	memset(&rf, 0, sizeof(rf));
+	rf.refine = refine;
+	rf.refineLow = refineLow;
+	rf.until = refine > refineLow ? refine : refineLow;
+	rf.aggregate = aggregate;
+
+	sx_radix_node_refine(tree->head, &rf, 0, 0);
 
 	return 0;
 }
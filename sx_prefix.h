@@ -56,6 +56,8 @@ typedef struct sx_radix_node {
 typedef struct sx_radix_tree { 
 	int 			 family;
 	struct sx_radix_node	*head;
+	unsigned int		 refine;	/* pending, see */
+	unsigned int		 refineLow;	/* sx_radix_tree_refine */
 } sx_radix_tree_t;
 
 /* most common operations with the tree is to: lookup/insert/unlink */
@@ -74,6 +76,11 @@ void sx_prefix_adjust_masklen(struct sx_prefix *p);
 struct sx_prefix *sx_prefix_new(int af, char *text);
 int sx_prefix_parse(struct sx_prefix *p, int af, char *text);
 int sx_prefix_range_parse(struct sx_radix_tree *t, int af, unsigned int ml, char *text);
+int sx_prefix_range_foreach(int af, unsigned int ml, char *text,
+    void (*func)(struct sx_prefix *, void *), void *udata);
+int sx_inet_ntop4(const struct in_addr *a, char *buf);
+int sx_inet_ntop6(const struct in6_addr *a, char *buf);
+int sx_prefix_ntop(struct sx_prefix *p, char *buf);
 int sx_prefix_fprint(FILE *f, struct sx_prefix *p);
 int sx_prefix_snprintf(struct sx_prefix *p, char *rbuffer, int srb);
 int sx_prefix_snprintf_sep(struct sx_prefix *p, char *rbuffer, int srb, char *);
@@ -90,9 +97,30 @@ int  sx_radix_node_foreach(struct sx_radix_node *node,
 	void (*func)(struct sx_radix_node *, void *), void *udata);
 int sx_radix_tree_foreach(struct sx_radix_tree *tree, 
 	void (*func)(struct sx_radix_node *, void *), void *udata);
+int sx_radix_tree_foreach_refined(struct sx_radix_tree *tree,
+	void (*func)(struct sx_radix_node *, void *), void *udata);
+void sx_radix_node_range(const struct sx_radix_node *node, unsigned int *ge,
+    unsigned int *le);
 int sx_radix_tree_aggregate(struct sx_radix_tree *tree);
-int sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine);
-int sx_radix_tree_refineLow(struct sx_radix_tree *tree, unsigned refineLow);
+int sx_radix_tree_refine(struct sx_radix_tree *tree, unsigned refine,
+    unsigned refineLow, int aggregate);
+
+/* a node, or a node and everything below it, see sx_radix_tree_split */
+struct sx_radix_piece {
+	struct sx_radix_node	*node;
+	int			 subtree;
+};
+
+size_t sx_radix_tree_split(struct sx_radix_tree *tree, unsigned depth,
+    struct sx_radix_piece **pieces);
+void sx_radix_piece_foreach(struct sx_radix_piece *piece,
+	void (*func)(struct sx_radix_node *, void *), void *udata);
+
+struct sx_prefix_set;
+
+struct sx_prefix_set *sx_prefix_set_new(int af);
+int sx_prefix_set_add(struct sx_prefix_set *s, struct sx_prefix *p);
+void sx_prefix_set_free(struct sx_prefix_set *s);
 
 #ifndef HAVE_STRLCPY
 size_t strlcpy(char *dst, const char *src, size_t size);
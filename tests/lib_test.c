@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Expand objects through libbgpq4 from an IRRd on 127.0.0.1, once over a
+ * connection the library opens and once over one opened here, check both
+ * agree and that the prefix walk sees every entry, and print the Cisco
+ * prefix-list for tests/mock_test.sh to compare with bgpq4's. Expanding
+ * over a connection the server closed fails without ending the process.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bgpq4.h"
+
+static struct bgpq4 *
+expand(const char *port, int fd, int argc, char *argv[])
+{
+	struct bgpq4	*q;
+	char		 server[64];
+	int		 i;
+
+	if ((q = bgpq4_new(AF_INET)) == NULL)
+		errx(1, "bgpq4_new");
+
+	snprintf(server, sizeof(server), "127.0.0.1:%s", port);
+	if (!bgpq4_add_server(q, server))
+		errx(1, "bgpq4_add_server %s", server);
+
+	for (i = 0; i < argc; i++)
+		if (!bgpq4_add(q, argv[i]))
+			errx(1, "bgpq4_add %s", argv[i]);
+
+	if (!bgpq4_expand(q, fd))
+		errx(1, "bgpq4_expand");
+
+	return q;
+}
+
+static void
+count(const struct bgpq4_prefix *p, void *arg)
+{
+	if (p->family == AF_INET && p->ge == p->len && p->le == p->len)
+		(*(size_t *)arg)++;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bgpq4		*q1, *q2, *q3;
+	struct sockaddr_in	 sin;
+	char			*b1, *b2, *c;
+	size_t			 l1, l2, n = 0, lines = 0;
+	int			 fd, sp[2], i;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: lib_test port object ...\n");
+		return 1;
+	}
+
+	q1 = expand(argv[1], -1, argc - 2, argv + 2);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[1]));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "connect");
+
+	q2 = expand(argv[1], fd, argc - 2, argv + 2);
+
+	if (!bgpq4_render(q1, &b1, &l1) || !bgpq4_render(q2, &b2, &l2))
+		errx(1, "bgpq4_render");
+	if (l1 != l2 || memcmp(b1, b2, l1) != 0)
+		errx(1, "expansions over the two connections differ");
+
+	/* "no ip prefix-list", then an exact entry per line */
+	bgpq4_foreach_prefix(q2, count, &n);
+	for (c = b2; (c = memchr(c, '\n', l2 - (c - b2))) != NULL; c++)
+		lines++;
+	if (n + 1 != lines)
+		errx(1, "%zu prefixes walked, %zu lines rendered", n, lines);
+
+	if ((q3 = bgpq4_new(AF_INET)) == NULL)
+		errx(1, "bgpq4_new");
+	for (i = 2; i < argc; i++)
+		if (!bgpq4_add(q3, argv[i]))
+			errx(1, "bgpq4_add %s", argv[i]);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+		err(1, "socketpair");
+	close(sp[1]);
+	if (bgpq4_expand(q3, sp[0]))
+		errx(1, "expansion over a closed connection succeeded");
+	bgpq4_free(q3);
+
+	fwrite(b1, 1, l1, stdout);
+
+	free(b1);
+	free(b2);
+	bgpq4_free(q1);
+	bgpq4_free(q2);
+
+	return 0;
+}
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A mock IRRd serving a synthetic dataset, to load and latency test the
+ * expander without touching a real IRR.
+ *
+ * There are N trees of AS-sets, AS-MOCK0 to AS-MOCK<N-1>. Each set has F
+ * ASN members and, above depth D, F member sets. The sets of a tree are
+ * numbered breadth first: the root is AS-MOCK<i>, the members of set k
+ * are AS-MOCK<i>-<k*F+1> to AS-MOCK<i>-<k*F+F>. Every ASN, counting up
+ * from AS1000000, originates M consecutive IPv4 /24s from 1.0.0.0 and
+ * M consecutive IPv6 /48s from 2000::, so the whole dataset follows from
+ * N, D, F and M and nothing is kept in memory.
+ *
+ * Each connection is served by its own process. Answers can be delayed
+ * (-D) and paced to a bandwidth (-b), and connections can be made to
+ * close (-x) or to hang (-w) after some number of queries.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_BASEASN	1000000UL
+
+static unsigned long	nsets = 10;
+static unsigned long	depth = 2;
+static unsigned long	fanout = 4;
+static unsigned long	nprefixes = 2;
+static unsigned long	delay;		/* ms before each answer */
+static unsigned long	bandwidth;	/* bytes per second, 0 unlimited */
+static unsigned long	closeafter;
+static unsigned long	hangafter;
+static int		aquery = 1;
+static const char	*sources = "MOCK";
+
+static unsigned long	setsize;	/* sets in one tree */
+
+/* The answer being built. */
+static char		*abuf;
+static size_t		 alen, asize;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: mock_irrd [-A] [-b bytes/s] [-D ms] "
+	    "[-d depth] [-f fanout]\n"
+	    "                 [-l address] [-m prefixes] [-n sets] "
+	    "[-p port] [-s sources]\n"
+	    "                 [-w queries] [-x queries]\n");
+	exit(1);
+}
+
+static unsigned long
+number(const char *s, unsigned long max)
+{
+	char		*ep;
+	unsigned long	 n;
+
+	errno = 0;
+	n = strtoul(s, &ep, 10);
+	if (*s == '\0' || *s == '-' || *ep != '\0' || errno != 0 || n > max)
+		errx(1, "invalid number: %s", s);
+
+	return n;
+}
+
+static void
+append(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void
+append(const char *fmt, ...)
+{
+	va_list	ap;
+	int	n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(abuf + alen, asize - alen, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(1, "vsnprintf");
+		if ((size_t)n < asize - alen)
+			break;
+		asize = asize * 2 + n;
+		if ((abuf = realloc(abuf, asize)) == NULL)
+			err(1, NULL);
+	}
+	alen += n;
+}
+
+static unsigned long
+set_depth(unsigned long k)
+{
+	unsigned long	d = 0;
+
+	for (; k > 0; k = (k - 1) / fanout)
+		d++;
+
+	return d;
+}
+
+/* Parse AS-MOCK<i>[-<k>] into the tree i and the set k within it. */
+static int
+set_parse(const char *name, unsigned long *i, unsigned long *k)
+{
+	char	*ep;
+
+	if (strncasecmp(name, "AS-MOCK", 7) != 0)
+		return 0;
+
+	errno = 0;
+	*i = strtoul(name + 7, &ep, 10);
+	if (ep == name + 7 || errno != 0 || *i >= nsets)
+		return 0;
+
+	*k = 0;
+	if (*ep == '-') {
+		name = ep + 1;
+		*k = strtoul(name, &ep, 10);
+		if (ep == name || errno != 0 || *k == 0 || *k >= setsize)
+			return 0;
+	}
+
+	return *ep == '\0';
+}
+
+/* The first ASN of set k of tree i. */
+static unsigned long
+set_asn(unsigned long i, unsigned long k)
+{
+	return MOCK_BASEASN + (i * setsize + k) * fanout;
+}
+
+static int
+asn_parse(const char *s, unsigned long *asn)
+{
+	char	*ep;
+
+	if (strncasecmp(s, "AS", 2) == 0)
+		s += 2;
+
+	errno = 0;
+	*asn = strtoul(s, &ep, 10);
+	if (ep == s || *ep != '\0' || errno != 0)
+		return 0;
+
+	return *asn >= MOCK_BASEASN && *asn < set_asn(nsets, 0);
+}
+
+static void
+asn_prefixes(unsigned long asn, int family)
+{
+	unsigned long	p, j;
+
+	for (j = 0; j < nprefixes; j++) {
+		p = (asn - MOCK_BASEASN) * nprefixes + j;
+		if (family == AF_INET)
+			append("%s%lu.%lu.%lu.0/24", alen ? " " : "",
+			    1 + (p >> 16), (p >> 8) & 0xff, p & 0xff);
+		else
+			append("%s%lx:%lx:%lx::/48", alen ? " " : "",
+			    0x2000 | ((p >> 32) & 0xfff), (p >> 16) & 0xffff,
+			    p & 0xffff);
+	}
+}
+
+/*
+ * Walk set k of tree i and its members. Either list its members,
+ * expanded to ASNs when recursive, or list the prefixes of all its ASNs.
+ */
+static void
+set_walk(unsigned long i, unsigned long k, int recursive, int family)
+{
+	unsigned long	asn, j;
+
+	for (j = 0, asn = set_asn(i, k); j < fanout; j++, asn++) {
+		if (family != 0)
+			asn_prefixes(asn, family);
+		else
+			append("%sAS%lu", alen ? " " : "", asn);
+	}
+
+	if (set_depth(k) >= depth)
+		return;
+
+	for (j = 1; j <= fanout; j++) {
+		if (recursive || family != 0)
+			set_walk(i, k * fanout + j, recursive, family);
+		else
+			append(" AS-MOCK%lu-%lu", i, k * fanout + j);
+	}
+}
+
+/* Frame what has been appended as an IRRd answer. */
+static void
+answer(int found)
+{
+	char	hdr[32];
+	int	n;
+
+	if (!found) {
+		alen = 0;
+		append("D\n");
+		return;
+	}
+	if (alen == 0) {
+		append("C\n");
+		return;
+	}
+
+	append("\nC\n");
+	n = snprintf(hdr, sizeof(hdr), "A%zu\n", alen - 2);
+	if (alen + n > asize) {
+		asize = alen + n;
+		if ((abuf = realloc(abuf, asize)) == NULL)
+			err(1, NULL);
+	}
+	memmove(abuf + n, abuf, alen);
+	memcpy(abuf, hdr, n);
+	alen += n;
+}
+
+/* Answer query q into abuf. Returns 0 for !q. */
+static int
+query(char *q)
+{
+	unsigned long	 i, k, asn;
+	size_t		 len;
+	int		 recursive = 0;
+
+	alen = 0;
+	len = strlen(q);
+	if (len > 0 && q[len - 1] == '\r')
+		q[--len] = '\0';
+
+	if (strcmp(q, "!q") == 0)
+		return 0;
+	if (strcmp(q, "!!") == 0 || len == 0)
+		return 1;
+
+	if (strncmp(q, "!n", 2) == 0) {
+		append("C\n");
+	} else if (strcmp(q, "!s-lc") == 0) {
+		append("%s", sources);
+		answer(1);
+	} else if (strncmp(q, "!s", 2) == 0) {
+		append("C\n");
+	} else if (strncmp(q, "!gas", 4) == 0 ||
+	    strncmp(q, "!6as", 4) == 0) {
+		if (asn_parse(q + 4, &asn))
+			asn_prefixes(asn, q[1] == 'g' ? AF_INET : AF_INET6);
+		answer(asn_parse(q + 4, &asn));
+	} else if (strncmp(q, "!i", 2) == 0) {
+		if (len > 4 && strcmp(q + len - 2, ",1") == 0) {
+			q[len - 2] = '\0';
+			recursive = 1;
+		}
+		if (set_parse(q + 2, &i, &k))
+			set_walk(i, k, recursive, 0);
+		answer(set_parse(q + 2, &i, &k));
+	} else if (strncmp(q, "!a", 2) == 0 && aquery) {
+		q += 2;
+		if (*q == '\0') {
+			append("F Missing required set name for A query\n");
+			return 1;
+		}
+		if (*q == '4' || *q == '6')
+			q++;
+		if (!set_parse(q, &i, &k)) {
+			answer(0);
+			return 1;
+		}
+		if (q[-1] != '6')
+			set_walk(i, k, 1, AF_INET);
+		if (q[-1] != '4')
+			set_walk(i, k, 1, AF_INET6);
+		answer(1);
+	} else {
+		append("F Unrecognized command\n");
+	}
+
+	return 1;
+}
+
+static void
+sleep_ms(unsigned long ms)
+{
+	struct timespec	ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+/* Write the answer, paced to the bandwidth if one is set. */
+static int
+reply(int fd)
+{
+	struct timespec	start, now;
+	size_t		off, chunk;
+	ssize_t		n;
+	double		due, at;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (off = 0; off < alen; off += n) {
+		chunk = alen - off;
+		if (bandwidth > 0) {
+			if (chunk > bandwidth / 100 + 1)
+				chunk = bandwidth / 100 + 1;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			due = (double)off / bandwidth;
+			at = (now.tv_sec - start.tv_sec)
+			    + (now.tv_nsec - start.tv_nsec) / 1e9;
+			if (due > at)
+				sleep_ms((due - at) * 1000 + 1);
+		}
+		if ((n = write(fd, abuf + off, chunk)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void
+serve(int fd)
+{
+	unsigned long	 queries = 0;
+	char		 buf[8192], *line, *nl;
+	size_t		 len = 0;
+	ssize_t		 n;
+
+	for (;;) {
+		if (len == sizeof(buf))
+			errx(1, "query too long");
+		if ((n = read(fd, buf + len, sizeof(buf) - len)) <= 0)
+			return;
+		len += n;
+
+		for (line = buf; (nl = memchr(line, '\n', buf + len - line))
+		    != NULL; line = nl + 1) {
+			*nl = '\0';
+			if (!query(line))
+				return;
+			if (alen == 0)
+				continue;
+			queries++;
+			if (hangafter > 0 && queries > hangafter) {
+				/* no more answers, until the client gives up */
+				while (read(fd, buf, sizeof(buf)) > 0)
+					;
+				return;
+			}
+			if (closeafter > 0 && queries > closeafter)
+				return;
+			if (delay > 0)
+				sleep_ms(delay);
+			if (!reply(fd))
+				return;
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 slen;
+	const char		*addr = "127.0.0.1";
+	unsigned long		 n;
+	int			 ch, s, c, on = 1, port = 0;
+
+	while ((ch = getopt(argc, argv, "Ab:D:d:f:l:m:n:p:s:w:x:")) != -1) {
+		switch (ch) {
+		case 'A':
+			aquery = 0;
+			break;
+		case 'b':
+			bandwidth = number(optarg, ULONG_MAX);
+			break;
+		case 'D':
+			delay = number(optarg, 3600000);
+			break;
+		case 'd':
+			depth = number(optarg, 32);
+			break;
+		case 'f':
+			fanout = number(optarg, 1000);
+			if (fanout < 2)
+				errx(1, "fanout must be at least 2");
+			break;
+		case 'l':
+			addr = optarg;
+			break;
+		case 'm':
+			nprefixes = number(optarg, 65536);
+			break;
+		case 'n':
+			nsets = number(optarg, 1000000);
+			break;
+		case 'p':
+			port = number(optarg, 65535);
+			break;
+		case 's':
+			sources = optarg;
+			break;
+		case 'w':
+			hangafter = number(optarg, ULONG_MAX);
+			break;
+		case 'x':
+			closeafter = number(optarg, ULONG_MAX);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	/* The ASNs and prefixes must fit their number spaces. */
+	for (setsize = 1, n = 1; n <= depth; n++) {
+		if (setsize > (ULONG_MAX - 1) / fanout)
+			errx(1, "too many sets");
+		setsize = setsize * fanout + 1;
+	}
+	if (nsets > (4200000000UL - MOCK_BASEASN) / setsize / fanout)
+		errx(1, "too many ASNs");
+	if ((set_asn(nsets, 0) - MOCK_BASEASN) * nprefixes > (0xdfUL << 16))
+		errx(1, "too many prefixes");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+		errx(1, "invalid address: %s", addr);
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind");
+	if (listen(s, 128) == -1)
+		err(1, "listen");
+
+	/* Tell the caller where to connect, for -p 0 in particular. */
+	slen = sizeof(sin);
+	if (getsockname(s, (struct sockaddr *)&sin, &slen) == -1)
+		err(1, "getsockname");
+	printf("%u\n", ntohs(sin.sin_port));
+	fflush(stdout);
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(s);
+			serve(c);
+			_exit(0);
+		default:
+			close(c);
+		}
+	}
+}
@@ -0,0 +1,250 @@
+#!/bin/sh
+#
+# Expand the synthetic dataset of tests/mock_irrd through the different
+# query paths of bgpq4 and check they all agree.
+
+if [ $# -ne 3 ]
+then
+    echo "Usage: ${0} path/to/bgpq4 path/to/mock_irrd path/to/lib_test"
+    exit 1
+fi
+
+BGPQ4="${1}"
+MOCK="${2}"
+LIB="${3}"
+TMP=$(mktemp -d) || exit 1
+PIDS=""
+
+cleanup() {
+    [ -n "${PIDS}" ] && kill ${PIDS} 2>/dev/null
+    rm -rf "${TMP}"
+}
+trap cleanup EXIT
+
+# Start a mock IRRd with the given options, its port goes to ${PORT}.
+mock() {
+    rm -f "${TMP}/port"
+    "${MOCK}" "$@" > "${TMP}/port" &
+    PIDS="${PIDS} $!"
+    while [ ! -s "${TMP}/port" ]
+    do
+        kill -0 $! 2>/dev/null || fail "mock_irrd $* did not start"
+        sleep 0.1
+    done
+    PORT=$(cat "${TMP}/port")
+}
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+DATA="-n 3 -d 2 -f 3 -m 2"
+mock ${DATA}; A=${PORT}
+mock ${DATA} -A; I=${PORT}
+mock ${DATA} -A -x 4; X=${PORT}
+mock -n 1 -d 1 -f 2 -m 2; S=${PORT}
+mock ${DATA} -A -w 30; W=${PORT}
+
+# One tree of three sets with two ASNs each, and two /24s per ASN.
+"${BGPQ4}" -h 127.0.0.1:${S} -A AS-MOCK0 > "${TMP}/small" ||
+    fail "small dataset"
+cat > "${TMP}/expect" <<EOF
+no ip prefix-list NN
+ip prefix-list NN permit 1.0.0.0/21 ge 24 le 24
+ip prefix-list NN permit 1.0.8.0/22 ge 24 le 24
+EOF
+cmp -s "${TMP}/expect" "${TMP}/small" || fail "small dataset output"
+
+# The same list as binary output: the header, the name padded to 8 bytes
+# and two 20 byte records, the first of them 1.0.0.0/21 ge 24 le 24.
+bytes() {
+    od -An -tu1 -j "${2}" -N "${3}" "${1}" | tr -s ' \n' ' ' | sed 's/ $//'
+}
+"${BGPQ4}" -h 127.0.0.1:${S} -A -Y AS-MOCK0 > "${TMP}/y" || fail "-Y"
+[ "$(head -c 4 "${TMP}/y")" = "BGQ4" ] || fail "-Y: magic"
+[ "$(bytes "${TMP}/y" 4 12)" = " 1 1 20 4 0 0 0 2 0 0 0 2" ] ||
+    fail "-Y: header"
+[ "$(wc -c < "${TMP}/y")" -eq $((16 + 8 + 2 * 20)) ] || fail "-Y: size"
+[ "$(bytes "${TMP}/y" 24 20)" = \
+    " 4 21 24 24 1 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0" ] || fail "-Y: record"
+"${BGPQ4}" -h 127.0.0.1:${S} -t -Y AS-MOCK0 > "${TMP}/y" || fail "-t -Y"
+[ "$(bytes "${TMP}/y" 4 12)" = " 1 2 4 0 0 0 0 6 0 0 0 2" ] ||
+    fail "-t -Y: header"
+[ "$(wc -c < "${TMP}/y")" -eq $((16 + 8 + 6 * 4)) ] || fail "-t -Y: size"
+[ "$(bytes "${TMP}/y" 24 4)" = " 0 15 66 64" ] || fail "-t -Y: record"
+
+for args in "-4 AS-MOCK1" "-6 AS-MOCK1" "-A AS-MOCK0 AS-MOCK2-4" \
+    "-f 1 AS-MOCK2" "-3 -j AS-MOCK0 AS-MOCK1" "-s -A AS-MOCK0" \
+    "-R 28 -r 26 AS-MOCK0" "-A -R 28 AS-MOCK2" "-6 -R 48 -r 32 AS-MOCK1"
+do
+    "${BGPQ4}" -h 127.0.0.1:${A} ${args} > "${TMP}/a" ||
+        fail "${args}: A queries"
+    "${BGPQ4}" -h 127.0.0.1:${I} ${args} > "${TMP}/i" ||
+        fail "${args}: pipelined"
+    "${BGPQ4}" -h 127.0.0.1:${I} -T ${args} > "${TMP}/t" ||
+        fail "${args}: not pipelined"
+    "${BGPQ4}" -h 127.0.0.1:${X} ${args} > "${TMP}/x" 2>/dev/null ||
+        fail "${args}: reconnecting"
+    "${BGPQ4}" -h 127.0.0.1:${I} -O "${TMP}/rec" ${args} > /dev/null ||
+        fail "${args}: recording"
+    "${BGPQ4}" -y "${TMP}/rec" ${args} > "${TMP}/y" ||
+        fail "${args}: replay"
+    "${BGPQ4}" -y "${TMP}/rec" -V 3 ${args} > "${TMP}/v" ||
+        fail "${args}: printing in threads"
+
+    for f in i t x y v
+    do
+        cmp -s "${TMP}/a" "${TMP}/${f}" || fail "${args}: ${f} differs"
+    done
+done
+
+# -i prints the entries as they come, in another order: sorted, without
+# the separating commas, they are those of the list printed at the end.
+entries() {
+    grep prefix | sed 's/,$//' | sort
+}
+for args in "-j AS-MOCK0 AS-MOCK1" "-6 -j AS-MOCK1" "-T -j AS-MOCK0"
+do
+    "${BGPQ4}" -h 127.0.0.1:${I} ${args} | entries > "${TMP}/a" ||
+        fail "${args}"
+    "${BGPQ4}" -h 127.0.0.1:${I} -i ${args} | entries > "${TMP}/i" ||
+        fail "-i ${args}"
+    [ -s "${TMP}/a" ] || fail "${args}: no entries"
+    cmp -s "${TMP}/a" "${TMP}/i" || fail "-i ${args}: entries differ"
+done
+
+# SOURCE::AS-SET objects: each set is queried after the !s of its own
+# sources, and no !s repeats the sources the connection has already. The
+# pipelined queries switch sources once per set of sources.
+sources() {
+    awk '/^!s/ && $0 != "!s-lc" { if ($0 == src) dup++; src = $0; n++ }
+        /^!iAS-MOCK[0-9]+$/ { print substr(src, 3), substr($0, 3) }
+        END { print "switches", n, dup + 0 }' "${1}" | sort
+}
+printf "RADB AS-MOCK0\nRADB AS-MOCK2\nRIPE AS-MOCK0\nRIPE AS-MOCK1\n" \
+    > "${TMP}/expect"
+"${BGPQ4}" -h 127.0.0.1:${I} AS-MOCK0 AS-MOCK1 AS-MOCK2 > "${TMP}/a" ||
+    fail "SOURCE::AS-SET: reference"
+for t in "" -T
+do
+    "${BGPQ4}" -h 127.0.0.1:${I} ${t} -O "${TMP}/rec" RADB::AS-MOCK0 \
+        RIPE::AS-MOCK1 RADB::AS-MOCK2 RIPE::AS-MOCK0 > "${TMP}/s" ||
+        fail "SOURCE::AS-SET ${t}"
+    cmp -s "${TMP}/a" "${TMP}/s" || fail "SOURCE::AS-SET ${t}: output differs"
+    sources "${TMP}/rec" > "${TMP}/q"
+    grep -v "^switches" "${TMP}/q" | cmp -s "${TMP}/expect" - ||
+        fail "SOURCE::AS-SET ${t}: queried under the wrong sources"
+    grep -q "^switches [0-9]* 0$" "${TMP}/q" ||
+        fail "SOURCE::AS-SET ${t}: !s repeated"
+    [ -n "${t}" ] || grep -q "^switches 3 0$" "${TMP}/q" ||
+        fail "SOURCE::AS-SET: queries not grouped by sources"
+done
+
+# The library, over its own connection and over one handed to it.
+for port in ${A} ${I}
+do
+    "${BGPQ4}" -h 127.0.0.1:${port} AS-MOCK0 AS-MOCK2-4 > "${TMP}/a" ||
+        fail "libbgpq4: reference"
+    "${LIB}" ${port} AS-MOCK0 AS-MOCK2-4 > "${TMP}/l" || fail "libbgpq4"
+    cmp -s "${TMP}/a" "${TMP}/l" || fail "libbgpq4: output differs"
+done
+
+# A snapshot renders what the run collected, and refuses the other lists:
+# with !a, a prefix-list run has no AS numbers.
+"${BGPQ4}" -h 127.0.0.1:${A} -C "${TMP}/snap" AS-MOCK1 > "${TMP}/a" ||
+    fail "-C"
+"${BGPQ4}" -c "${TMP}/snap" > "${TMP}/c" || fail "-c"
+cmp -s "${TMP}/a" "${TMP}/c" || fail "-c: output differs"
+"${BGPQ4}" -c "${TMP}/snap" -f 1 > /dev/null 2>&1 &&
+    fail "-c: as-path from a !a snapshot"
+"${BGPQ4}" -h 127.0.0.1:${A} -C "${TMP}/snap" -f 1 AS-MOCK1 > /dev/null ||
+    fail "-C -f"
+"${BGPQ4}" -c "${TMP}/snap" > /dev/null 2>&1 &&
+    fail "-c: prefix-list from an as-path snapshot"
+
+# -I against the snapshot of other objects: the entries only the new run
+# has are added, then the ones only the snapshot has are removed.
+"${BGPQ4}" -h 127.0.0.1:${I} -C "${TMP}/snap" AS-MOCK0 AS-MOCK1 |
+    grep permit > "${TMP}/old" || fail "-I: old list"
+"${BGPQ4}" -h 127.0.0.1:${I} AS-MOCK1 AS-MOCK2 |
+    grep permit > "${TMP}/new" || fail "-I: new list"
+grep -vxF -f "${TMP}/old" "${TMP}/new" > "${TMP}/expect"
+grep -vxF -f "${TMP}/new" "${TMP}/old" | sed 's/^/no /' >> "${TMP}/expect"
+grep -q "^no " "${TMP}/expect" && grep -q "^ip " "${TMP}/expect" ||
+    fail "-I: the lists don't differ both ways"
+"${BGPQ4}" -h 127.0.0.1:${I} -I "${TMP}/snap" AS-MOCK1 AS-MOCK2 \
+    > "${TMP}/d" || fail "-I"
+cmp -s "${TMP}/expect" "${TMP}/d" || fail "-I: Cisco output differs"
+awk '{ print ($1 == "no" ? "delete" : "set") \
+    " policy-options prefix-list NN " $NF }' "${TMP}/expect" > "${TMP}/jexpect"
+"${BGPQ4}" -h 127.0.0.1:${I} -I "${TMP}/snap" -J AS-MOCK1 AS-MOCK2 \
+    > "${TMP}/d" || fail "-I -J"
+cmp -s "${TMP}/jexpect" "${TMP}/d" || fail "-I: Juniper output differs"
+
+# The daemon answers as a direct run, the second time from its cache
+# unless the request reads a file, and refuses the options that write
+# files or start daemons.
+"${BGPQ4}" -d -h 127.0.0.1:${A} -k "${TMP}/sock" 2> "${TMP}/daemon" &
+PIDS="${PIDS} $!"
+while [ ! -S "${TMP}/sock" ]
+do
+    kill -0 $! 2>/dev/null || fail "-k did not start"
+    sleep 0.1
+done
+ls -l "${TMP}/sock" | grep -q "^srw------- " || fail "-k: socket mode"
+"${BGPQ4}" -h 127.0.0.1:${A} -J AS-MOCK1 > "${TMP}/a" || fail "-k: reference"
+for n in 1 2
+do
+    "${BGPQ4}" -x "${TMP}/sock" -J AS-MOCK1 > "${TMP}/k" || fail "-x ${n}"
+    cmp -s "${TMP}/a" "${TMP}/k" || fail "-x ${n}: output differs"
+done
+grep -q "cached response" "${TMP}/daemon" || fail "-x: not cached"
+"${BGPQ4}" -h 127.0.0.1:${A} -J AS-MOCK1 -l "" > "${TMP}/a" ||
+    fail "-x: empty argument reference"
+"${BGPQ4}" -x "${TMP}/sock" -J AS-MOCK1 -l "" > "${TMP}/k" ||
+    fail "-x: empty argument"
+cmp -s "${TMP}/a" "${TMP}/k" || fail "-x: empty last argument lost"
+for obj in AS-MOCK1 AS-MOCK2
+do
+    "${BGPQ4}" -h 127.0.0.1:${A} -C "${TMP}/d.snap" ${obj} > "${TMP}/a" ||
+        fail "-x -c: ${obj} snapshot"
+    "${BGPQ4}" -x "${TMP}/sock" -c "${TMP}/d.snap" > "${TMP}/k" ||
+        fail "-x -c: ${obj}"
+    cmp -s "${TMP}/a" "${TMP}/k" || fail "-x -c: stale ${obj} response"
+done
+for args in "-C ${TMP}/x.snap" "-k ${TMP}/sock2" "-AZ ${TMP}/x.json"
+do
+    "${BGPQ4}" -x "${TMP}/sock" ${args} AS-MOCK1 > /dev/null 2>&1 &&
+        fail "-x ${args}: not refused"
+done
+[ -e "${TMP}/x.snap" ] || [ -e "${TMP}/sock2" ] || [ -e "${TMP}/x.json" ] &&
+    fail "-x: a refused request left a file"
+
+# Several servers, one of them closing the connection every 4 queries or,
+# with -Q, stalling: the output is that of the healthy server alone.
+"${BGPQ4}" -h 127.0.0.1:${I} AS-MOCK0 AS-MOCK1 > "${TMP}/a" ||
+    fail "-h a,b: reference"
+for args in "${I} ${X}" "${X} ${I}" "${I} ${X} -Q" "${X} ${I} -Q" \
+    "${I} ${W} -Q" "${W} ${I} -Q"
+do
+    set -- ${args}
+    "${BGPQ4}" -h 127.0.0.1:$1,127.0.0.1:$2 $3 AS-MOCK0 AS-MOCK1 \
+        > "${TMP}/h" 2>/dev/null || fail "-h $1,$2 $3"
+    cmp -s "${TMP}/a" "${TMP}/h" || fail "-h $1,$2 $3: output differs"
+done
+
+# A server that stops answering: -q retries the query on a new connection
+# or goes on without it, and says so with exit status 2.
+"${BGPQ4}" -h 127.0.0.1:${A} AS-MOCK1 > "${TMP}/a" || fail "-q: reference"
+for t in "" -T
+do
+    "${BGPQ4}" -h 127.0.0.1:${W} ${t} -q query=1,expire=retry AS-MOCK1 \
+        > "${TMP}/w" 2>/dev/null || fail "-q retry ${t}"
+    cmp -s "${TMP}/a" "${TMP}/w" || fail "-q retry ${t}: output differs"
+    "${BGPQ4}" -h 127.0.0.1:${W} ${t} -q query=1,expire=partial AS-MOCK1 \
+        > "${TMP}/w" 2>/dev/null
+    [ $? -eq 2 ] || fail "-q partial ${t}: exit status"
+done
+
+echo "mock IRRd tests passed"
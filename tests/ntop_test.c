@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Round-trip check of the address formatters in sx_prefix.c against the
+ * system inet_ntop(3).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sx_prefix.h"
+
+int debug_expander = 0;
+
+static const char *vectors[] = {
+	"::", "::1", "1::", "2001:db8::", "2001:db8::1", "::ffff:192.0.2.1",
+	"2001:db8:0:1:1:1:1:1", "2001:0:0:1:0:0:0:1", "2001:db8:0:0:1:0:0:1",
+	"fe80::1:0:0:0", "0:0:1::", "1:0:0:2:0:0:0:3", "ffff::ffff:0:0",
+	NULL
+};
+
+static uint64_t rstate = 0x9e3779b97f4a7c15ULL;
+
+static uint32_t
+rnd(void)
+{
+	rstate ^= rstate << 13;
+	rstate ^= rstate >> 7;
+	rstate ^= rstate << 17;
+
+	return rstate >> 32;
+}
+
+static void
+rnd_addr6(struct in6_addr *a)
+{
+	unsigned char	*o = (unsigned char *)a;
+	uint32_t	 r;
+	int		 i;
+
+	/* favour zero groups, so that every compression case shows up */
+	for (i = 0; i < 8; i++) {
+		r = rnd();
+		switch (r & 3) {
+		case 0:
+		case 1:
+			o[2 * i] = o[2 * i + 1] = 0;
+			break;
+		case 2:
+			o[2 * i] = 0;
+			o[2 * i + 1] = r >> 8;
+			break;
+		default:
+			o[2 * i] = r >> 8;
+			o[2 * i + 1] = r >> 16;
+			break;
+		}
+	}
+}
+
+static int
+compat_form(const struct in6_addr *a)
+{
+	const unsigned char	*o = (const unsigned char *)a;
+	int			 i;
+
+	/* libcs disagree on deprecated IPv4-compatible addresses */
+	for (i = 0; i < 12; i++)
+		if (o[i])
+			return 0;
+
+	return o[12] || o[13];
+}
+
+static int
+check6(const struct in6_addr *a)
+{
+	char			 ref[INET6_ADDRSTRLEN], got[INET6_ADDRSTRLEN];
+	char			 pref[128], pgot[128];
+	struct sx_prefix	 p;
+	int			 len;
+
+	inet_ntop(AF_INET6, a, ref, sizeof(ref));
+	len = sx_inet_ntop6(a, got);
+
+	if (strcmp(ref, got) || len != (int)strlen(ref)) {
+		printf("FAILED: inet_ntop %s, sx_inet_ntop6 %s (%i)\n", ref,
+		    got, len);
+		return 1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.family = AF_INET6;
+	p.masklen = rnd() % 129;
+	memcpy(&p.addr.addr6, a, sizeof(*a));
+
+	snprintf(pref, sizeof(pref), "%s/%u", ref, p.masklen);
+	len = sx_prefix_snprintf(&p, pgot, sizeof(pgot));
+	if (strcmp(pref, pgot) || len != (int)strlen(pref)) {
+		printf("FAILED: prefix %s, sx_prefix_snprintf %s\n", pref,
+		    pgot);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+check4(const struct in_addr *a)
+{
+	char			 ref[INET_ADDRSTRLEN], got[INET_ADDRSTRLEN];
+	char			 pref[128], pgot[128];
+	struct sx_prefix	 p;
+	int			 len;
+
+	inet_ntop(AF_INET, a, ref, sizeof(ref));
+	len = sx_inet_ntop4(a, got);
+
+	if (strcmp(ref, got) || len != (int)strlen(ref)) {
+		printf("FAILED: inet_ntop %s, sx_inet_ntop4 %s (%i)\n", ref,
+		    got, len);
+		return 1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.family = AF_INET;
+	p.masklen = rnd() % 33;
+	p.addr.addr = *a;
+
+	snprintf(pref, sizeof(pref), "%s\\/%u", ref, p.masklen);
+	len = sx_prefix_jsnprintf(&p, pgot, sizeof(pgot));
+	if (strcmp(pref, pgot) || len != (int)strlen(pref)) {
+		printf("FAILED: prefix %s, sx_prefix_jsnprintf %s\n", pref,
+		    pgot);
+		return 1;
+	}
+
+	/* short buffers must truncate like snprintf does */
+	len = sx_prefix_snprintf(&p, pgot, 8);
+	snprintf(pref, 8, "%s/%u", ref, p.masklen);
+	if (strcmp(pref, pgot)) {
+		printf("FAILED: truncated %s, got %s\n", pref, pgot);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct in6_addr	 a6;
+	struct in_addr	 a4;
+	unsigned long	 i, n = 1000000, failed = 0;
+	const char	**v;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+
+	for (v = vectors; *v; v++) {
+		if (inet_pton(AF_INET6, *v, &a6) != 1) {
+			printf("FAILED: unable to parse vector %s\n", *v);
+			failed++;
+			continue;
+		}
+		failed += check6(&a6);
+	}
+
+	for (i = 0; i < n; i++) {
+		rnd_addr6(&a6);
+		if (!compat_form(&a6))
+			failed += check6(&a6);
+
+		a4.s_addr = rnd();
+		if (i & 1)
+			a4.s_addr &= htonl(0xff00ff00);
+		failed += check4(&a4);
+
+		if (failed > 10)
+			break;
+	}
+
+	if (failed) {
+		printf("ntop_test: %lu failures\n", failed);
+		return 1;
+	}
+
+	printf("ntop_test: %lu IPv4 and IPv6 addresses OK\n", n);
+
+	return 0;
+}
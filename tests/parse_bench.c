@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Micro-benchmark of sx_prefix_parse() against the strlcpy/strtol/
+ * inet_pton sequence it used to run for every prefix. The corpus mimics
+ * a large !gas/!6as reply: a million prefixes with a DFZ-like masklen
+ * mix, three in four of them IPv4, split in place the way bgpq_read()
+ * splits the receive buffer.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sx_prefix.h"
+
+int debug_expander = 0;
+
+static const unsigned int v4lens[] = {
+	24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+	23, 23, 22, 22, 22, 21, 20, 19, 16, 18
+};
+static const unsigned int v6lens[] = {
+	48, 48, 48, 48, 48, 48, 48, 48, 48, 48, 32, 32, 32,
+	44, 44, 40, 40, 36, 29, 46, 56, 64
+};
+
+static uint64_t rstate = 0x2545f4914f6cdd1dULL;
+
+static uint32_t
+rnd(void)
+{
+	rstate ^= rstate << 13;
+	rstate ^= rstate >> 7;
+	rstate ^= rstate << 17;
+
+	return rstate >> 32;
+}
+
+static char *
+corpus_new(unsigned long n, char ***tokens)
+{
+	struct sx_prefix	 p;
+	char			*buf, *c;
+	unsigned long		 i;
+	uint32_t		 r;
+
+	if ((buf = malloc(n * 48)) == NULL)
+		err(1, NULL);
+	if ((*tokens = calloc(n, sizeof(char *))) == NULL)
+		err(1, NULL);
+
+	for (i = 0, c = buf; i < n; i++) {
+		memset(&p, 0, sizeof(p));
+		r = rnd();
+		if (r % 4) {
+			p.family = AF_INET;
+			p.masklen = v4lens[r % (sizeof(v4lens) /
+			    sizeof(v4lens[0]))];
+			p.addr.addr.s_addr = htonl(0x01000000 +
+			    rnd() % 0xdf000000);
+		} else {
+			p.family = AF_INET6;
+			p.masklen = v6lens[r % (sizeof(v6lens) /
+			    sizeof(v6lens[0]))];
+			p.addr.addrs[0] = 0x20 + (r >> 8) % 12;
+			p.addr.addrs[1] = rnd();
+			p.addr.addrs[2] = rnd();
+			p.addr.addrs[3] = rnd();
+			p.addr.addrs[4] = rnd();
+			p.addr.addrs[5] = rnd();
+			p.addr.addrs[6] = rnd();
+			p.addr.addrs[7] = rnd();
+		}
+		sx_prefix_adjust_masklen(&p);
+
+		(*tokens)[i] = c;
+		c += sx_prefix_snprintf(&p, c, 48) + 1;
+	}
+
+	return buf;
+}
+
+/* what sx_prefix_parse() did before the fast path */
+static int
+legacy_parse(struct sx_prefix *p, char *text)
+{
+	char	 mtext[INET6_ADDRSTRLEN + 5], *c;
+	int	 masklen = -1, af;
+
+	strlcpy(mtext, text, sizeof(mtext));
+
+	if ((c = strchr(mtext, '/')) != NULL) {
+		*c = 0;
+		masklen = strtol(c + 1, NULL, 10);
+	}
+
+	af = strchr(mtext, ':') ? AF_INET6 : AF_INET;
+
+	if (inet_pton(af, mtext, &p->addr) != 1)
+		return 0;
+
+	p->family = af;
+	p->masklen = masklen == -1 ? (af == AF_INET ? 32 : 128) : masklen;
+	sx_prefix_adjust_masklen(p);
+
+	return 1;
+}
+
+static double
+now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sx_prefix	*fast, *slow;
+	char			*buf, **tokens;
+	unsigned long		 i, n = 1000000, bad = 0;
+	double			 t, tfast = 1e9, tslow = 1e9;
+	int			 round;
+
+	if (argc > 1)
+		n = strtoul(argv[1], NULL, 10);
+
+	buf = corpus_new(n, &tokens);
+
+	if ((fast = calloc(n, sizeof(*fast))) == NULL ||
+	    (slow = calloc(n, sizeof(*slow))) == NULL)
+		err(1, NULL);
+
+	for (round = 0; round < 5; round++) {
+		t = now();
+		for (i = 0; i < n; i++)
+			legacy_parse(slow + i, tokens[i]);
+		if (now() - t < tslow)
+			tslow = now() - t;
+
+		t = now();
+		for (i = 0; i < n; i++)
+			sx_prefix_parse(fast + i, 0, tokens[i]);
+		if (now() - t < tfast)
+			tfast = now() - t;
+	}
+
+	for (i = 0; i < n; i++) {
+		unsigned int nbytes = fast[i].family == AF_INET ? 4 : 16;
+
+		if (fast[i].family != slow[i].family ||
+		    fast[i].masklen != slow[i].masklen ||
+		    memcmp(fast[i].addr.addrs, slow[i].addr.addrs, nbytes)) {
+			if (bad++ < 10)
+				printf("MISMATCH: %s\n", tokens[i]);
+		}
+	}
+
+	printf("parse_bench: %lu prefixes\n", n);
+	printf("  strlcpy/strtol/inet_pton: %8.1f ms, %6.1f ns/prefix\n",
+	    tslow * 1e3, tslow * 1e9 / n);
+	printf("  sx_prefix_parse:          %8.1f ms, %6.1f ns/prefix\n",
+	    tfast * 1e3, tfast * 1e9 / n);
+	printf("  speedup:                  %8.2fx\n", tslow / tfast);
+
+	free(fast);
+	free(slow);
+	free(tokens);
+	free(buf);
+
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2026 The bgpq4 contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Refine (-R, -r) and aggregate (-A) a fixed set of prefixes and check
+ * the entries the printers would see against the expected ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+#include "sx_prefix.h"
+
+static const char *prefixes4[] = {
+	"10.0.0.0/24", "10.0.1.0/24", "10.0.2.0/23", "10.0.2.0/24",
+	"192.0.2.0/25", "192.0.2.128/25", "198.51.100.0/22",
+	"198.51.100.0/30", NULL
+};
+
+static const char *prefixes6[] = {
+	"2001:db8::/32", "2001:db8:1::/48", "2001:db8:2::/47",
+	"2001:db8:8000::/33", NULL
+};
+
+struct refine_case {
+	const char	 *name;
+	int		  af;
+	unsigned int	  refine;	/* -R */
+	unsigned int	  refineLow;	/* -r */
+	int		  aggregate;	/* -A */
+	const char	**expect;
+};
+
+/* the prefixes as inserted */
+static const char *plain4[] = {
+	"10.0.0.0/24", "10.0.1.0/24", "10.0.2.0/23", "10.0.2.0/24",
+	"192.0.2.0/25", "192.0.2.128/25", "198.51.100.0/22", "198.51.100.0/30",
+	NULL
+};
+
+/* -R: every prefix up to /25, /30 is longer and stays */
+static const char *refine4[] = {
+	"10.0.0.0/24 24-25", "10.0.1.0/24 24-25", "10.0.2.0/23 23-25",
+	"192.0.2.0/25", "192.0.2.128/25", "198.51.100.0/22 22-25",
+	"198.51.100.0/30", NULL
+};
+
+/* -r: more specifics only, 10.0.2.0/24 is in 10.0.2.0/23 */
+static const char *refinelow4[] = {
+	"10.0.0.0/24 25-32", "10.0.1.0/24 25-32", "10.0.2.0/23 25-32",
+	"192.0.2.0/25 25-32", "192.0.2.128/25 25-32", "198.51.100.0/22 25-32",
+	"198.51.100.0/30", NULL
+};
+
+static const char *range4[] = {
+	"10.0.0.0/24 25-26", "10.0.1.0/24 25-26", "10.0.2.0/23 25-26",
+	"192.0.2.0/25 25-26", "192.0.2.128/25 25-26", "198.51.100.0/22 25-26",
+	"198.51.100.0/30", NULL
+};
+
+/* -A: the /24s and /25s that fill their parent merge */
+static const char *agg4[] = {
+	"10.0.0.0/23 24-24", "10.0.2.0/23", "10.0.2.0/24",
+	"192.0.2.0/24 25-25", "198.51.100.0/22", "198.51.100.0/30", NULL
+};
+
+static const char *aggrefine4[] = {
+	"10.0.0.0/23 24-25", "10.0.2.0/23 23-25", "192.0.2.0/24 25-25",
+	"198.51.100.0/22 22-25", "198.51.100.0/30", NULL
+};
+
+/* the /23 and the /24s all end up in 10.0.0.0/22 25-28 */
+static const char *aggrange4[] = {
+	"10.0.0.0/22 25-28", "192.0.2.0/24 25-28", "198.51.100.0/22 25-28",
+	"198.51.100.0/30", NULL
+};
+
+static const char *range6[] = {
+	"2001:db8::/32 40-48", NULL
+};
+
+/* no IPv6 prefix fills its parent */
+static const char *agg6[] = {
+	"2001:db8::/32", "2001:db8:1::/48", "2001:db8:2::/47",
+	"2001:db8:8000::/33", NULL
+};
+
+static const char *aggrefine6[] = {
+	"2001:db8::/32 32-48", NULL
+};
+
+static const struct refine_case cases[] = {
+	{ "-4", AF_INET, 0, 0, 0, plain4 },
+	{ "-R 25", AF_INET, 25, 0, 0, refine4 },
+	{ "-r 25", AF_INET, 0, 25, 0, refinelow4 },
+	{ "-r 25 -R 26", AF_INET, 26, 25, 0, range4 },
+	{ "-A", AF_INET, 0, 0, 1, agg4 },
+	{ "-A -R 25", AF_INET, 25, 0, 1, aggrefine4 },
+	{ "-A -r 25 -R 28", AF_INET, 28, 25, 1, aggrange4 },
+	{ "-6 -R 48 -r 40", AF_INET6, 48, 40, 0, range6 },
+	{ "-6 -A", AF_INET6, 0, 0, 1, agg6 },
+	{ "-6 -A -R 48", AF_INET6, 48, 0, 1, aggrefine6 },
+};
+
+struct collect {
+	char	buf[4096];
+	size_t	len;
+};
+
+static void
+collect_entry(struct sx_radix_node *n, void *arg)
+{
+	struct collect	*c = arg;
+	char		 prefix[128];
+
+	for (; n != NULL; n = n->son) {
+		if (n->isGlue)
+			continue;
+		sx_prefix_snprintf(n->prefix, prefix, sizeof(prefix));
+		if (n->isAggregate)
+			c->len += snprintf(c->buf + c->len,
+			    sizeof(c->buf) - c->len, "%s %u-%u\n", prefix,
+			    n->aggregateLow, n->aggregateHi);
+		else
+			c->len += snprintf(c->buf + c->len,
+			    sizeof(c->buf) - c->len, "%s\n", prefix);
+	}
+}
+
+static int
+check(const struct refine_case *rc)
+{
+	struct sx_radix_tree	*tree;
+	struct sx_prefix	*p;
+	struct collect		 got, want;
+	const char		**s;
+	int			 failed = 1;
+
+	if ((tree = sx_radix_tree_new(rc->af)) == NULL)
+		return 1;
+
+	for (s = rc->af == AF_INET ? prefixes4 : prefixes6; *s; s++) {
+		if ((p = sx_prefix_new(rc->af, (char *)*s)) == NULL) {
+			printf("FAILED: unable to parse %s\n", *s);
+			goto done;
+		}
+		if (sx_radix_tree_insert(tree, p) == NULL) {
+			sx_prefix_free(p);
+			goto done;
+		}
+		sx_prefix_free(p);
+	}
+
+	if (rc->aggregate) {
+		if (rc->refine || rc->refineLow)
+			sx_radix_tree_refine(tree, rc->refine, rc->refineLow,
+			    1);
+		else
+			sx_radix_tree_aggregate(tree);
+	} else if (rc->refine || rc->refineLow)
+		sx_radix_tree_refine(tree, rc->refine, rc->refineLow, 0);
+
+	memset(&got, 0, sizeof(got));
+	sx_radix_tree_foreach_refined(tree, collect_entry, &got);
+
+	memset(&want, 0, sizeof(want));
+	for (s = rc->expect; *s; s++)
+		want.len += snprintf(want.buf + want.len,
+		    sizeof(want.buf) - want.len, "%s\n", *s);
+
+	if (strcmp(got.buf, want.buf)) {
+		printf("FAILED: %s, expected:\n%sgot:\n%s", rc->name,
+		    want.buf, got.buf);
+		goto done;
+	}
+
+	failed = 0;
+
+done:
+	sx_radix_tree_freeall(tree);
+	return failed;
+}
+
+int
+main(void)
+{
+	size_t	i, failed = 0;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		failed += check(&cases[i]);
+
+	if (failed) {
+		printf("refine_test: %zu failures\n", failed);
+		return 1;
+	}
+
+	printf("refine_test: %zu cases OK\n", i);
+
+	return 0;
+}